@@ -0,0 +1,585 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#ifndef HIC_SLICE_NO_WRITER
+#include <iostream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#endif
+#include "zlib.h"
+#include "hic_slice.h"
+
+using namespace std;
+
+#ifndef HIC_SLICE_NO_WRITER
+
+// one complete gzip member holding the bytes
+static string compressGzipMember(const string &data, int32_t compressionLevel) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 16: largest window, gzip wrapper
+    if (deflateInit2(&stream, compressionLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return string();
+    }
+    string member(deflateBound(&stream, static_cast<uLong>(data.size())), '\0');
+    stream.next_in = (Bytef *) data.data();
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = (Bytef *) &member[0];
+    stream.avail_out = static_cast<uInt>(member.size());
+    deflate(&stream, Z_FINISH);
+    member.resize(stream.total_out);
+    deflateEnd(&stream);
+    return member;
+}
+
+HicSliceWriter::HicSliceWriter(const string &path, int32_t compressionLevel, int32_t numThreads, size_t chunkSize,
+                               int64_t appendAt)
+        : compressionLevel(max(0, min(compressionLevel, 9))), chunkSize(max<size_t>(chunkSize, 1)) {
+    if (numThreads <= 0) {
+        numThreads = static_cast<int32_t>(max(1u, thread::hardware_concurrency()));
+    }
+    maxInFlight = 2 * static_cast<size_t>(numThreads);
+    if (appendAt < 0) {
+        out = fopen(path.c_str(), "wb");
+    } else {
+        out = fopen(path.c_str(), "r+b");
+#ifdef _WIN32
+        bool truncated = out != nullptr && _chsize_s(_fileno(out), appendAt) == 0 && _fseeki64(out, appendAt, SEEK_SET) == 0;
+#else
+        bool truncated = out != nullptr && ftruncate(fileno(out), appendAt) == 0 && fseeko(out, appendAt, SEEK_SET) == 0;
+#endif
+        if (!truncated && out != nullptr) {
+            fclose(out);
+            out = nullptr;
+        }
+        bytesWritten = appendAt;
+    }
+    buffer.reserve(this->chunkSize);
+}
+
+HicSliceWriter::~HicSliceWriter() {
+    close();
+}
+
+void HicSliceWriter::write(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        size_t n = min(size, chunkSize - buffer.size());
+        buffer.append(bytes, n);
+        bytes += n;
+        size -= n;
+        if (buffer.size() == chunkSize) {
+            flushChunk();
+        }
+    }
+}
+
+// hands the buffered bytes to a compression task, first writing out the oldest members if too many are pending
+void HicSliceWriter::flushChunk() {
+    if (buffer.empty()) {
+        return;
+    }
+    while (pending.size() >= maxInFlight) {
+        writeOldestMember();
+    }
+    auto level = compressionLevel;
+    string chunk;
+    chunk.swap(buffer);
+    buffer.reserve(chunkSize);
+    numMembers++;
+    pending.push_back(async(launch::async, [level](string data) {
+        return compressGzipMember(data, level);
+    }, move(chunk)));
+}
+
+void HicSliceWriter::writeOldestMember() {
+    string member = pending.front().get();
+    pending.pop_front();
+    memberOffsets.push_back(bytesWritten);
+    if (out != nullptr && fwrite(member.data(), 1, member.size(), out) != member.size()) {
+        cerr << "Error writing compressed output" << endl;
+    }
+    bytesWritten += static_cast<int64_t>(member.size());
+}
+
+size_t HicSliceWriter::endMember() {
+    flushChunk();
+    return numMembers;
+}
+
+void HicSliceWriter::flush() {
+    flushChunk();
+    while (!pending.empty()) {
+        writeOldestMember();
+    }
+}
+
+void HicSliceWriter::syncFile() {
+    if (out != nullptr) {
+        fflush(out);
+    }
+}
+
+int64_t HicSliceWriter::getMemberOffset(size_t i) const {
+    return i < memberOffsets.size() ? memberOffsets[i] : bytesWritten;
+}
+
+void HicSliceWriter::writeTrailer(int64_t indexOffset) {
+    flush();
+    // gzip header with FEXTRA set and one 12 byte "HS" subfield holding the offset, then an empty final deflate
+    // block, CRC32 and size (both 0), as in the end of file marker of BGZF
+    unsigned char trailer[HICSLICE_TRAILER_SIZE] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 12, 0, 'H', 'S', 8, 0};
+    for (int32_t i = 0; i < 8; i++) {
+        trailer[16 + i] = static_cast<unsigned char>((static_cast<uint64_t>(indexOffset) >> (8 * i)) & 0xff);
+    }
+    trailer[24] = 3;
+    trailer[25] = 0;
+    if (out != nullptr && fwrite(trailer, 1, sizeof(trailer), out) != sizeof(trailer)) {
+        cerr << "Error writing compressed output" << endl;
+    }
+    bytesWritten += sizeof(trailer);
+}
+
+void HicSliceWriter::close() {
+    flush();
+    if (out != nullptr) {
+        fclose(out);
+        out = nullptr;
+    }
+}
+
+static void appendVarint(uint64_t value, string &out) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+void encodeHicSliceChunk(const vector<CompressedContactRecord> &records, string &out) {
+    int16_t chr1Key = records.empty() ? 0 : records[0].chr1Key;
+    int16_t chr2Key = records.empty() ? 0 : records[0].chr2Key;
+    int32_t numRecords = static_cast<int32_t>(records.size());
+    HicSliceCountsEncoding encoding = HicSliceCountsEncoding::Varint;
+    for (const CompressedContactRecord &record : records) {
+        if (!(record.value >= 0 && record.value < 4294967296.0f && record.value == floor(record.value))) {
+            encoding = HicSliceCountsEncoding::Float;
+            break;
+        }
+    }
+    out.append((const char *) &chr1Key, sizeof(int16_t));
+    out.append((const char *) &chr2Key, sizeof(int16_t));
+    out.append((const char *) &numRecords, sizeof(int32_t));
+    out.push_back(static_cast<char>(encoding));
+    int32_t previous = 0;
+    for (const CompressedContactRecord &record : records) {
+        appendVarint(zigzag(static_cast<int64_t>(record.binX) - previous), out);
+        previous = record.binX;
+    }
+    previous = 0;
+    for (const CompressedContactRecord &record : records) {
+        appendVarint(zigzag(static_cast<int64_t>(record.binY) - previous), out);
+        previous = record.binY;
+    }
+    for (const CompressedContactRecord &record : records) {
+        if (encoding == HicSliceCountsEncoding::Varint) {
+            appendVarint(static_cast<uint64_t>(record.value), out);
+        } else {
+            out.append((const char *) &record.value, sizeof(float));
+        }
+    }
+}
+
+#endif // HIC_SLICE_NO_WRITER
+
+// reads a varint at position, moving it past; false if the data ends first
+static inline bool readVarint(const unsigned char *&position, const unsigned char *end, uint64_t &value) {
+    value = 0;
+    for (int32_t shift = 0; position < end && shift < 64; shift += 7) {
+        unsigned char byte = *position++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// appends the records of a version 3 chunk to the columns; false if the chunk is damaged
+static bool decodeHicSliceChunk(const string &data, HicSliceColumns &columns) {
+    const unsigned char *position = (const unsigned char *) data.data(), *end = position + data.size();
+    const size_t headerSize = 2 * sizeof(int16_t) + sizeof(int32_t) + 1;
+    if (data.size() < headerSize) {
+        return false;
+    }
+    int16_t chr1Key, chr2Key;
+    int32_t numRecords;
+    memcpy(&chr1Key, position, sizeof(int16_t));
+    memcpy(&chr2Key, position + 2, sizeof(int16_t));
+    memcpy(&numRecords, position + 4, sizeof(int32_t));
+    auto encoding = static_cast<HicSliceCountsEncoding>(position[8]);
+    position += headerSize;
+    if (numRecords < 0) {
+        return false;
+    }
+    size_t start = columns.size(), n = static_cast<size_t>(numRecords);
+    columns.chr1Key.resize(start + n, chr1Key);
+    columns.chr2Key.resize(start + n, chr2Key);
+    columns.binX.resize(start + n);
+    columns.binY.resize(start + n);
+    columns.counts.resize(start + n);
+    uint64_t value;
+    int64_t bin = 0;
+    for (size_t i = start; i < start + n; i++) {
+        if (!readVarint(position, end, value)) return false;
+        bin += unzigzag(value);
+        columns.binX[i] = static_cast<int32_t>(bin);
+    }
+    bin = 0;
+    for (size_t i = start; i < start + n; i++) {
+        if (!readVarint(position, end, value)) return false;
+        bin += unzigzag(value);
+        columns.binY[i] = static_cast<int32_t>(bin);
+    }
+    if (encoding == HicSliceCountsEncoding::Varint) {
+        for (size_t i = start; i < start + n; i++) {
+            if (!readVarint(position, end, value)) return false;
+            columns.counts[i] = static_cast<float>(value);
+        }
+    } else if (encoding == HicSliceCountsEncoding::Float && static_cast<size_t>(end - position) >= n * sizeof(float)) {
+        memcpy(&columns.counts[start], position, n * sizeof(float));
+        position += n * sizeof(float);
+    } else {
+        return false;
+    }
+    return position == end;
+}
+
+// records per batch when reading a version 1 file
+static const size_t RECORDS_PER_BATCH = 1 << 16;
+// batches the reader thread may get ahead of readBatch
+static const size_t MAX_QUEUED_BATCHES = 4;
+
+void HicSliceColumns::clear() {
+    chr1Key.clear();
+    binX.clear();
+    chr2Key.clear();
+    binY.clear();
+    counts.clear();
+}
+
+void HicSliceColumns::append(const HicSliceColumns &other) {
+    chr1Key.insert(chr1Key.end(), other.chr1Key.begin(), other.chr1Key.end());
+    binX.insert(binX.end(), other.binX.begin(), other.binX.end());
+    chr2Key.insert(chr2Key.end(), other.chr2Key.begin(), other.chr2Key.end());
+    binY.insert(binY.end(), other.binY.begin(), other.binY.end());
+    counts.insert(counts.end(), other.counts.begin(), other.counts.end());
+}
+
+// the bytes of one or more concatenated gzip members
+static bool inflateGzipMembers(const char *data, size_t size, string &out) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+        return false;
+    }
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = static_cast<uInt>(size);
+    char buffer[1 << 16];
+    int status = Z_OK;
+    while (status != Z_STREAM_END || stream.avail_in > 0) {
+        if (status == Z_STREAM_END) {
+            inflateReset(&stream);
+        }
+        stream.next_out = (Bytef *) buffer;
+        stream.avail_out = sizeof(buffer);
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            break;
+        }
+        out.append(buffer, sizeof(buffer) - stream.avail_out);
+        if (status == Z_OK && stream.avail_in == 0 && stream.avail_out > 0) {
+            status = Z_DATA_ERROR; // truncated
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+// parses n raw CompressedContactRecords into the columns, keeping those of the pair when filtered
+static void appendRecords(const char *data, size_t n, bool filtered, int16_t chr1Key, int16_t chr2Key,
+                          HicSliceColumns &columns) {
+    size_t start = columns.size();
+    columns.chr1Key.resize(start + n);
+    columns.binX.resize(start + n);
+    columns.chr2Key.resize(start + n);
+    columns.binY.resize(start + n);
+    columns.counts.resize(start + n);
+    size_t kept = start;
+    for (size_t i = 0; i < n; i++) {
+        const char *record = data + i * sizeof(CompressedContactRecord);
+        memcpy(&columns.chr1Key[kept], record + offsetof(CompressedContactRecord, chr1Key), sizeof(int16_t));
+        memcpy(&columns.chr2Key[kept], record + offsetof(CompressedContactRecord, chr2Key), sizeof(int16_t));
+        if (filtered && (columns.chr1Key[kept] != chr1Key || columns.chr2Key[kept] != chr2Key)) continue;
+        memcpy(&columns.binX[kept], record + offsetof(CompressedContactRecord, binX), sizeof(int32_t));
+        memcpy(&columns.binY[kept], record + offsetof(CompressedContactRecord, binY), sizeof(int32_t));
+        memcpy(&columns.counts[kept], record + offsetof(CompressedContactRecord, value), sizeof(float));
+        kept++;
+    }
+    columns.chr1Key.resize(kept);
+    columns.binX.resize(kept);
+    columns.chr2Key.resize(kept);
+    columns.binY.resize(kept);
+    columns.counts.resize(kept);
+}
+
+template <typename T>
+static bool readValue(gzFile file, T &value) {
+    return gzread(file, &value, sizeof(T)) == sizeof(T);
+}
+
+HicSliceReader::HicSliceReader(const string &path, const string &chr1, const string &chr2) : path(path) {
+    if (!readHeader()) {
+        error = path + " is not a readable slice file";
+        return;
+    }
+    if (header.version >= 2 && !readIndex()) {
+        error = "the chunk index of " + path + " is missing or damaged";
+        return;
+    }
+    if (!chr1.empty() || !chr2.empty()) {
+        filtered = true;
+        auto key1 = header.chromosomeKeys.find(chr1);
+        auto key2 = header.chromosomeKeys.find(chr2);
+        if (key1 == header.chromosomeKeys.end() || key2 == header.chromosomeKeys.end()) {
+            error = "chromosome pair " + chr1 + "-" + chr2 + " is not in " + path;
+            return;
+        }
+        // pairs are stored with the lower key first
+        filterChr1Key = min(key1->second, key2->second);
+        filterChr2Key = max(key1->second, key2->second);
+    }
+    open = true;
+    worker = thread(&HicSliceReader::readRecords, this);
+}
+
+HicSliceReader::~HicSliceReader() {
+    {
+        lock_guard<mutex> lock(batchMutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+// the header is the start of the decompressed stream in every version
+bool HicSliceReader::readHeader() {
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    string magic(HICSLICE_MAGIC.length(), '\0');
+    bool ok = gzread(file, &magic[0], static_cast<unsigned>(magic.length())) == static_cast<int>(magic.length());
+    header.version = magic == HICSLICE_V3_MAGIC ? 3 : magic == HICSLICE_V2_MAGIC ? 2 : 1;
+    ok = ok && (magic == HICSLICE_MAGIC || magic == HICSLICE_V2_MAGIC || magic == HICSLICE_V3_MAGIC);
+    ok = ok && readValue(file, header.resolution) && readValue(file, header.numChromosomes);
+    for (int32_t i = 0; ok && i < header.numChromosomes; i++) {
+        int32_t nameLength;
+        int16_t key;
+        ok = readValue(file, nameLength) && nameLength >= 0;
+        string name(ok ? nameLength : 0, '\0');
+        ok = ok && gzread(file, &name[0], static_cast<unsigned>(nameLength)) == nameLength && readValue(file, key);
+        if (ok && key >= 0) {
+            header.chromosomeKeys[name] = key;
+            if (chromosomeNames.size() <= static_cast<size_t>(key)) {
+                chromosomeNames.resize(key + 1);
+            }
+            chromosomeNames[key] = name;
+        }
+    }
+    recordsOffset = gztell(file);
+    gzclose(file);
+    return ok;
+}
+
+// finds the index through the trailer and parses it
+bool HicSliceReader::readIndex() {
+    ifstream file(path, ios::binary);
+    unsigned char trailer[HICSLICE_TRAILER_SIZE];
+    file.seekg(-HICSLICE_TRAILER_SIZE, ios::end);
+    bool ok = file.read((char *) trailer, sizeof(trailer)) &&
+              trailer[0] == 0x1f && trailer[1] == 0x8b && trailer[12] == 'H' && trailer[13] == 'S';
+    int64_t fileSize = ok ? static_cast<int64_t>(file.tellg()) : 0;
+    uint64_t indexOffset = 0;
+    for (int32_t i = 7; ok && i >= 0; i--) {
+        indexOffset = (indexOffset << 8) | trailer[16 + i];
+    }
+    ok = ok && static_cast<int64_t>(indexOffset) < fileSize - HICSLICE_TRAILER_SIZE;
+    string compressed, data;
+    if (ok) {
+        compressed.resize(static_cast<size_t>(fileSize - HICSLICE_TRAILER_SIZE - static_cast<int64_t>(indexOffset)));
+        file.seekg(static_cast<streamoff>(indexOffset));
+        ok = file.read(&compressed[0], static_cast<streamsize>(compressed.size())) &&
+             inflateGzipMembers(compressed.data(), compressed.size(), data);
+    }
+    file.close();
+
+    const char *position = data.data(), *end = data.data() + data.size();
+    auto read = [&position, end](void *value, size_t size) {
+        if (position + size > end) return false;
+        memcpy(value, position, size);
+        position += size;
+        return true;
+    };
+    int32_t numChunks = 0;
+    ok = ok && read(&numChunks, sizeof(int32_t)) && numChunks >= 0;
+    for (int32_t i = 0; ok && i < numChunks; i++) {
+        HicSliceChunk chunk;
+        ok = read(&chunk.chr1Key, sizeof(int16_t)) && read(&chunk.chr2Key, sizeof(int16_t)) &&
+             read(&chunk.offset, sizeof(int64_t)) && read(&chunk.size, sizeof(int64_t)) &&
+             read(&chunk.numRecords, sizeof(int64_t)) && read(&chunk.binXStart, sizeof(int32_t)) &&
+             read(&chunk.binXEnd, sizeof(int32_t)) && read(&chunk.binYStart, sizeof(int32_t)) &&
+             read(&chunk.binYEnd, sizeof(int32_t));
+        if (ok) {
+            index.push_back(chunk);
+        }
+    }
+    return ok;
+}
+
+string HicSliceReader::getError() {
+    lock_guard<mutex> lock(batchMutex);
+    return error;
+}
+
+string HicSliceReader::getChromosomeName(int16_t key) const {
+    return key >= 0 && static_cast<size_t>(key) < chromosomeNames.size() ? chromosomeNames[key] : string();
+}
+
+// queues a parsed batch, waiting while the queue is full; false once the reader is being destroyed
+bool HicSliceReader::pushBatch(HicSliceColumns &batch) {
+    unique_lock<mutex> lock(batchMutex);
+    changed.wait(lock, [this]() { return stopping || batches.size() < MAX_QUEUED_BATCHES; });
+    if (stopping) {
+        return false;
+    }
+    batches.push_back(move(batch));
+    batch = HicSliceColumns();
+    changed.notify_all();
+    return true;
+}
+
+// the background thread: version 2 and 3 files are read chunk by chunk through the index, skipping the chunks of other
+// pairs; version 1 files are streamed and filtered record by record
+void HicSliceReader::readRecords() {
+    HicSliceColumns batch;
+    if (header.version >= 2) {
+        ifstream file(path, ios::binary);
+        string compressed, data;
+        for (const HicSliceChunk &chunk : index) {
+            if (filtered && (chunk.chr1Key != filterChr1Key || chunk.chr2Key != filterChr2Key)) continue;
+            compressed.resize(static_cast<size_t>(chunk.size));
+            data.clear();
+            file.seekg(static_cast<streamoff>(chunk.offset));
+            bool ok = file.read(&compressed[0], static_cast<streamsize>(compressed.size())) &&
+                      inflateGzipMembers(compressed.data(), compressed.size(), data);
+            if (ok && header.version == 3) {
+                ok = decodeHicSliceChunk(data, batch) && batch.size() == static_cast<size_t>(chunk.numRecords);
+            } else if (ok) {
+                ok = data.size() == static_cast<size_t>(chunk.numRecords) * sizeof(CompressedContactRecord);
+                if (ok) {
+                    appendRecords(data.data(), static_cast<size_t>(chunk.numRecords), false, 0, 0, batch);
+                }
+            }
+            if (!ok) {
+                lock_guard<mutex> lock(batchMutex);
+                error = "damaged chunk at offset " + to_string(chunk.offset) + " of " + path;
+                break;
+            }
+            if (!pushBatch(batch)) break;
+        }
+    } else {
+        gzFile file = gzopen(path.c_str(), "rb");
+        if (file != nullptr) {
+            gzbuffer(file, 1 << 20);
+            gzseek(file, recordsOffset, SEEK_SET);
+            vector<char> data(RECORDS_PER_BATCH * sizeof(CompressedContactRecord));
+            int bytesRead;
+            while ((bytesRead = gzread(file, data.data(), static_cast<unsigned>(data.size()))) > 0) {
+                appendRecords(data.data(), bytesRead / sizeof(CompressedContactRecord), filtered, filterChr1Key,
+                              filterChr2Key, batch);
+                if (batch.size() > 0 && !pushBatch(batch)) break;
+            }
+            gzclose(file);
+        }
+    }
+    lock_guard<mutex> lock(batchMutex);
+    done = true;
+    changed.notify_all();
+}
+
+bool HicSliceReader::readBatch(HicSliceColumns &batch) {
+    batch.clear();
+    if (!open) {
+        return false;
+    }
+    unique_lock<mutex> lock(batchMutex);
+    changed.wait(lock, [this]() { return done || !batches.empty(); });
+    if (batches.empty()) {
+        return false;
+    }
+    batch = move(batches.front());
+    batches.pop_front();
+    changed.notify_all();
+    return true;
+}
+
+HicSliceColumns HicSliceReader::readAll() {
+    HicSliceColumns all, batch;
+    while (readBatch(batch)) {
+        if (all.size() == 0) {
+            all = move(batch);
+        } else {
+            all.append(batch);
+        }
+    }
+    return all;
+}
@@ -1,16 +1,36 @@
 #ifndef HIC_SLICE_H
 #define HIC_SLICE_H
 
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <map>
 #include <vector>
 #include "straw.h"
 
 // Magic string to identify file format
 const std::string HICSLICE_MAGIC = "HICSLICE";
+// the same for version 2 files, whose records are split into per chromosome pair chunks with an index at the end
+const std::string HICSLICE_V2_MAGIC = "HICSLIC2";
+// and for version 3 files, laid out as version 2 but with each chunk's records stored in columns
+const std::string HICSLICE_V3_MAGIC = "HICSLIC3";
+
+// how the counts column of a version 3 chunk is stored
+enum class HicSliceCountsEncoding : uint8_t {
+    Varint = 0, // every count is a non-negative integer
+    Float = 1   // raw float32
+};
+
+// size of the empty gzip member closing a version 2 or 3 file, which holds the file offset of the index
+const int32_t HICSLICE_TRAILER_SIZE = 34;
 
 // Header structure for the file
 struct HicSliceHeader {
+    int32_t version;
     int32_t resolution;
     int32_t numChromosomes;
     std::map<std::string, int16_t> chromosomeKeys;
@@ -25,11 +45,151 @@ struct CompressedContactRecord {
     float value;
 };
 
+// index entry of a version 2 or 3 file: one run of records of a chromosome pair, compressed on its own as the size
+// bytes at offset in the file. the bin ranges are inclusive.
+struct HicSliceChunk {
+    int16_t chr1Key;
+    int16_t chr2Key;
+    int64_t offset;
+    int64_t size;
+    int64_t numRecords;
+    int32_t binXStart;
+    int32_t binXEnd;
+    int32_t binYStart;
+    int32_t binYEnd;
+};
+
+// the writing side is left out of builds that only read slice files (the Python and R packages), which define
+// HIC_SLICE_NO_WRITER
+#ifndef HIC_SLICE_NO_WRITER
+
+// writes a compressed stream as a series of independent gzip members, one per chunk of chunkSize bytes, which gunzip
+// and gzread read back as one stream. chunks are compressed in parallel (numThreads; 0 means one per core) and
+// written in order. with appendAt >= 0 an existing file is cut back to its first appendAt bytes and written on from
+// there (to resume a dump); offsets then count from the start of the file and member numbers from the first new member.
+class HicSliceWriter {
+public:
+    explicit HicSliceWriter(const std::string& path, int32_t compressionLevel = 6, int32_t numThreads = 0,
+                            size_t chunkSize = 4 << 20, int64_t appendAt = -1);
+    ~HicSliceWriter();
+
+    bool isOpen() const { return out != nullptr; }
+    // compressed bytes written to the file so far
+    int64_t getBytesWritten() const { return bytesWritten; }
+    // members written to the file so far; getMemberOffset is known up to this one
+    size_t getMembersWritten() const { return memberOffsets.size(); }
+
+    void write(const void* data, size_t size);
+    // ends the gzip member being filled, so the next write starts a new one; returns the number of members so far
+    size_t endMember();
+    // ends the current member and waits for every member to be written
+    void flush();
+    // file offset of member i, or of the end of the members once i is the number of members (after flush)
+    int64_t getMemberOffset(size_t i) const;
+    // hands the members written so far to the operating system, so they survive the process
+    void syncFile();
+    // flushes and appends the empty member pointing at the index that ends a version 2 or 3 file
+    void writeTrailer(int64_t indexOffset);
+    // compresses what is left and closes the file
+    void close();
+
+private:
+    FILE* out;
+    int32_t compressionLevel;
+    size_t chunkSize;
+    size_t maxInFlight;
+    std::string buffer;
+    std::deque<std::future<std::string>> pending;
+    std::vector<int64_t> memberOffsets;
+    size_t numMembers = 0;
+    int64_t bytesWritten = 0;
+
+    void flushChunk();
+    void writeOldestMember();
+};
+
+// a version 3 chunk: chr1Key and chr2Key (int16), the number of records (int32) and the counts encoding (uint8),
+// then the binX column, the binY column and the counts column. bins are stored as zigzag varint differences from the
+// previous record's bin (0 before the first) and counts as varints when all of them are whole numbers. the records
+// must all belong to one chromosome pair.
+void encodeHicSliceChunk(const std::vector<CompressedContactRecord>& records, std::string& out);
+
+#endif // HIC_SLICE_NO_WRITER
+
+// records of a slice file in columns, one entry per record in each
+struct HicSliceColumns {
+    std::vector<int16_t> chr1Key;
+    std::vector<int32_t> binX;
+    std::vector<int16_t> chr2Key;
+    std::vector<int32_t> binY;
+    std::vector<float> counts;
+
+    size_t size() const { return counts.size(); }
+    void clear();
+    void append(const HicSliceColumns& other);
+};
+
+// reads version 1, 2 and 3 slice files in batches of columns. a background thread decompresses and parses the batches a
+// few ahead of readBatch. with chr1 and chr2 given (in either order) only the records of that chromosome pair are read,
+// which in version 2 and 3 files means only its chunks are read from disk.
+class HicSliceReader {
+public:
+    explicit HicSliceReader(const std::string& path, const std::string& chr1 = "", const std::string& chr2 = "");
+    ~HicSliceReader();
+
+    bool isOpen() const { return open; }
+    // why the file could not be opened or reading stopped at a damaged chunk; empty if neither happened. errors are
+    // kept rather than printed so each caller reports them its own way
+    std::string getError();
+    const HicSliceHeader& getHeader() const { return header; }
+    // name of the chromosome with this key, or empty if there is none
+    std::string getChromosomeName(int16_t key) const;
+    // the chunk index of a version 2 or 3 file; empty for version 1
+    const std::vector<HicSliceChunk>& getIndex() const { return index; }
+
+    // replaces batch with the next batch of records; false once every record has been read
+    bool readBatch(HicSliceColumns& batch);
+    // every record not read yet
+    HicSliceColumns readAll();
+
+private:
+    std::string path;
+    bool open = false;
+    std::string error;
+    HicSliceHeader header;
+    std::vector<std::string> chromosomeNames;
+    std::vector<HicSliceChunk> index;
+    int64_t recordsOffset = 0;
+    bool filtered = false;
+    int16_t filterChr1Key = 0;
+    int16_t filterChr2Key = 0;
+
+    std::thread worker;
+    std::mutex batchMutex;
+    std::condition_variable changed;
+    std::deque<HicSliceColumns> batches;
+    bool done = false;
+    bool stopping = false;
+
+    bool readHeader();
+    bool readIndex();
+    void readRecords();
+    bool pushBatch(HicSliceColumns& batch);
+};
+
+#ifndef HIC_SLICE_NO_WRITER
+// writes a version 3 file, or Arrow for .arrow, .feather and .arrows paths. compressionLevel is the zlib level (0-9) of
+// the gzip members the output is written as. with sortMemory > 0 the records of each chromosome pair are written
+// sorted by binX, then binY, sorting in runs of at most sortMemory bytes that are spilled next to the output file and
+// merged; otherwise they are written in block order
 void dumpGenomeWideDataAtResolution(const std::string& matrixType, 
                                   const std::string& norm, 
                                   const std::string& filePath, 
                                   const std::string& unit, 
                                   int32_t resolution, 
-                                  const std::string& outputPath);
+                                  const std::string& outputPath,
+                                  int32_t compressionLevel = 6,
+                                  int64_t sortMemory = 0);
+#endif // HIC_SLICE_NO_WRITER
 
 #endif 
\ No newline at end of file
@@ -22,18 +22,21 @@
  THE SOFTWARE.
 */
 #include <iostream>
+#include <sstream>
 #include <string>
 #include "straw.h"
 #include "hic_slice.h"
+#include "straw_arrow.h"
+#include "straw_cooler.h"
 using namespace std;
 
 int main(int argc, char *argv[])
 {
     // Check if this is a dump command
     if (argc > 1 && string(argv[1]) == "dump") {
-        if (argc != 8) {
+        if (argc < 8 || argc > 10) {
             cerr << "Incorrect arguments for dump command" << endl;
-            cerr << "Usage: straw dump <observed/oe/expected> <NONE/VC/VC_SQRT/KR> <hicFile> <BP/FRAG> <binsize> <outputFile>" << endl;
+            cerr << "Usage: straw dump <observed/oe/expected> <NONE/VC/VC_SQRT/KR> <hicFile> <BP/FRAG> <binsize> <outputFile> [compressionLevel] [sortMemoryMB]" << endl;
             exit(1);
         }
         string matrixType = argv[2];
@@ -42,8 +45,73 @@ int main(int argc, char *argv[])
         string unit = argv[5];
         int32_t binsize = stoi(argv[6]);
         string outputPath = argv[7];
+        int32_t compressionLevel = argc >= 9 ? stoi(argv[8]) : 6;
+        int64_t sortMemory = argc == 10 ? stoll(argv[9]) * 1024 * 1024 : 0;
 
-        dumpGenomeWideDataAtResolution(matrixType, norm, fname, unit, binsize, outputPath);
+        dumpGenomeWideDataAtResolution(matrixType, norm, fname, unit, binsize, outputPath, compressionLevel,
+                                       sortMemory);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "arrow") {
+        if (argc != 9 && argc != 10) {
+            cerr << "Incorrect arguments for arrow command" << endl;
+            cerr << "Usage: straw arrow <outputFile> [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>" << endl;
+            exit(1);
+        }
+        int offset = argc == 10 ? 1 : 0;
+        string matrixType = argc == 10 ? argv[3] : "observed";
+        strawToArrow(matrixType, argv[3 + offset], argv[4 + offset], argv[5 + offset], argv[6 + offset],
+                     argv[7 + offset], stoi(argv[8 + offset]), argv[2]);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "convert") {
+        if (argc < 4 || argc > 7) {
+            cerr << "Incorrect arguments for convert command" << endl;
+            cerr << "Usage: straw convert <hicFile> <outputFile.cool/.mcool> [binsize,...|all] [norm,...|stored] [sortMemoryMB]" << endl;
+            exit(1);
+        }
+        vector<int32_t> resolutions;
+        vector<string> norms;
+        string item;
+        stringstream resolutionList(argc > 4 ? argv[4] : "all");
+        while (getline(resolutionList, item, ',')) {
+            if (item != "all") resolutions.push_back(stoi(item));
+        }
+        stringstream normList(argc > 5 ? argv[5] : "");
+        while (getline(normList, item, ',')) {
+            if (item != "stored") norms.push_back(item);
+        }
+        int64_t sortMemory = argc > 6 ? stoll(argv[6]) * 1024 * 1024 : 1LL << 30;
+        convertToCooler(argv[2], argv[3], resolutions, norms, sortMemory);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "apa") {
+        if (argc != 9 && argc != 10) {
+            cerr << "Incorrect arguments for apa command" << endl;
+            cerr << "Usage: straw apa <observed/oe/expected> <NONE/VC/VC_SQRT/KR> <hicFile> <loops.bedpe> <BP/FRAG> <binsize> <window> [sum]" << endl;
+            exit(1);
+        }
+        string matrixType = argv[2];
+        string norm = argv[3];
+        string fname = argv[4];
+        vector<anchorPair> loops = readBedpe(argv[5]);
+        string unit = argv[6];
+        int32_t binsize = stoi(argv[7]);
+        int32_t window = stoi(argv[8]);
+        bool average = argc != 10 || string(argv[9]) != "sum";
+
+        pileupResult apa = pileup(matrixType, norm, fname, loops, window, unit, binsize);
+        cerr << "Aggregated " << apa.numLoops << " of " << loops.size() << " loops" << endl;
+        double scale = average && apa.numLoops > 0 ? 1.0 / apa.numLoops : 1.0;
+        for (int32_t i = 0; i < apa.width; i++) {
+            for (int32_t j = 0; j < apa.width; j++) {
+                cout << apa.sum[(size_t) i * apa.width + j] * scale << "\t";
+            }
+            cout << endl;
+        }
         return 0;
     }
 
@@ -51,7 +119,10 @@ int main(int argc, char *argv[])
     if (argc != 7 && argc != 8) {
         cerr << "Incorrect arguments" << endl;
         cerr << "Usage: straw [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG/MATRIX> <binsize>" << endl;
-        cerr << "   or: straw dump <observed/oe/expected> <NONE/VC/VC_SQRT/KR> <hicFile> <BP/FRAG> <binsize> <outputFile>" << endl;
+        cerr << "   or: straw dump <observed/oe/expected> <NONE/VC/VC_SQRT/KR> <hicFile> <BP/FRAG> <binsize> <outputFile> [compressionLevel] [sortMemoryMB]" << endl;
+        cerr << "   or: straw arrow <outputFile> [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>" << endl;
+        cerr << "   or: straw convert <hicFile> <outputFile.cool/.mcool> [binsize,...|all] [norm,...|stored] [sortMemoryMB]" << endl;
+        cerr << "   or: straw apa <observed/oe/expected> <NONE/VC/VC_SQRT/KR> <hicFile> <loops.bedpe> <BP/FRAG> <binsize> <window> [sum]" << endl;
         exit(1);
     }
     int offset = 0;
@@ -41,7 +41,19 @@
 #include <future>
 #include <queue>
 #include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <limits>
+#include <chrono>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
 #include "hic_slice.h"
+#include "straw_arrow.h"
+#include "straw_cooler.h"
+#include "straw_simd.h"
 
 using namespace std;
 
@@ -403,6 +415,11 @@ int64_t readStringFromURL(istream &fin, string &basicString) {
     return (basicString.length() + 1);
 }
 
+// the normalizations straw can compute itself when a file doesn't have them
+bool canComputeNorm(const string &norm) {
+    return norm == "VC" || norm == "VC_SQRT" || norm == "KR" || norm == "SCALE";
+}
+
 // reads the footer from the master pointer location. takes in the chromosomes,
 // norm, unit (BP or FRAG) and resolution or binsize, and sets the file
 // position of the matrix and the normalization vectors for those chromosomes
@@ -519,7 +536,8 @@ bool readFooterURL(CURL *curl, int64_t master, int32_t version, int32_t c1, int3
 
     if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm == "NONE") {
         if (expectedValues.empty()) {
-            cerr << "Remote file did not contain expected values vectors at " << resolution << " " << unit << endl;
+            cerr << "Remote file did not contain expected values vectors at " << resolution << " " << unit
+                 << "; computing them from the observed counts" << endl;
             return false;
         }
         return true;
@@ -575,7 +593,8 @@ bool readFooterURL(CURL *curl, int64_t master, int32_t version, int32_t c1, int3
 
     if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm != "NONE") {
         if (expectedValues.empty()) {
-            cerr << "Remote file did not contain normalized expected values vectors at " << resolution << " " << unit << endl;
+            cerr << "Remote file did not contain normalized expected values vectors at " << resolution << " " << unit
+                 << "; computing them from the observed counts" << endl;
             return false;
         }
     }
@@ -634,7 +653,8 @@ bool readFooterURL(CURL *curl, int64_t master, int32_t version, int32_t c1, int3
     delete buffer;
     if (!found1 || !found2) {
         cerr << "Remote file did not contain " << norm << " normalization vectors for one or both chromosomes at "
-             << resolution << " " << unit << endl;
+             << resolution << " " << unit << (canComputeNorm(norm) ? "; using vectors computed from the observed counts" : "")
+             << endl;
     }
     return true;
 }
@@ -697,7 +717,8 @@ bool readFooter(istream &fin, int64_t master, int32_t version, int32_t c1, int32
 
     if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm == "NONE") {
         if (expectedValues.empty()) {
-            cerr << "File did not contain expected values vectors at " << resolution << " " << unit << endl;
+            cerr << "File did not contain expected values vectors at " << resolution << " " << unit
+                 << "; computing them from the observed counts" << endl;
             return false;
         }
         return true;
@@ -724,7 +745,8 @@ bool readFooter(istream &fin, int64_t master, int32_t version, int32_t c1, int32
 
     if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm != "NONE") {
         if (expectedValues.empty()) {
-            cerr << "File did not contain normalized expected values vectors at " << resolution << " " << unit << endl;
+            cerr << "File did not contain normalized expected values vectors at " << resolution << " " << unit
+                 << "; computing them from the observed counts" << endl;
             return false;
         }
     }
@@ -761,11 +783,68 @@ bool readFooter(istream &fin, int64_t master, int32_t version, int32_t c1, int32
     }
     if (!found1 || !found2) {
         cerr << "File did not contain " << norm << " normalization vectors for one or both chromosomes at "
-             << resolution << " " << unit << endl;
+             << resolution << " " << unit << (canComputeNorm(norm) ? "; using vectors computed from the observed counts" : "")
+             << endl;
     }
     return true;
 }
 
+// the normalizations the footer stores vectors for at unit and resolution, in the order of its normalization vector
+// index. fin is at the start of the footer, or with atIndex at the index itself (the header's nviPosition in v9 files)
+vector<string> readStoredNormTypes(istream &fin, int32_t version, bool atIndex, const string &unit,
+                                   int32_t resolution) {
+    vector<double> ignored;
+    if (!atIndex) {
+        if (version > 8) {
+            readInt64FromFile(fin);
+        } else {
+            readInt32FromFile(fin);
+        }
+        int32_t nEntries = readInt32FromFile(fin);
+        for (int i = 0; i < nEntries; i++) {
+            string keyStr;
+            getline(fin, keyStr, '\0');
+            readInt64FromFile(fin);
+            readInt32FromFile(fin);
+        }
+        // expected values, then normalized expected values, which also start with the normalization type
+        for (int section = 0; section < 2; section++) {
+            int32_t nExpectedValues = readInt32FromFile(fin);
+            for (int i = 0; i < nExpectedValues; i++) {
+                string nType, unit0;
+                if (section == 1) {
+                    getline(fin, nType, '\0');
+                }
+                getline(fin, unit0, '\0');
+                readInt32FromFile(fin);
+                int64_t nValues = version > 8 ? readInt64FromFile(fin) : (int64_t) readInt32FromFile(fin);
+                readThroughExpectedVector(version, fin, ignored, nValues, false, resolution);
+                readThroughNormalizationFactors(fin, version, false, ignored, 0);
+            }
+        }
+    }
+
+    vector<string> norms;
+    int32_t nEntries = readInt32FromFile(fin);
+    for (int i = 0; i < nEntries && fin; i++) {
+        string normtype, unit1;
+        getline(fin, normtype, '\0');
+        readInt32FromFile(fin);
+        getline(fin, unit1, '\0');
+        int32_t resolution1 = readInt32FromFile(fin);
+        readInt64FromFile(fin);
+        if (version > 8) {
+            readInt64FromFile(fin);
+        } else {
+            readInt32FromFile(fin);
+        }
+        if (unit1 == unit && resolution1 == resolution && find(norms.begin(), norms.end(), normtype) == norms.end()) {
+            norms.push_back(normtype);
+        }
+    }
+    return norms;
+}
+
 indexEntry readIndexEntry(istream &fin) {
     int64_t filePosition = readInt64FromFile(fin);
     int32_t blockSizeInBytes = readInt32FromFile(fin);
@@ -803,27 +882,28 @@ void populateBlockMap(istream &fin, int32_t nBlocks, map<int32_t, indexEntry> &b
     }
 }
 
-// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count
-map<int32_t, indexEntry> readMatrixZoomData(istream &fin, const string &myunit, int32_t mybinsize, float &mySumCounts,
-                                            int32_t &myBlockBinCount, int32_t &myBlockColumnCount, bool &found) {
+// reads the zoom header of the raw binned contact matrix; if it is the specified resolution, sets the block bin count,
+// block column count and the location of the block index, which is not read until it is needed
+void readMatrixZoomData(istream &fin, const string &myunit, int32_t mybinsize, float &mySumCounts,
+                        int32_t &myBlockBinCount, int32_t &myBlockColumnCount, indexEntry &myBlockIndex, bool &found) {
 
-    map<int32_t, indexEntry> blockMap;
     setValuesForMZD(fin, myunit, mySumCounts, mybinsize, myBlockBinCount, myBlockColumnCount, found);
 
     int32_t nBlocks = readInt32FromFile(fin);
+    int64_t indexSize = nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t));
     if (found) {
-        populateBlockMap(fin, nBlocks, blockMap);
+        myBlockIndex.position = fin.tellg();
+        myBlockIndex.size = indexSize;
     } else {
-        fin.seekg(nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)), ios_base::cur);
+        fin.seekg(indexSize, ios_base::cur);
     }
-    return blockMap;
 }
 
-// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count
-map<int32_t, indexEntry> readMatrixZoomDataHttp(CURL *curl, int64_t &myFilePosition, const string &myunit,
-                                                int32_t mybinsize, float &mySumCounts, int32_t &myBlockBinCount,
-                                                int32_t &myBlockColumnCount, bool &found) {
-    map<int32_t, indexEntry> blockMap;
+// reads the zoom header of the raw binned contact matrix; if it is the specified resolution, sets the block bin count,
+// block column count and the location of the block index, which is not read until it is needed
+void readMatrixZoomDataHttp(CURL *curl, int64_t &myFilePosition, const string &myunit, int32_t mybinsize,
+                            float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount,
+                            indexEntry &myBlockIndex, bool &found) {
     int32_t header_size = 5 * sizeof(int32_t) + 4 * sizeof(float);
     char *first = getData(curl, myFilePosition, 1);
     if (first[0] == 'B') {
@@ -832,7 +912,7 @@ map<int32_t, indexEntry> readMatrixZoomDataHttp(CURL *curl, int64_t &myFilePosit
         header_size += 5;
     } else {
         cerr << "Unit not understood" << endl;
-        return blockMap;
+        return;
     }
     delete first;
     char *buffer = getData(curl, myFilePosition, header_size);
@@ -841,23 +921,19 @@ map<int32_t, indexEntry> readMatrixZoomDataHttp(CURL *curl, int64_t &myFilePosit
     int32_t nBlocks = readInt32FromFile(fin);
     delete buffer;
 
+    int64_t indexSize = nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t));
     if (found) {
-        int32_t chunkSize = nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t));
-        buffer = getData(curl, myFilePosition + header_size, chunkSize);
-        memstream fin2(buffer, chunkSize);
-        populateBlockMap(fin2, nBlocks, blockMap);
-        delete buffer;
+        myBlockIndex.position = myFilePosition + header_size;
+        myBlockIndex.size = indexSize;
     } else {
-        myFilePosition = myFilePosition + header_size
-                         + (nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)));
+        myFilePosition = myFilePosition + header_size + indexSize;
     }
-    return blockMap;
 }
 
 // goes to the specified file pointer in http and finds the raw contact matrixType at specified resolution, calling readMatrixZoomData.
-// sets blockbincount and blockcolumncount
-map<int32_t, indexEntry> readMatrixHttp(CURL *curl, int64_t myFilePosition, const string &unit, int32_t resolution,
-                                        float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount) {
+// sets blockbincount, blockcolumncount and the location of the block index
+bool readMatrixHttp(CURL *curl, int64_t myFilePosition, const string &unit, int32_t resolution,
+                    float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount, indexEntry &myBlockIndex) {
     int32_t size = sizeof(int32_t) * 3;
     char *buffer = getData(curl, myFilePosition, size);
     memstream bufin(buffer, size);
@@ -869,26 +945,23 @@ map<int32_t, indexEntry> readMatrixHttp(CURL *curl, int64_t myFilePosition, cons
     bool found = false;
     myFilePosition = myFilePosition + size;
     delete buffer;
-    map<int32_t, indexEntry> blockMap;
 
     while (i < nRes && !found) {
         // myFilePosition gets updated within call
-        blockMap = readMatrixZoomDataHttp(curl, myFilePosition, unit, resolution, mySumCounts, myBlockBinCount,
-                                          myBlockColumnCount, found);
+        readMatrixZoomDataHttp(curl, myFilePosition, unit, resolution, mySumCounts, myBlockBinCount,
+                               myBlockColumnCount, myBlockIndex, found);
         i++;
     }
     if (!found) {
         cerr << "Error finding block data" << endl;
     }
-    return blockMap;
+    return found;
 }
 
 // goes to the specified file pointer and finds the raw contact matrixType at specified resolution, calling readMatrixZoomData.
-// sets blockbincount and blockcolumncount
-map<int32_t, indexEntry> readMatrix(istream &fin, int64_t myFilePosition, const string &unit, int32_t resolution,
-                                    float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount) {
-    map<int32_t, indexEntry> blockMap;
-
+// sets blockbincount, blockcolumncount and the location of the block index
+bool readMatrix(istream &fin, int64_t myFilePosition, const string &unit, int32_t resolution,
+                float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount, indexEntry &myBlockIndex) {
     fin.seekg(myFilePosition, ios::beg);
     int32_t c1 = readInt32FromFile(fin);
     int32_t c2 = readInt32FromFile(fin);
@@ -896,73 +969,184 @@ map<int32_t, indexEntry> readMatrix(istream &fin, int64_t myFilePosition, const
     int32_t i = 0;
     bool found = false;
     while (i < nRes && !found) {
-        blockMap = readMatrixZoomData(fin, unit, resolution, mySumCounts, myBlockBinCount, myBlockColumnCount, found);
+        readMatrixZoomData(fin, unit, resolution, mySumCounts, myBlockBinCount, myBlockColumnCount, myBlockIndex, found);
         i++;
     }
     if (!found) {
         cerr << "Error finding block data" << endl;
     }
+    return found;
+}
+
+// reads the block index located by readMatrix, i.e. the block number, file position and size of every block
+map<int32_t, indexEntry> readBlockIndex(HiCFileStream &stream, indexEntry blockIndex) {
+    map<int32_t, indexEntry> blockMap;
+    if (blockIndex.size <= 0) {
+        return blockMap;
+    }
+    char *buffer = stream.readCompressedBytes(blockIndex);
+    memstream fin(buffer, static_cast<int32_t>(blockIndex.size));
+    int32_t nBlocks = static_cast<int32_t>(blockIndex.size / (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)));
+    populateBlockMap(fin, nBlocks, blockMap);
+    delete[] buffer;
     return blockMap;
 }
 
-// gets the blocks that need to be read for this slice of the data.  needs blockbincount, blockcolumncount, and whether
-// or not this is intrachromosomal.
-set<int32_t> getBlockNumbersForRegionFromBinPosition(const int64_t *regionIndices, int32_t blockBinCount,
-                                                     int32_t blockColumnCount, bool intra) {
+// a rectangle of candidate block numbers: rows [row1, row2] by columns [col1, col2] of a grid that is
+// blockColumnCount wide. for v9 intrachromosomal matrices rows are depths and columns are positions along the diagonal.
+struct BlockRange {
+    int32_t row1;
+    int32_t row2;
+    int32_t col1;
+    int32_t col2;
+};
+
+// gets the ranges of blocks that need to be read for this slice of the data.  needs blockbincount and whether
+// or not this is intrachromosomal; the second range mirrors the first below the diagonal. returns the number of ranges.
+int32_t getBlockRangesForRegionFromBinPosition(const int64_t *regionIndices, int32_t blockBinCount, bool intra,
+                                               BlockRange ranges[2]) {
     int32_t col1, col2, row1, row2;
     col1 = static_cast<int32_t>(regionIndices[0] / blockBinCount);
     col2 = static_cast<int32_t>((regionIndices[1] + 1) / blockBinCount);
     row1 = static_cast<int32_t>(regionIndices[2] / blockBinCount);
     row2 = static_cast<int32_t>((regionIndices[3] + 1) / blockBinCount);
 
-    set<int32_t> blocksSet;
     // first check the upper triangular matrixType
-    for (int r = row1; r <= row2; r++) {
-        for (int c = col1; c <= col2; c++) {
-            int32_t blockNumber = r * blockColumnCount + c;
-            blocksSet.insert(blockNumber);
-        }
-    }
+    ranges[0] = {row1, row2, col1, col2};
     // check region part that overlaps with lower left triangle but only if intrachromosomal
     if (intra) {
-        for (int r = col1; r <= col2; r++) {
-            for (int c = row1; c <= row2; c++) {
-                int32_t blockNumber = r * blockColumnCount + c;
-                blocksSet.insert(blockNumber);
-            }
+        ranges[1] = {col1, col2, row1, row2};
+        return 2;
+    }
+    return 1;
+}
+
+// depth layer of the v9 intrachromosomal blocks holding contacts this many bins away from the diagonal
+int32_t getV9Depth(int64_t distance, int32_t blockBinCount) {
+    return static_cast<int32_t>(log2(1 + distance / sqrt(2) / blockBinCount));
+}
+
+// smallest distance from the diagonal, in bins, that is stored in the given v9 depth layer
+int64_t getV9MinDistanceForDepth(int32_t depth, int32_t blockBinCount) {
+    if (depth <= 0) {
+        return 0;
+    }
+    auto distance = static_cast<int64_t>(ceil(sqrt(2) * blockBinCount * (pow(2.0, depth) - 1)));
+    // step off any rounding so the boundary agrees exactly with getV9Depth
+    while (distance > 0 && getV9Depth(distance - 1, blockBinCount) >= depth) distance--;
+    while (getV9Depth(distance, blockBinCount) < depth) distance++;
+    return distance;
+}
+
+// whether some bin (x, y) with x in [x0, x1] and y in [y0, y1] has sLo <= x + y <= sHi and uLo <= x - y <= uHi.
+// y is feasible for a given x when max(y0, sLo - x, x - uHi) <= min(y1, sHi - x, x - uLo); the slack between the
+// two bounds is concave in x, so its integer maximum lies next to a breakpoint of either bound or at an end.
+bool regionIntersectsDiagonalBand(const int64_t *regionIndices, int64_t sLo, int64_t sHi, int64_t uLo, int64_t uHi) {
+    const int64_t x0 = regionIndices[0], x1 = regionIndices[1], y0 = regionIndices[2], y1 = regionIndices[3];
+    if (x0 > x1 || y0 > y1 || sLo > sHi || uLo > uHi) {
+        return false;
+    }
+    const int64_t candidates[] = {x0, x1,
+                                  sLo - y0, y0 + uHi, (sLo + uHi) >> 1, ((sLo + uHi) >> 1) + 1,
+                                  sHi - y1, y1 + uLo, (sHi + uLo) >> 1, ((sHi + uLo) >> 1) + 1};
+    for (int64_t x : candidates) {
+        x = min(max(x, x0), x1);
+        int64_t lower = max(y0, max(sLo - x, x - uHi));
+        int64_t upper = min(y1, min(sHi - x, x - uLo));
+        if (lower <= upper) {
+            return true;
         }
     }
-    return blocksSet;
+    return false;
+}
+
+// whether the v9 intrachromosomal block at this depth and position along the diagonal (PAD) can hold any contact in
+// the region, i.e. the exact intersection of the region with the block's footprint. contacts are in block
+// pad = (x + y) / 2 / blockBinCount and depth = getV9Depth(|x - y|), so mirrored contacts share a block and it is
+// enough to test the region against both sides of the diagonal. maxDistance (in bins) further limits the region to
+// contacts at most that far from the diagonal.
+bool isBlockInRegionV9Intra(const int64_t *regionIndices, int32_t depth, int32_t pad, int32_t blockBinCount,
+                            int64_t maxDistance = numeric_limits<int64_t>::max()) {
+    int64_t sLo = 2LL * blockBinCount * pad;
+    int64_t sHi = sLo + 2LL * blockBinCount - 1;
+    int64_t tLo = getV9MinDistanceForDepth(depth, blockBinCount);
+    int64_t tHi = min(getV9MinDistanceForDepth(depth + 1, blockBinCount) - 1, maxDistance);
+    return regionIntersectsDiagonalBand(regionIndices, sLo, sHi, tLo, tHi) ||
+           regionIntersectsDiagonalBand(regionIndices, sLo, sHi, -tHi, -tLo);
 }
 
-set<int32_t> getBlockNumbersForRegionFromBinPositionV9Intra(int64_t *regionIndices, int32_t blockBinCount,
-                                                            int32_t blockColumnCount) {
+// the PAD and depth bounds of the region; blocks inside these bounds still need isBlockInRegionV9Intra
+BlockRange getBlockRangeForRegionFromBinPositionV9Intra(const int64_t *regionIndices, int32_t blockBinCount) {
     // regionIndices is binX1 binX2 binY1 binY2
-    set<int32_t> blocksSet;
-    int32_t translatedLowerPAD, translatedHigherPAD, translatedNearerDepth, translatedFurtherDepth;
-    translatedLowerPAD = static_cast<int32_t>((regionIndices[0] + regionIndices[2]) / 2 / blockBinCount);
-    translatedHigherPAD = static_cast<int32_t>((regionIndices[1] + regionIndices[3]) / 2 / blockBinCount + 1);
-    translatedNearerDepth = static_cast<int32_t>(log2(
-            1 + abs(regionIndices[0] - regionIndices[3]) / sqrt(2) / blockBinCount));
-    translatedFurtherDepth = static_cast<int32_t>(log2(
-            1 + abs(regionIndices[1] - regionIndices[2]) / sqrt(2) / blockBinCount));
+    int32_t lowerPAD = static_cast<int32_t>((regionIndices[0] + regionIndices[2]) / 2 / blockBinCount);
+    int32_t higherPAD = static_cast<int32_t>((regionIndices[1] + regionIndices[3]) / 2 / blockBinCount);
+
+    // nearest and furthest distance from the diagonal; zero when the region crosses it
+    int64_t nearest = 0;
+    if (regionIndices[1] < regionIndices[2]) {
+        nearest = regionIndices[2] - regionIndices[1];
+    } else if (regionIndices[3] < regionIndices[0]) {
+        nearest = regionIndices[0] - regionIndices[3];
+    }
+    int64_t furthest = max(abs(regionIndices[0] - regionIndices[3]), abs(regionIndices[1] - regionIndices[2]));
+
+    return {getV9Depth(nearest, blockBinCount), getV9Depth(furthest, blockBinCount), lowerPAD, higherPAD};
+}
 
-    // because code above assume above diagonal; but we could be below diagonal
-    int32_t nearerDepth = min(translatedNearerDepth, translatedFurtherDepth);
-    if ((regionIndices[0] > regionIndices[3] && regionIndices[1] < regionIndices[2]) ||
-        (regionIndices[1] > regionIndices[2] && regionIndices[0] < regionIndices[3])) {
-        nearerDepth = 0;
+// visits each block of the index that lies within any of the ranges exactly once, without enumerating the
+// candidate block numbers that are not in the file. rows are walked in order and the column intervals of
+// overlapping ranges are merged, so blocks are visited in block number order (which is the order blocks are
+// written to the file, i.e. increasing file offset).
+template<typename F>
+void forEachBlockInRanges(const map<int32_t, indexEntry> &blockMap, const BlockRange *ranges, int32_t numRanges,
+                          int32_t blockColumnCount, F visit) {
+    if (blockMap.empty() || numRanges < 1) {
+        return;
     }
-    int32_t furtherDepth = max(translatedNearerDepth, translatedFurtherDepth) + 1; // +1; integer divide rounds down
+    const int32_t lastBlockNumber = blockMap.rbegin()->first;
+    int32_t firstRow = ranges[0].row1;
+    int32_t lastRow = ranges[0].row2;
+    for (int32_t i = 1; i < numRanges; i++) {
+        firstRow = min(firstRow, ranges[i].row1);
+        lastRow = max(lastRow, ranges[i].row2);
+    }
+    firstRow = max(firstRow, 0);
 
-    for (int depth = nearerDepth; depth <= furtherDepth; depth++) {
-        for (int pad = translatedLowerPAD; pad <= translatedHigherPAD; pad++) {
-            int32_t blockNumber = depth * blockColumnCount + pad;
-            blocksSet.insert(blockNumber);
+    pair<int32_t, int32_t> intervals[4];
+    for (int32_t r = firstRow; r <= lastRow; r++) {
+        int64_t rowStart = static_cast<int64_t>(r) * blockColumnCount;
+        if (rowStart > lastBlockNumber) {
+            break;
+        }
+
+        // column intervals of this row, clamped to the grid and sorted by start
+        int32_t numIntervals = 0;
+        for (int32_t i = 0; i < numRanges && numIntervals < 4; i++) {
+            if (r < ranges[i].row1 || r > ranges[i].row2) continue;
+            int32_t c1 = max(ranges[i].col1, 0);
+            int32_t c2 = min(ranges[i].col2, blockColumnCount - 1);
+            if (c1 > c2) continue;
+            int32_t k = numIntervals++;
+            while (k > 0 && intervals[k - 1].first > c1) {
+                intervals[k] = intervals[k - 1];
+                k--;
+            }
+            intervals[k] = make_pair(c1, c2);
         }
-    }
 
-    return blocksSet;
+        int32_t nextCol = 0; // columns before this one have already been visited in this row
+        for (int32_t i = 0; i < numIntervals; i++) {
+            int32_t c1 = max(intervals[i].first, nextCol);
+            int32_t c2 = intervals[i].second;
+            if (c1 > c2) continue;
+            nextCol = c2 + 1;
+            auto it = blockMap.lower_bound(static_cast<int32_t>(rowStart + c1));
+            const int64_t lastInRow = rowStart + c2;
+            for (; it != blockMap.end() && it->first <= lastInRow; ++it) {
+                visit(it->first, it->second);
+            }
+        }
+    }
 }
 
 void appendRecord(vector<contactRecord> &vector, int32_t index, int32_t binX, int32_t binY, float counts) {
@@ -1009,12 +1193,12 @@ long getNumRecordsInBlock(const string &fileName, indexEntry idx, int32_t versio
 
 // this is the meat of reading the data.  takes in the block number and returns the set of contact records corresponding to
 // that block.  the block data is compressed and must be decompressed using the zlib library functions
-vector<contactRecord> readBlock(const string &fileName, indexEntry idx, int32_t version) {
+vector<contactRecord> readBlock(HiCFileStream &stream, indexEntry idx, int32_t version) {
     if (idx.size <= 0) {
         vector<contactRecord> v;
         return v;
     }
-    char *compressedBytes = readCompressedBytesFromFile(fileName, idx);
+    char *compressedBytes = stream.readCompressedBytes(idx);
     char *uncompressedBytes = new char[idx.size * 10]; //biggest seen so far is 3
     int32_t uncompressedSize = decompressBlock(idx, compressedBytes, uncompressedBytes);
 
@@ -1115,26 +1299,15 @@ vector<contactRecord> readBlock(const string &fileName, indexEntry idx, int32_t
             int32_t nPts = readInt32FromFile(bufferin);
             int16_t w = readInt16FromFile(bufferin);
 
-            for (int i = 0; i < nPts; i++) {
-                //int32_t idx = (p.y - binOffset2) * w + (p.x - binOffset1);
-                int32_t row = i / w;
-                int32_t col = i - row * w;
-                int32_t bin1 = binXOffset + col;
-                int32_t bin2 = binYOffset + row;
-
-                float counts;
-                if (useShort) {
-                    int16_t c = readInt16FromFile(bufferin);
-                    if (c != -32768) {
-                        appendRecord(v, index++, bin1, bin2, c);
-                    }
-                } else {
-                    counts = readFloatFromFile(bufferin);
-                    if (!isnan(counts)) {
-                        appendRecord(v, index++, bin1, bin2, counts);
-                    }
-                }
-            }
+            // the cells follow as one array, row by row; the decoder skips the empty ones
+            int64_t cellsStart = bufferin.tellg();
+            int64_t cellSize = useShort ? sizeof(int16_t) : sizeof(float);
+            nPts = static_cast<int32_t>(max((int64_t) 0, min((int64_t) nPts,
+                                                             (uncompressedSize - cellsStart) / cellSize)));
+            v.resize(nPts);
+            index = static_cast<int32_t>(decodeDenseBlock(uncompressedBytes + cellsStart, nPts, w, useShort,
+                                                          binXOffset, binYOffset, v.data()));
+            v.resize(index);
         }
     }
     delete[] compressedBytes;
@@ -1142,6 +1315,17 @@ vector<contactRecord> readBlock(const string &fileName, indexEntry idx, int32_t
     return v;
 }
 
+// the same, opening the file for just this block
+vector<contactRecord> readBlock(const string &fileName, indexEntry idx, int32_t version) {
+    if (idx.size <= 0) {
+        return {};
+    }
+    HiCFileStream stream(fileName);
+    vector<contactRecord> records = readBlock(stream, idx, version);
+    stream.close();
+    return records;
+}
+
 // reads the normalization vector from the file at the specified location
 vector<double> readNormalizationVector(istream &bufferin, int32_t version) {
     int64_t nValues;
@@ -1168,73 +1352,206 @@ vector<double> readNormalizationVector(istream &bufferin, int32_t version) {
     return values;
 }
 
-// Modify the BlockResult struct to include block number for sorting
+vector<double> readNormalizationVectorFromFooter(indexEntry cNormEntry, int32_t version, const string &fileName) {
+    char *buffer = readCompressedBytesFromFile(fileName, cNormEntry);
+    memstream bufferin(buffer, cNormEntry.size);
+    vector<double> cNorm = readNormalizationVector(bufferin, version);
+    delete buffer;
+    return cNorm;
+}
+
+// reads only the entries for bins [firstBin, lastBin] of the normalization vector stored at cNormEntry; entries have a
+// fixed size per version, so their byte range is known without reading the rest of the vector
+vector<double> readNormalizationVectorSliceFromFooter(indexEntry cNormEntry, int32_t version, const string &fileName,
+                                                      int64_t firstBin, int64_t lastBin) {
+    int64_t headerSize = version > 8 ? sizeof(int64_t) : sizeof(int32_t);
+    int64_t entrySize = version > 8 ? sizeof(float) : sizeof(double);
+    indexEntry slice{};
+    slice.position = cNormEntry.position + headerSize + firstBin * entrySize;
+    slice.size = (lastBin - firstBin + 1) * entrySize;
+
+    char *buffer = readCompressedBytesFromFile(fileName, slice);
+    memstream bufferin(buffer, slice.size);
+    vector<double> values(static_cast<size_t>(lastBin - firstBin + 1));
+    for (double &value : values) {
+        if (version > 8) {
+            value = (double) readFloatFromFile(bufferin);
+        } else {
+            value = readDoubleFromFile(bufferin);
+        }
+    }
+    delete buffer;
+    return values;
+}
+
+// normalization values for bins [firstBin, firstBin + values->size()) of one chromosome
+struct NormVectorSlice {
+    int64_t firstBin;
+    shared_ptr<const vector<double>> values;
+
+    double operator[](int64_t bin) const {
+        return (*values)[bin - firstBin];
+    }
+};
+
+// fraction of a normalization vector below which queries read only the bins they need; negative means the default,
+// which is 0.1 for remote files and 0 (always read and cache the whole vector) for local ones
+static atomic<double> partialNormVectorReadFraction{-1};
+
+void setPartialNormVectorReadFraction(double maxFraction) {
+    partialNormVectorReadFraction = maxFraction;
+}
+
+// normalization vectors of one file keyed by (chromosome, norm, unit, resolution). every HiCFile and MatrixZoomData
+// open on the same file shares one cache, so each vector is read once while they are in use and then handed out
+// without copying. the file is identified by its name and master index position, so a file rewritten at the same path
+// gets a new cache, and a cache is released with the last object holding it.
+class NormVectorCache {
+public:
+    static shared_ptr<NormVectorCache> forFile(const string &fileName, int64_t master) {
+        static mutex registryMutex;
+        static map<pair<string, int64_t>, weak_ptr<NormVectorCache>> registry;
+        lock_guard<mutex> lock(registryMutex);
+        for (auto it = registry.begin(); it != registry.end();) {
+            it = it->second.expired() ? registry.erase(it) : next(it);
+        }
+        weak_ptr<NormVectorCache> &slot = registry[make_pair(fileName, master)];
+        shared_ptr<NormVectorCache> cache = slot.lock();
+        if (!cache) {
+            cache = make_shared<NormVectorCache>();
+            slot = cache;
+        }
+        return cache;
+    }
+
+    // the vector stored at cNormEntry, read on the first request for its key
+    shared_ptr<const vector<double>> get(int32_t chrIdx, const string &norm, const string &unit, int32_t resolution,
+                                         indexEntry cNormEntry, int32_t version, const string &fileName) {
+        return getOrMake(chrIdx, norm, unit, resolution, [&]() {
+            return readNormalizationVectorFromFooter(cNormEntry, version, fileName);
+        });
+    }
+
+    // the vector made by make() on the first request for its key, for vectors the file doesn't store
+    template<typename F>
+    shared_ptr<const vector<double>> getOrMake(int32_t chrIdx, const string &norm, const string &unit,
+                                               int32_t resolution, F make) {
+        shared_ptr<Entry> entry;
+        {
+            lock_guard<mutex> lock(entriesMutex);
+            shared_ptr<Entry> &slot = entries[make_tuple(chrIdx, norm, unit, resolution)];
+            if (!slot) {
+                slot = make_shared<Entry>();
+            }
+            entry = slot;
+        }
+        // read outside the lock so different vectors load concurrently
+        call_once(entry->loaded, [&]() {
+            entry->values = make_shared<const vector<double>>(make());
+            entry->ready.store(true, memory_order_release);
+        });
+        return entry->values;
+    }
+
+    // the vector if it has already been read, otherwise null
+    shared_ptr<const vector<double>> find(int32_t chrIdx, const string &norm, const string &unit, int32_t resolution) {
+        lock_guard<mutex> lock(entriesMutex);
+        auto it = entries.find(make_tuple(chrIdx, norm, unit, resolution));
+        if (it == entries.end() || !it->second->ready.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        return it->second->values;
+    }
+
+private:
+    struct Entry {
+        once_flag loaded;
+        atomic<bool> ready{false};
+        shared_ptr<const vector<double>> values;
+    };
+    mutex entriesMutex;
+    map<tuple<int32_t, string, string, int32_t>, shared_ptr<Entry>> entries;
+};
+
+// Modify the BlockResult struct to include the block's file position for sorting
 struct BlockResult {
     vector<contactRecord> records;
-    int32_t blockNumber;
+    int64_t position;
 };
 
 // Add a comparison function for sorting BlockResults
 bool compareBlockResults(const BlockResult &a, const BlockResult &b) {
-    return a.blockNumber < b.blockNumber;
+    return a.position < b.position;
 }
 
-// Add this helper function that processes a single block
-BlockResult processBlock(const string &filename, indexEntry idx, int32_t version,
-                       int64_t *regionIndices, int32_t resolution,
-                       const string &norm, vector<double> &c1Norm, vector<double> &c2Norm,
-                       bool isIntra, const string &matrixType, vector<double> &expectedValues,
-                       double avgCount) {
+// the normalize stage of one query: reciprocals of the normalization values over the queried bins and of the
+// expected values over the queried distances, so normalizing a record takes multiplies only
+struct QueryScaling {
+    vector<double> rowFactors, colFactors, distanceFactors;
+    scaleTables tables{};
+};
+
+// 1 / normalization value for bins [firstBin, lastBin]; bins the slice doesn't cover get NaN so their records are dropped
+static vector<double> getReciprocalNormFactors(const NormVectorSlice &slice, int64_t firstBin, int64_t lastBin) {
+    vector<double> factors(static_cast<size_t>(lastBin - firstBin + 1));
+    int64_t sliceEnd = slice.firstBin + static_cast<int64_t>(slice.values->size());
+    for (int64_t bin = firstBin; bin <= lastBin; bin++) {
+        factors[bin - firstBin] = bin >= slice.firstBin && bin < sliceEnd ? 1.0 / slice[bin] : NAN;
+    }
+    return factors;
+}
+
+// picks the records of a decoded block that fall in the region (genomic coordinates; either orientation for intra
+// matrices) and, for band queries, within maxDistance bins of the diagonal, applies the normalize stage and converts
+// them to genomic coordinates. records are in bins, as read.
+BlockResult selectBlockRecords(const vector<contactRecord> &records, int64_t position, const int64_t *regionIndices,
+                               int32_t resolution, bool isIntra, const scaleTables *tables,
+                               int64_t maxDistance = numeric_limits<int64_t>::max()) {
     BlockResult result;
-    vector<contactRecord> records = readBlock(filename, idx, version);
-    vector<contactRecord> filteredRecords;
-    
-    for (contactRecord rec : records) {
-        int64_t x = rec.binX * resolution;
-        int64_t y = rec.binY * resolution;
+    vector<contactRecord> selected;
+    for (const contactRecord &rec : records) {
+        // band queries drop the contacts too far from the diagonal before anything else is done with them
+        if (abs((int64_t) rec.binY - rec.binX) > maxDistance) continue;
+        int64_t x = (int64_t) rec.binX * resolution;
+        int64_t y = (int64_t) rec.binY * resolution;
 
         if ((x >= regionIndices[0] && x <= regionIndices[1] &&
              y >= regionIndices[2] && y <= regionIndices[3]) ||
-            (isIntra && y >= regionIndices[0] && y <= regionIndices[1] && 
+            (isIntra && y >= regionIndices[0] && y <= regionIndices[1] &&
              x >= regionIndices[2] && x <= regionIndices[3])) {
+            selected.push_back(rec);
+        }
+    }
 
-            float c = rec.counts;
-            if (norm != "NONE") {
-                c = static_cast<float>(c / (c1Norm[rec.binX] * c2Norm[rec.binY]));
-            }
-            if (matrixType == "oe") {
-                if (isIntra) {
-                    c = static_cast<float>(c / expectedValues[min(expectedValues.size() - 1,
-                                                              (size_t) floor(abs(y - x) /
-                                                                         resolution))]);
-                } else {
-                    c = static_cast<float>(c / avgCount);
-                }
-            } else if (matrixType == "expected") {
-                if (isIntra) {
-                    c = static_cast<float>(expectedValues[min(expectedValues.size() - 1,
-                                                              (size_t) floor(abs(y - x) /
-                                                                         resolution))]);
-                } else {
-                    c = static_cast<float>(avgCount);
-                }
-            }
+    if (tables != nullptr) {
+        scaleContactRecords(selected.data(), selected.size(), *tables);
+    }
 
-            if (!isnan(c) && !isinf(c)) {
-                contactRecord record = contactRecord();
-                record.binX = static_cast<int32_t>(x);
-                record.binY = static_cast<int32_t>(y);
-                record.counts = c;
-                filteredRecords.push_back(record);
-            }
+    size_t numKept = 0;
+    for (const contactRecord &rec : selected) {
+        if (!isnan(rec.counts) && !isinf(rec.counts)) {
+            contactRecord record = contactRecord();
+            record.binX = static_cast<int32_t>((int64_t) rec.binX * resolution);
+            record.binY = static_cast<int32_t>((int64_t) rec.binY * resolution);
+            record.counts = rec.counts;
+            selected[numKept++] = record;
         }
     }
-    
-    result.records = filteredRecords;
-    result.blockNumber = idx.position;
+    selected.resize(numKept);
+
+    result.records = move(selected);
+    result.position = position;
     return result;
 }
 
+// Add this helper function that processes a single block
+BlockResult processBlock(const string &filename, indexEntry idx, int32_t version,
+                       const int64_t *regionIndices, int32_t resolution, bool isIntra, const scaleTables *tables,
+                       int64_t maxDistance = numeric_limits<int64_t>::max()) {
+    return selectBlockRecords(readBlock(filename, idx, version), idx.position, regionIndices, resolution, isIntra,
+                              tables, maxDistance);
+}
+
 class ThreadPool {
 public:
     explicit ThreadPool(size_t numThreads) : stop(false) {
@@ -1294,33 +1611,265 @@ private:
     bool stop;
 };
 
+// worker threads to use: every core but one, and at least one (hardware_concurrency may return 0)
+static unsigned int getNumWorkerThreads() {
+    unsigned int numCores = thread::hardware_concurrency();
+    return numCores > 1 ? numCores - 1 : 1u;
+}
+
+// directory that vectors computed from the observed counts (normalization and expected vectors the file lacks) are
+// cached in, so later processes use them like stored ones. null means the default, $STRAW_CACHE_DIR or else
+// ~/.cache/straw; empty turns the cache off.
+static mutex computedVectorCacheMutex;
+static unique_ptr<string> computedVectorCacheDirectory;
+
+void setComputedVectorCacheDirectory(const string &directory) {
+    lock_guard<mutex> lock(computedVectorCacheMutex);
+    computedVectorCacheDirectory.reset(new string(directory));
+}
+
+static string getComputedVectorCacheDirectory() {
+    lock_guard<mutex> lock(computedVectorCacheMutex);
+    if (computedVectorCacheDirectory) {
+        return *computedVectorCacheDirectory;
+    }
+    const char *dir = getenv("STRAW_CACHE_DIR");
+    if (dir != nullptr) {
+        return dir;
+    }
+    const char *home = getenv("HOME");
+    return home != nullptr ? string(home) + "/.cache/straw" : string();
+}
+
+// cache file of a computed vector: named after a hash of the file's name and master index position (which moves when
+// the file is rewritten) and the vector's key. empty when caching is off.
+static string getComputedVectorPath(const string &fileName, int64_t master, const string &key) {
+    string dir = getComputedVectorCacheDirectory();
+    if (dir.empty()) {
+        return dir;
+    }
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a, stable across builds
+    for (char c : fileName + "@" + to_string(master)) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    stringstream path;
+    path << dir << "/" << hex << hash << dec << "_" << key << ".vec";
+    return path.str();
+}
+
+static const char computedVectorMagic[8] = {'S', 'T', 'R', 'A', 'W', 'V', 'E', 'C'};
+
+static bool readComputedVector(const string &path, vector<double> &values) {
+    if (path.empty()) {
+        return false;
+    }
+    ifstream fin(path, ios::binary);
+    char magic[8];
+    int64_t n = 0;
+    if (!fin.read(magic, 8) || memcmp(magic, computedVectorMagic, 8) != 0 ||
+        !fin.read(reinterpret_cast<char *>(&n), sizeof(n)) || n < 0) {
+        return false;
+    }
+    values.resize(static_cast<size_t>(n));
+    return static_cast<bool>(fin.read(reinterpret_cast<char *>(values.data()), n * sizeof(double)));
+}
+
+// written to a temporary file first and renamed into place, so readers never see a partial vector
+static void writeComputedVector(const string &path, const vector<double> &values) {
+    if (path.empty()) {
+        return;
+    }
+    string dir = path.substr(0, path.rfind('/'));
+    for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+        mkdir(dir.substr(0, slash).c_str(), 0755);
+        if (slash == string::npos) break;
+    }
+    stringstream tmp;
+    tmp << path << ".tmp" << this_thread::get_id();
+    {
+        ofstream fout(tmp.str(), ios::binary);
+        auto n = static_cast<int64_t>(values.size());
+        fout.write(computedVectorMagic, 8);
+        fout.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        fout.write(reinterpret_cast<const char *>(values.data()), n * sizeof(double));
+        if (!fout) {
+            cerr << "Could not write " << tmp.str() << endl;
+            return;
+        }
+    }
+    if (rename(tmp.str().c_str(), path.c_str()) != 0) {
+        remove(tmp.str().c_str());
+    }
+}
+
+// the upper triangle of the observed intrachromosomal matrix of one chromosome, one entry per stored contact
+struct SparseSymmetricMatrix {
+    int64_t numBins = 0;
+    vector<int32_t> rows;
+    vector<int32_t> cols;
+    vector<float> values;
+};
+
+// y = M * x, with M symmetric and stored as its upper triangle. the entries are split into
+// one contiguous chunk per worker, each with its own partial product.
+static void multiplySymmetric(const SparseSymmetricMatrix &matrix, const vector<double> &x, vector<double> &y,
+                              ThreadPool &pool, size_t numThreads) {
+    const size_t numEntries = matrix.values.size();
+    const size_t entriesPerThread = (numEntries + numThreads - 1) / max<size_t>(numThreads, 1);
+    vector<future<vector<double>>> futures;
+    for (size_t first = 0; first < numEntries; first += entriesPerThread) {
+        size_t last = min(numEntries, first + entriesPerThread);
+        futures.push_back(pool.enqueue([&matrix, &x, first, last]() {
+            vector<double> partial(static_cast<size_t>(matrix.numBins), 0);
+            for (size_t e = first; e < last; e++) {
+                int32_t r = matrix.rows[e], c = matrix.cols[e];
+                partial[r] += matrix.values[e] * x[c];
+                if (r != c) {
+                    partial[c] += matrix.values[e] * x[r];
+                }
+            }
+            return partial;
+        }));
+    }
+    y.assign(static_cast<size_t>(matrix.numBins), 0);
+    for (auto &future : futures) {
+        vector<double> partial = future.get();
+        for (size_t i = 0; i < y.size(); i++) {
+            y[i] += partial[i];
+        }
+    }
+}
+
+// scales a normalization vector so the normalized matrix keeps the total count of the observed one, as juicer does
+static void scaleNormToObservedSum(const SparseSymmetricMatrix &matrix, vector<double> &norm) {
+    double observed = 0, normalized = 0;
+    for (size_t e = 0; e < matrix.values.size(); e++) {
+        double n = norm[matrix.rows[e]] * norm[matrix.cols[e]];
+        if (isnan(n) || n == 0) continue;
+        double weight = matrix.rows[e] == matrix.cols[e] ? 1 : 2;
+        observed += weight * matrix.values[e];
+        normalized += weight * matrix.values[e] / n;
+    }
+    if (observed > 0 && normalized > 0) {
+        double factor = sqrt(normalized / observed);
+        for (double &value : norm) {
+            value *= factor;
+        }
+    }
+}
+
+// a VC, VC_SQRT or balanced (KR / SCALE) normalization vector for the matrix; bins without coverage get NaN. balancing
+// scales the rows until every row of the normalized matrix has the same sum (the fixed point both KR and SCALE reach),
+// each iteration one multithreaded product with the sparse matrix, after dropping the rows with less than 5% of the
+// mean coverage, which only slow convergence down.
+static vector<double> computeNormVector(const SparseSymmetricMatrix &matrix, const string &norm) {
+    const auto numBins = static_cast<size_t>(matrix.numBins);
+    unsigned int maxThreads = getNumWorkerThreads();
+    size_t numThreads = max(1u, min(maxThreads, static_cast<unsigned int>(matrix.values.size() / 100000 + 1)));
+    ThreadPool pool(numThreads);
+
+    vector<double> rowSums;
+    multiplySymmetric(matrix, vector<double>(numBins, 1), rowSums, pool, numThreads);
+    vector<double> result(numBins, NAN);
+    if (norm == "VC" || norm == "VC_SQRT") {
+        for (size_t i = 0; i < numBins; i++) {
+            if (rowSums[i] > 0) {
+                result[i] = norm == "VC" ? rowSums[i] : sqrt(rowSums[i]);
+            }
+        }
+        scaleNormToObservedSum(matrix, result);
+        return result;
+    }
+
+    double meanRowSum = 0;
+    size_t numCovered = 0;
+    for (double sum : rowSums) {
+        if (sum > 0) {
+            meanRowSum += sum;
+            numCovered++;
+        }
+    }
+    meanRowSum = numCovered > 0 ? meanRowSum / numCovered : 0;
+    // x holds 1 / norm for the bins being balanced and 0 for the rest
+    vector<double> x(numBins, 0), products;
+    for (size_t i = 0; i < numBins; i++) {
+        if (rowSums[i] > 0 && rowSums[i] >= 0.05 * meanRowSum) x[i] = 1;
+    }
+    const int32_t maxIterations = 500;
+    const double tolerance = 1e-5;
+    bool converged = numCovered == 0;
+    for (int32_t iteration = 0; iteration < maxIterations && !converged; iteration++) {
+        multiplySymmetric(matrix, x, products, pool, numThreads);
+        double mean = 0;
+        size_t numValid = 0;
+        for (size_t i = 0; i < numBins; i++) {
+            if (x[i] > 0) {
+                mean += x[i] * products[i];
+                numValid++;
+            }
+        }
+        if (numValid == 0 || mean <= 0) break;
+        mean /= numValid;
+        double maxError = 0;
+        for (size_t i = 0; i < numBins; i++) {
+            if (x[i] <= 0) continue;
+            double ratio = x[i] * products[i] / mean;
+            if (ratio <= 0) {
+                // rows left with nothing to balance against
+                x[i] = 0;
+                continue;
+            }
+            maxError = max(maxError, fabs(ratio - 1));
+            x[i] /= sqrt(ratio);
+        }
+        converged = maxError < tolerance;
+    }
+    if (!converged) {
+        cerr << norm << " balancing did not converge in " << maxIterations << " iterations" << endl;
+    }
+    for (size_t i = 0; i < numBins; i++) {
+        if (x[i] > 0) result[i] = 1 / x[i];
+    }
+    scaleNormToObservedSum(matrix, result);
+    return result;
+}
+
+// the expected values of chromosome chrIdx for a norm (NONE included), computed from the observed counts of every
+// chromosome when the file doesn't store them. computed holds the genome-wide values, which are shared with every
+// caller for the same file while one of them keeps its pointer; defined after HiCFile
+struct ComputedExpected;
+static bool computeExpectedValues(const string &fileName, int64_t master, const string &norm, const string &unit,
+                                  int32_t resolution, int32_t chrIdx, vector<double> &expectedValues,
+                                  shared_ptr<ComputedExpected> &computed);
+
+// process-wide totals of the per-matrix block counters, see getBlockReadStats
+static atomic<int64_t> totalBlocksRead{0};
+static atomic<int64_t> totalBlocksContributed{0};
+
 class MatrixZoomData {
 public:
     bool isIntra;
     string fileName;
-    int64_t myFilePos = 0LL;
-    vector<double> expectedValues;
-    bool foundFooter = false;
-    vector<double> c1Norm;
-    vector<double> c2Norm;
     int32_t c1 = 0;
     int32_t c2 = 0;
     string matrixType;
     string norm;
+    string unit;
     int32_t version = 0;
     int32_t resolution = 0;
     int32_t numBins1 = 0;
     int32_t numBins2 = 0;
-    float sumCounts;
-    int32_t blockBinCount, blockColumnCount;
-    map<int32_t, indexEntry> blockMap;
-    double avgCount;
+    int64_t master = 0LL;
 
+    // nothing is read here; the footer entries, block index, normalization vectors and expected values are each
+    // loaded from the file the first time they are needed, so a MatrixZoomData for every chromosome pair is cheap
     MatrixZoomData(const chromosome &chrom1, const chromosome &chrom2, const string &matrixType,
                    const string &norm, const string &unit, int32_t resolution,
                    int32_t &version, int64_t &master, int64_t &totalFileSize,
-                   const string &fileName) {
+                   const string &fileName, shared_ptr<NormVectorCache> normVectorCache = nullptr) {
+        this->normVectorCache = normVectorCache ? normVectorCache : NormVectorCache::forFile(fileName, master);
         this->version = version;
+        this->master = master;
         this->fileName = fileName;
         int32_t c01 = chrom1.index;
         int32_t c02 = chrom2.index;
@@ -1339,96 +1888,106 @@ public:
 
         this->matrixType = matrixType;
         this->norm = norm;
+        this->unit = unit;
         this->resolution = resolution;
+    }
 
-        HiCFileStream *stream = new HiCFileStream(fileName);
-        indexEntry c1NormEntry{}, c2NormEntry{};
-
-        if (stream->isHttp) {
-            foundFooter = readFooterURL(stream->curl, master, version, c1, c2, matrixType, norm, unit,
-                                     resolution,
-                                     myFilePos,
-                                     c1NormEntry, c2NormEntry, expectedValues);
-        } else {
-            stream->fin.seekg(master, ios::beg);
-            foundFooter = readFooter(stream->fin, master, version, c1, c2, matrixType, norm,
-                                     unit,
-                                     resolution, myFilePos,
-                                     c1NormEntry, c2NormEntry, expectedValues);
-        }
-
-        if (!foundFooter) {
-            return;
-        }
-        stream->close();
+    bool hasFooter() {
+        loadFooter();
+        return foundFooter;
+    }
 
-        if (norm != "NONE") {
-            c1Norm = readNormalizationVectorFromFooter(c1NormEntry, version, fileName);
-            if (isIntra) {
-                c2Norm = c1Norm;
-            } else {
-                c2Norm = readNormalizationVectorFromFooter(c2NormEntry, version, fileName);
-            }
-        }
+    // blocks read by queries on this matrix, and how many of them held records for the queried region
+    int64_t getNumBlocksRead() const {
+        return numBlocksRead;
+    }
 
-        HiCFileStream *stream2 = new HiCFileStream((fileName));
-        if (stream2->isHttp) {
-            // readMatrix will assign blockBinCount and blockColumnCount
-            blockMap = readMatrixHttp(stream2->curl, myFilePos, unit, resolution, sumCounts,
-                                      blockBinCount,
-                                      blockColumnCount);
-        } else {
-            // readMatrix will assign blockBinCount and blockColumnCount
-            blockMap = readMatrix(stream2->fin, myFilePos, unit, resolution, sumCounts,
-                                  blockBinCount,
-                                  blockColumnCount);
-        }
-        stream2->close();
+    int64_t getNumBlocksContributed() const {
+        return numBlocksContributed;
+    }
 
-        if (!isIntra) {
-            avgCount = (sumCounts / numBins1) / numBins2;   // <= trying to avoid overflows
-        }
+    const map<int32_t, indexEntry> &getBlockMap() {
+        loadBlockIndex();
+        return blockMap;
     }
 
-    static vector<double> readNormalizationVectorFromFooter(indexEntry cNormEntry, int32_t &version,
-                                                            const string &fileName) {
-        char *buffer = readCompressedBytesFromFile(fileName, cNormEntry);
-        memstream bufferin(buffer, cNormEntry.size);
-        vector<double> cNorm = readNormalizationVector(bufferin, version);
-        delete buffer;
-        return cNorm;
+    float getSumCounts() {
+        loadBlockIndex();
+        return sumCounts;
     }
 
     static bool isInRange(int32_t r, int32_t c, int32_t numRows, int32_t numCols) {
         return 0 <= r && r < numRows && 0 <= c && c < numCols;
     }
 
-    set<int32_t> getBlockNumbers(int64_t *regionIndices) const {
+    // visits every block in the index that may hold records for the region, in file order
+    template<typename F>
+    void forEachBlock(const int64_t *regionIndices, F visit) const {
         if (version > 8 && isIntra) {
-            return getBlockNumbersForRegionFromBinPositionV9Intra(regionIndices, blockBinCount, blockColumnCount);
+            BlockRange range = getBlockRangeForRegionFromBinPositionV9Intra(regionIndices, blockBinCount);
+            const int32_t bbc = blockBinCount, bcc = blockColumnCount;
+            forEachBlockInRanges(blockMap, &range, 1, bcc,
+                                 [regionIndices, bbc, bcc, &visit](int32_t blockNumber, const indexEntry &idx) {
+                if (isBlockInRegionV9Intra(regionIndices, blockNumber / bcc, blockNumber % bcc, bbc)) {
+                    visit(blockNumber, idx);
+                }
+            });
+        } else {
+            BlockRange ranges[2];
+            int32_t numRanges = getBlockRangesForRegionFromBinPosition(regionIndices, blockBinCount, isIntra, ranges);
+            forEachBlockInRanges(blockMap, ranges, numRanges, blockColumnCount, visit);
+        }
+    }
+
+    // visits every block in the index that may hold records of the intra square [b0, b1] x [b0, b1] (in bins) within
+    // maxDistance bins of the diagonal, in file order. for v9 files only the depth layers up to maxDistance are
+    // considered; otherwise each block row is limited to the block columns near the diagonal.
+    template<typename F>
+    void forEachBandBlock(const int64_t *regionIndices, int64_t maxDistance, F visit) const {
+        if (version > 8) {
+            const int32_t bbc = blockBinCount, bcc = blockColumnCount;
+            BlockRange range = {0, getV9Depth(maxDistance, bbc),
+                                static_cast<int32_t>(regionIndices[0] / bbc), static_cast<int32_t>(regionIndices[1] / bbc)};
+            forEachBlockInRanges(blockMap, &range, 1, bcc,
+                                 [regionIndices, maxDistance, bbc, bcc, &visit](int32_t blockNumber,
+                                                                                const indexEntry &idx) {
+                if (isBlockInRegionV9Intra(regionIndices, blockNumber / bcc, blockNumber % bcc, bbc, maxDistance)) {
+                    visit(blockNumber, idx);
+                }
+            });
         } else {
-            return getBlockNumbersForRegionFromBinPosition(regionIndices, blockBinCount, blockColumnCount, isIntra);
+            // blocks more than this many rows or columns off the diagonal only hold contacts beyond maxDistance
+            const int64_t maxBlockOffset = maxDistance / blockBinCount + 1;
+            const auto first = static_cast<int32_t>(regionIndices[0] / blockBinCount);
+            const auto last = static_cast<int32_t>((regionIndices[1] + 1) / blockBinCount);
+            for (int32_t r = first; r <= last; r++) {
+                BlockRange range = {r, r, static_cast<int32_t>(max<int64_t>(first, r - maxBlockOffset)),
+                                    static_cast<int32_t>(min<int64_t>(last, r + maxBlockOffset))};
+                forEachBlockInRanges(blockMap, &range, 1, blockColumnCount, visit);
+            }
         }
     }
 
-    vector<double> getNormVector(int32_t index) {
+    const vector<double> &getNormVector(int32_t index) {
+        loadNorms();
         if (index == c1) {
-            return c1Norm;
+            return *c1Norm;
         } else if (index == c2) {
-            return c2Norm;
+            return *c2Norm;
         }
         cerr << "Invalid index provided: " << index << endl;
         cerr << "Should be either " << c1 << " or " << c2 << endl;
-        vector<double> v;
+        static const vector<double> v;
         return v;
     }
 
     vector<double> getExpectedValues() {
+        loadExpected();
         return expectedValues;
     }
 
     vector<contactRecord> getRecords(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) {
-        if (!foundFooter) {
+        if (!loadForRecords()) {
             vector<contactRecord> v;
             return v;
         }
@@ -1436,57 +1995,318 @@ public:
         int64_t regionIndices[4];
         convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
 
-        set<int32_t> blockNumbers = getBlockNumbers(regionIndices);
-        vector<BlockResult> allResults;
-        vector<future<BlockResult>> futures;
-        
-        // Adjust thread count based on block count and available cores
-        unsigned int maxThreads = thread::hardware_concurrency() - 1;
-        unsigned int numThreads = max(1u, min(
-            maxThreads,                // Don't use more than available cores minus one
-            static_cast<unsigned int>(blockNumbers.size())  // Don't create more threads than blocks
-        ));
-        
-        ThreadPool pool(numThreads);
+        NormVectorSlice c1NormSlice, c2NormSlice;
+        getNormSlices(regionIndices, c1NormSlice, c2NormSlice);
 
-        // Submit all tasks to thread pool
-        for (int32_t blockNumber : blockNumbers) {
-            futures.push_back(
-                pool.enqueue([this, blockNumber, &origRegionIndices]() {
-                    return processBlock(
-                        fileName, blockMap[blockNumber], version,
-                        origRegionIndices, resolution,
-                        norm, c1Norm, c2Norm, isIntra,
-                        matrixType, expectedValues, avgCount
-                    );
-                })
-            );
-        }
+        QueryScaling scaling;
+        const scaleTables *tables = buildScaleTables(regionIndices, c1NormSlice, c2NormSlice, scaling)
+                                    ? &scaling.tables : nullptr;
 
-        // Collect all results
-        allResults.reserve(futures.size());
-        for (auto& future : futures) {
-            allResults.push_back(future.get());
+        vector<indexEntry> blocks;
+        forEachBlock(regionIndices, [&blocks](int32_t, const indexEntry &idx) {
+            blocks.push_back(idx);
+        });
+        return readBlockRecords(blocks, origRegionIndices, tables, numeric_limits<int64_t>::max());
+    }
+
+    // the records of an intrachromosomal matrix in [start, end] (genomic) at most maxDistance (genomic) from the
+    // diagonal, as getRecords(start, end, start, end) would return them after dropping the contacts further away.
+    // only the blocks that reach into the band are read, and the distance filter runs as each block is decoded.
+    vector<contactRecord> getBandRecords(int64_t start, int64_t end, int64_t maxDistance) {
+        if (!isIntra) {
+            cerr << "Band queries need an intrachromosomal matrix" << endl;
+            return {};
+        }
+        if (maxDistance < 0 || !loadForRecords()) {
+            return {};
         }
+        int64_t origRegionIndices[] = {start, end, start, end};
+        int64_t regionIndices[4];
+        convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+        const int64_t maxDistanceBins = maxDistance / resolution;
 
-        // Sort results by block number to maintain consistent order
-        sort(allResults.begin(), allResults.end(), compareBlockResults);
+        NormVectorSlice c1NormSlice, c2NormSlice;
+        getNormSlices(regionIndices, c1NormSlice, c2NormSlice);
 
-        // Combine all records in sorted order
-        vector<contactRecord> records;
-        size_t totalSize = 0;
-        for (const auto& result : allResults) {
-            totalSize += result.records.size();
+        QueryScaling scaling;
+        const scaleTables *tables = buildScaleTables(regionIndices, c1NormSlice, c2NormSlice, scaling)
+                                    ? &scaling.tables : nullptr;
+
+        vector<indexEntry> blocks;
+        forEachBandBlock(regionIndices, maxDistanceBins, [&blocks](int32_t, const indexEntry &idx) {
+            blocks.push_back(idx);
+        });
+        return readBlockRecords(blocks, origRegionIndices, tables, maxDistanceBins);
+    }
+
+    // the band of an intrachromosomal matrix in [start, end] within maxDistance of the diagonal, stored by diagonal:
+    // row i is bin start / resolution + i and column d holds its contact with the bin d further along, for d up to
+    // maxDistance / resolution (cells past the end of the region stay 0)
+    vector<vector<float> > getBandMatrix(int64_t start, int64_t end, int64_t maxDistance) {
+        vector<contactRecord> records = getBandRecords(start, end, maxDistance);
+        if (records.empty()) {
+            return vector<vector<float> >(1, vector<float>(1, 0));
         }
-        records.reserve(totalSize);
-        
-        for (const auto& result : allResults) {
-            records.insert(records.end(), 
-                          result.records.begin(), 
-                          result.records.end());
+        const int64_t first = start / resolution;
+        const auto numRows = static_cast<int32_t>(end / resolution - first + 1);
+        const auto numDiagonals = static_cast<int32_t>(maxDistance / resolution + 1);
+        vector<vector<float> > band(numRows, vector<float>(numDiagonals, 0));
+        for (const contactRecord &cr : records) {
+            int64_t x = cr.binX / resolution, y = cr.binY / resolution;
+            int64_t r = min(x, y) - first, d = abs(y - x);
+            if (isInRange(static_cast<int32_t>(r), static_cast<int32_t>(d), numRows, numDiagonals)) {
+                band[r][d] = cr.counts;
+            }
         }
+        return band;
+    }
 
-        return records;
+    // the records for each of several regions (genomic, in the same order as for getRecords), as getRecords would
+    // return them. blocks are gathered over all regions first, so a block that several regions need is read and
+    // decoded once; each block task then picks out the records of every region that needs it.
+    vector<vector<contactRecord>> getRecordsForRegions(const vector<queryRegion> &regions) {
+        vector<vector<contactRecord>> results(regions.size());
+        if (regions.empty() || !loadForRecords()) {
+            return results;
+        }
+        RegionBatch batch;
+        prepareRegionBatch(regions, batch);
+
+        unsigned int maxThreads = getNumWorkerThreads();
+        unsigned int numThreads = max(1u, min(maxThreads, static_cast<unsigned int>(batch.blocks.size())));
+        ThreadPool pool(numThreads);
+
+        typedef vector<pair<int32_t, BlockResult>> RegionResults;
+        vector<future<RegionResults>> futures;
+        for (const auto &block : batch.blocks) {
+            const auto *blockEntry = &block;
+            futures.push_back(pool.enqueue([this, blockEntry, &batch]() {
+                const indexEntry &idx = blockEntry->first;
+                vector<contactRecord> blockRecords = readBlock(fileName, idx, version);
+                RegionResults regionResults;
+                for (int32_t r : blockEntry->second) {
+                    BlockResult result = selectBlockRecords(blockRecords, idx.position,
+                                                            &batch.origRegionIndices[4 * r], resolution, isIntra,
+                                                            batch.tables[r]);
+                    if (!result.records.empty()) {
+                        regionResults.emplace_back(r, move(result));
+                    }
+                }
+                return regionResults;
+            }));
+        }
+
+        vector<vector<BlockResult>> resultsPerRegion(regions.size());
+        int64_t contributed = 0;
+        for (auto &future : futures) {
+            RegionResults regionResults = future.get();
+            if (!regionResults.empty()) contributed++;
+            for (auto &regionResult : regionResults) {
+                resultsPerRegion[regionResult.first].push_back(move(regionResult.second));
+            }
+        }
+        countBlocksRead(static_cast<int64_t>(futures.size()), contributed);
+
+        for (size_t r = 0; r < regions.size(); r++) {
+            results[r] = combineBlockResults(resultsPerRegion[r]);
+        }
+        return results;
+    }
+
+    // adds the (2 * window + 1) x (2 * window + 1) submatrix around each (row bin, column bin) center to sum (row-major,
+    // rows along the first chromosome) and returns how many centers were added; centers whose window runs off the
+    // chromosomes are skipped. blocks are read once for all centers, split among the threads, and each thread sums
+    // into its own matrix before the partial sums are added together.
+    int64_t addPileup(const vector<pair<int64_t, int64_t>> &centers, int32_t window, vector<double> &sum) {
+        const int64_t width = 2 * (int64_t) window + 1;
+        if (window < 0 || !loadForRecords()) {
+            return 0;
+        }
+        vector<queryRegion> regions;
+        for (const auto &center : centers) {
+            if (center.first - window < 0 || center.second - window < 0 ||
+                center.first + window > numBins1 || center.second + window > numBins2) {
+                continue;
+            }
+            regions.push_back({(center.first - window) * resolution, (center.first + window) * resolution,
+                               (center.second - window) * resolution, (center.second + window) * resolution});
+        }
+        if (regions.empty()) {
+            return 0;
+        }
+        RegionBatch batch;
+        prepareRegionBatch(regions, batch);
+
+        unsigned int maxThreads = getNumWorkerThreads();
+        size_t numThreads = max(1u, min(maxThreads, static_cast<unsigned int>(batch.blocks.size())));
+        ThreadPool pool(numThreads);
+
+        vector<future<pair<vector<double>, int64_t>>> futures;
+        size_t blocksPerThread = (batch.blocks.size() + numThreads - 1) / numThreads;
+        for (size_t first = 0; first < batch.blocks.size(); first += blocksPerThread) {
+            size_t last = min(batch.blocks.size(), first + blocksPerThread);
+            futures.push_back(pool.enqueue([this, first, last, width, &batch]() {
+                vector<double> partial(static_cast<size_t>(width * width), 0);
+                int64_t contributed = 0;
+                for (size_t b = first; b < last; b++) {
+                    const indexEntry &idx = batch.blocks[b].first;
+                    vector<contactRecord> blockRecords = readBlock(fileName, idx, version);
+                    bool anyRecords = false;
+                    for (int32_t r : batch.blocks[b].second) {
+                        const int64_t *orig = &batch.origRegionIndices[4 * r];
+                        BlockResult result = selectBlockRecords(blockRecords, idx.position, orig, resolution,
+                                                                isIntra, batch.tables[r]);
+                        anyRecords = anyRecords || !result.records.empty();
+                        addToPileup(result.records, orig[0] / resolution, orig[2] / resolution, width, partial);
+                    }
+                    if (anyRecords) contributed++;
+                }
+                return make_pair(move(partial), contributed);
+            }));
+        }
+
+        sum.resize(static_cast<size_t>(width * width), 0);
+        int64_t contributed = 0;
+        for (auto &future : futures) {
+            pair<vector<double>, int64_t> partial = future.get();
+            for (size_t i = 0; i < sum.size(); i++) {
+                sum[i] += partial.first[i];
+            }
+            contributed += partial.second;
+        }
+        countBlocksRead(static_cast<int64_t>(batch.blocks.size()), contributed);
+        return static_cast<int64_t>(regions.size());
+    }
+
+    // adds the (normalized) counts of every contact of an intrachromosomal matrix to contacts[distanceBins[d]], where d
+    // is the contact's distance from the diagonal in bins (distances past the table go to its last entry). each block
+    // is decoded, scaled and binned by one worker into its own partial sums; no records are kept.
+    bool addDistanceDecay(const vector<int32_t> &distanceBins, vector<double> &contacts) {
+        if (!isIntra) {
+            cerr << "Distance decay needs an intrachromosomal matrix" << endl;
+            return false;
+        }
+        if (distanceBins.empty() || !loadForRecords()) {
+            return false;
+        }
+        int64_t regionIndices[] = {0, numBins1, 0, numBins2};
+        NormVectorSlice c1NormSlice, c2NormSlice;
+        getNormSlices(regionIndices, c1NormSlice, c2NormSlice);
+        QueryScaling scaling;
+        const scaleTables *tables = buildScaleTables(regionIndices, c1NormSlice, c2NormSlice, scaling)
+                                    ? &scaling.tables : nullptr;
+
+        const size_t numDistanceBins = static_cast<size_t>(*max_element(distanceBins.begin(), distanceBins.end())) + 1;
+        const int64_t lastDistance = static_cast<int64_t>(distanceBins.size()) - 1;
+        vector<vector<double>> partials = accumulateBlocks<vector<double>>(
+                tables, [numDistanceBins]() { return vector<double>(numDistanceBins, 0); },
+                [&distanceBins, lastDistance](const vector<contactRecord> &records, vector<double> &partial) {
+            for (const contactRecord &rec : records) {
+                if (isnan(rec.counts) || isinf(rec.counts)) continue;
+                int64_t distance = min(abs((int64_t) rec.binY - rec.binX), lastDistance);
+                partial[distanceBins[distance]] += rec.counts;
+            }
+        });
+
+        contacts.resize(max(contacts.size(), numDistanceBins), 0);
+        for (const vector<double> &partial : partials) {
+            for (size_t i = 0; i < numDistanceBins; i++) {
+                contacts[i] += partial[i];
+            }
+        }
+        return true;
+    }
+
+    // loads what records anywhere in the matrix need and fills in scaling for them, as the whole-matrix passes use it;
+    // returns the tables to scale decoded records with, or null when they are used as read. ok is false if the file
+    // doesn't have this matrix or its expected values.
+    const scaleTables *getMatrixScaling(QueryScaling &scaling, bool &ok) {
+        ok = loadForRecords();
+        if (!ok) {
+            return nullptr;
+        }
+        int64_t regionIndices[] = {0, numBins1, 0, numBins2};
+        NormVectorSlice c1NormSlice, c2NormSlice;
+        getNormSlices(regionIndices, c1NormSlice, c2NormSlice);
+        return buildScaleTables(regionIndices, c1NormSlice, c2NormSlice, scaling) ? &scaling.tables : nullptr;
+    }
+
+    // sets windowSums[i] to the (normalized) contact sum between bins [i - window, i - 1] and [i + 1, i + window] of an
+    // intrachromosomal matrix, for every bin i (squares running off the chromosome are only partly summed). one pass
+    // over the blocks within 2 * window bins of the diagonal, in file order: a contact (a, b) with a < b lies in the
+    // squares of bins max(a + 1, b - window) to min(a + window, b - 1), so it is added to that range of a difference
+    // array and the sums are its running total.
+    bool getInsulationSums(int32_t window, vector<double> &windowSums) {
+        if (!isIntra) {
+            cerr << "Insulation needs an intrachromosomal matrix" << endl;
+            return false;
+        }
+        if (window < 1 || !loadForRecords()) {
+            return false;
+        }
+        int64_t regionIndices[] = {0, numBins1, 0, numBins2};
+        NormVectorSlice c1NormSlice, c2NormSlice;
+        getNormSlices(regionIndices, c1NormSlice, c2NormSlice);
+        QueryScaling scaling;
+        const scaleTables *tables = buildScaleTables(regionIndices, c1NormSlice, c2NormSlice, scaling)
+                                    ? &scaling.tables : nullptr;
+
+        vector<double> changes(static_cast<size_t>(numBins1) + 2, 0);
+        int64_t blocksRead = 0, contributed = 0;
+        forEachBandBlock(regionIndices, 2LL * window, [&](int32_t, const indexEntry &idx) {
+            vector<contactRecord> blockRecords = readBlock(fileName, idx, version);
+            if (tables != nullptr) {
+                scaleContactRecords(blockRecords.data(), blockRecords.size(), *tables);
+            }
+            blocksRead++;
+            bool anyRecords = false;
+            for (const contactRecord &rec : blockRecords) {
+                if (isnan(rec.counts) || isinf(rec.counts)) continue;
+                int64_t a = min(rec.binX, rec.binY), b = max(rec.binX, rec.binY);
+                int64_t first = max(a + 1, b - window), last = min(min(a + window, b - 1), (int64_t) numBins1);
+                if (first > last) continue;
+                changes[first] += rec.counts;
+                changes[last + 1] -= rec.counts;
+                anyRecords = true;
+            }
+            if (anyRecords) contributed++;
+        });
+        countBlocksRead(blocksRead, contributed);
+
+        windowSums.assign(static_cast<size_t>(numBins1) + 1, 0);
+        double running = 0;
+        for (size_t i = 0; i < windowSums.size(); i++) {
+            running += changes[i];
+            windowSums[i] = running;
+        }
+        return true;
+    }
+
+    // the raw counts of an intrachromosomal matrix as a sparse upper triangle, read with one pass over its blocks
+    bool getSparseMatrix(SparseSymmetricMatrix &matrix) {
+        if (!isIntra || !loadForRecords() || blockMap.empty()) {
+            return false;
+        }
+        matrix.numBins = static_cast<int64_t>(numBins1) + 1;
+        const int32_t lastBin = numBins1;
+        vector<SparseSymmetricMatrix> partials = accumulateBlocks<SparseSymmetricMatrix>(
+                nullptr, []() { return SparseSymmetricMatrix(); },
+                [lastBin](const vector<contactRecord> &records, SparseSymmetricMatrix &partial) {
+            for (const contactRecord &rec : records) {
+                if (isnan(rec.counts) || isinf(rec.counts) || rec.counts == 0) continue;
+                int32_t r = min(rec.binX, rec.binY), c = max(rec.binX, rec.binY);
+                if (r < 0 || c > lastBin) continue;
+                partial.rows.push_back(r);
+                partial.cols.push_back(c);
+                partial.values.push_back(rec.counts);
+            }
+        });
+        for (const SparseSymmetricMatrix &partial : partials) {
+            matrix.rows.insert(matrix.rows.end(), partial.rows.begin(), partial.rows.end());
+            matrix.cols.insert(matrix.cols.end(), partial.cols.begin(), partial.cols.end());
+            matrix.values.insert(matrix.values.end(), partial.values.begin(), partial.values.end());
+        }
+        return true;
     }
 
     vector<vector<float> > getRecordsAsMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) {
@@ -1530,17 +2350,474 @@ public:
     }
 
     int64_t getNumberOfTotalRecords() {
-        if (!foundFooter) {
+        if (!loadForRecords()) {
             return 0;
         }
-        int64_t regionIndices[4] = {0, numBins1, 0, numBins2};
-        set<int32_t> blockNumbers = getBlockNumbers(regionIndices);
+        // the whole matrix is requested, so every block in the index is needed
         int64_t total = 0;
-        for (int32_t blockNumber : blockNumbers) {
-            total += getNumRecordsInBlock(fileName, blockMap[blockNumber], version);
+        for (const auto &entry : blockMap) {
+            total += getNumRecordsInBlock(fileName, entry.second, version);
         }
         return total;
     }
+
+private:
+    once_flag footerOnce, blockIndexOnce, normsOnce, expectedOnce;
+    atomic<int64_t> numBlocksRead{0};
+    atomic<int64_t> numBlocksContributed{0};
+    bool foundFooter = false;
+    bool foundExpected = false;
+    int64_t myFilePos = 0LL;
+    indexEntry c1NormEntry{}, c2NormEntry{};
+    shared_ptr<NormVectorCache> normVectorCache;
+    // empty for NONE; for intra matrices both point at the same vector
+    shared_ptr<const vector<double>> c1Norm = make_shared<const vector<double>>();
+    shared_ptr<const vector<double>> c2Norm = c1Norm;
+    vector<double> expectedValues;
+    shared_ptr<ComputedExpected> computedExpected;
+    float sumCounts = 0;
+    int32_t blockBinCount = 0, blockColumnCount = 0;
+    map<int32_t, indexEntry> blockMap;
+    double avgCount = 0;
+
+    // reads and decodes the blocks in parallel and returns the records they hold in the region (genomic, 4 values)
+    // within maxDistance bins of the diagonal, normalized with the tables (if any), in file order
+    vector<contactRecord> readBlockRecords(const vector<indexEntry> &blocks, const int64_t *origRegionIndices,
+                                           const scaleTables *tables, int64_t maxDistance) {
+        vector<BlockResult> allResults;
+        vector<future<BlockResult>> futures;
+        
+        // Adjust thread count based on block count and available cores
+        unsigned int maxThreads = getNumWorkerThreads();
+        unsigned int numThreads = max(1u, min(
+            maxThreads,                // Don't use more than available cores minus one
+            static_cast<unsigned int>(blocks.size())  // Don't create more threads than blocks
+        ));
+        
+        ThreadPool pool(numThreads);
+
+        // Submit all tasks to thread pool
+        for (const indexEntry &idx : blocks) {
+            futures.push_back(
+                pool.enqueue([this, idx, origRegionIndices, tables, maxDistance]() {
+                    return processBlock(
+                        fileName, idx, version,
+                        origRegionIndices, resolution, isIntra, tables, maxDistance
+                    );
+                })
+            );
+        }
+
+        // Collect all results
+        allResults.reserve(futures.size());
+        int64_t contributed = 0;
+        for (auto& future : futures) {
+            allResults.push_back(future.get());
+            if (!allResults.back().records.empty()) contributed++;
+        }
+        countBlocksRead(static_cast<int64_t>(allResults.size()), contributed);
+
+        return combineBlockResults(allResults);
+    }
+
+    // reads every block of the matrix once, splitting them into one contiguous chunk per worker. each worker decodes
+    // its blocks in turn, normalizes them with the tables (if any) and passes the records to add(records, partial)
+    // with a partial of its own, made by makePartial. returns the partials of all workers.
+    template<typename Partial, typename Make, typename Add>
+    vector<Partial> accumulateBlocks(const scaleTables *tables, Make makePartial, Add add) {
+        vector<indexEntry> blocks;
+        blocks.reserve(blockMap.size());
+        for (const auto &entry : blockMap) {
+            blocks.push_back(entry.second);
+        }
+        vector<Partial> partials;
+        if (blocks.empty()) {
+            return partials;
+        }
+
+        unsigned int maxThreads = getNumWorkerThreads();
+        size_t numThreads = max(1u, min(maxThreads, static_cast<unsigned int>(blocks.size())));
+        ThreadPool pool(numThreads);
+
+        vector<future<pair<Partial, int64_t>>> futures;
+        size_t blocksPerThread = (blocks.size() + numThreads - 1) / numThreads;
+        for (size_t first = 0; first < blocks.size(); first += blocksPerThread) {
+            size_t last = min(blocks.size(), first + blocksPerThread);
+            futures.push_back(pool.enqueue([this, first, last, tables, &blocks, &makePartial, &add]() {
+                Partial partial = makePartial();
+                int64_t contributed = 0;
+                for (size_t b = first; b < last; b++) {
+                    vector<contactRecord> blockRecords = readBlock(fileName, blocks[b], version);
+                    if (tables != nullptr) {
+                        scaleContactRecords(blockRecords.data(), blockRecords.size(), *tables);
+                    }
+                    if (!blockRecords.empty()) contributed++;
+                    add(blockRecords, partial);
+                }
+                return make_pair(move(partial), contributed);
+            }));
+        }
+
+        int64_t contributed = 0;
+        for (auto &future : futures) {
+            pair<Partial, int64_t> result = future.get();
+            partials.push_back(move(result.first));
+            contributed += result.second;
+        }
+        countBlocksRead(static_cast<int64_t>(blocks.size()), contributed);
+        return partials;
+    }
+
+    void countBlocksRead(int64_t blocksRead, int64_t blocksContributed) {
+        numBlocksRead += blocksRead;
+        numBlocksContributed += blocksContributed;
+        totalBlocksRead += blocksRead;
+        totalBlocksContributed += blocksContributed;
+    }
+
+    // a set of regions queried together: their genomic bounds (4 per region), normalize stage tables, and each block
+    // any of them needs, in block order, with the regions that need it
+    struct RegionBatch {
+        vector<int64_t> origRegionIndices;
+        vector<QueryScaling> scalings;
+        vector<const scaleTables *> tables;
+        vector<pair<indexEntry, vector<int32_t>>> blocks;
+    };
+
+    void prepareRegionBatch(const vector<queryRegion> &regions, RegionBatch &batch) {
+        size_t numRegions = regions.size();
+        batch.origRegionIndices.resize(4 * numRegions);
+        batch.scalings.resize(numRegions);
+        batch.tables.resize(numRegions);
+
+        // one query reads only the normalization values it needs, but a batch uses the whole (cached) vectors rather
+        // than reading a slice per region
+        NormVectorSlice c1NormSlice, c2NormSlice;
+        if (numRegions > 1) {
+            loadNorms();
+            c1NormSlice = {0, c1Norm};
+            c2NormSlice = {0, c2Norm};
+        }
+
+        map<int32_t, vector<int32_t>> regionsForBlock;
+        for (size_t r = 0; r < numRegions; r++) {
+            int64_t *orig = &batch.origRegionIndices[4 * r];
+            orig[0] = regions[r].x0;
+            orig[1] = regions[r].x1;
+            orig[2] = regions[r].y0;
+            orig[3] = regions[r].y1;
+            int64_t regionIndices[4];
+            convertGenomeToBinPos(orig, regionIndices, resolution);
+
+            if (numRegions == 1) {
+                getNormSlices(regionIndices, c1NormSlice, c2NormSlice);
+            }
+            batch.tables[r] = buildScaleTables(regionIndices, c1NormSlice, c2NormSlice, batch.scalings[r])
+                              ? &batch.scalings[r].tables : nullptr;
+
+            auto region = static_cast<int32_t>(r);
+            forEachBlock(regionIndices, [&regionsForBlock, region](int32_t blockNumber, const indexEntry &) {
+                regionsForBlock[blockNumber].push_back(region);
+            });
+        }
+
+        batch.blocks.reserve(regionsForBlock.size());
+        for (auto &entry : regionsForBlock) {
+            batch.blocks.emplace_back(blockMap.at(entry.first), move(entry.second));
+        }
+    }
+
+    // adds records (genomic) to a width x width matrix whose first cell is bin (row0, col0); intra records are added in
+    // both orientations, as getRecordsAsMatrix places them, but only once when both land on the same cell
+    void addToPileup(const vector<contactRecord> &records, int64_t row0, int64_t col0, int64_t width,
+                     vector<double> &matrix) const {
+        for (const contactRecord &cr : records) {
+            int64_t x = cr.binX / resolution;
+            int64_t y = cr.binY / resolution;
+            int64_t r = x - row0;
+            int64_t c = y - col0;
+            bool placed = false;
+            if (0 <= r && r < width && 0 <= c && c < width) {
+                matrix[r * width + c] += cr.counts;
+                placed = true;
+            }
+            if (isIntra) {
+                int64_t r2 = y - row0;
+                int64_t c2 = x - col0;
+                if (0 <= r2 && r2 < width && 0 <= c2 && c2 < width && !(placed && r2 == r && c2 == c)) {
+                    matrix[r2 * width + c2] += cr.counts;
+                }
+            }
+        }
+    }
+
+    // sorts the per-block results into file order and concatenates their records
+    static vector<contactRecord> combineBlockResults(vector<BlockResult> &results) {
+        sort(results.begin(), results.end(), compareBlockResults);
+
+        vector<contactRecord> records;
+        size_t totalSize = 0;
+        for (const auto &result : results) {
+            totalSize += result.records.size();
+        }
+        records.reserve(totalSize);
+
+        for (const auto &result : results) {
+            records.insert(records.end(), result.records.begin(), result.records.end());
+        }
+        return records;
+    }
+
+    // records can be mirrored across the diagonal for intra matrices, so either range indexes either vector
+    void getNormSlices(const int64_t *regionIndices, NormVectorSlice &c1NormSlice, NormVectorSlice &c2NormSlice) {
+        if (isIntra) {
+            c1NormSlice = getNormSlice(c1, c1NormEntry, min(regionIndices[0], regionIndices[2]),
+                                       max(regionIndices[1], regionIndices[3]));
+            c2NormSlice = c1NormSlice;
+        } else {
+            c1NormSlice = getNormSlice(c1, c1NormEntry, regionIndices[0], regionIndices[1]);
+            c2NormSlice = getNormSlice(c2, c2NormEntry, regionIndices[2], regionIndices[3]);
+        }
+    }
+
+    bool needsExpected() const {
+        return isIntra && (matrixType == "oe" || matrixType == "expected");
+    }
+
+    // finds the matrix and the normalization vector entries; expected values are left to loadExpected
+    void loadFooter() {
+        call_once(footerOnce, [this]() {
+            HiCFileStream stream(fileName);
+            vector<double> ignored;
+            if (stream.isHttp) {
+                foundFooter = readFooterURL(stream.curl, master, version, c1, c2, "observed", norm, unit,
+                                            resolution, myFilePos, c1NormEntry, c2NormEntry, ignored);
+            } else {
+                stream.fin.seekg(master, ios::beg);
+                foundFooter = readFooter(stream.fin, master, version, c1, c2, "observed", norm, unit,
+                                         resolution, myFilePos, c1NormEntry, c2NormEntry, ignored);
+            }
+            stream.close();
+        });
+    }
+
+    void loadExpected() {
+        call_once(expectedOnce, [this]() {
+            if (!needsExpected()) {
+                return;
+            }
+            HiCFileStream stream(fileName);
+            int64_t filePos;
+            indexEntry entry1{}, entry2{};
+            if (stream.isHttp) {
+                foundExpected = readFooterURL(stream.curl, master, version, c1, c2, matrixType, norm, unit,
+                                              resolution, filePos, entry1, entry2, expectedValues);
+            } else {
+                stream.fin.seekg(master, ios::beg);
+                foundExpected = readFooter(stream.fin, master, version, c1, c2, matrixType, norm, unit,
+                                           resolution, filePos, entry1, entry2, expectedValues);
+            }
+            stream.close();
+            if (!foundExpected && hasFooter()) {
+                expectedValues.clear();
+                foundExpected = computeExpectedValues(fileName, master, norm, unit, resolution, c1, expectedValues,
+                                                      computedExpected);
+            }
+        });
+    }
+
+    void loadNorms() {
+        call_once(normsOnce, [this]() {
+            if (norm == "NONE" || !hasFooter()) {
+                return;
+            }
+            c1Norm = getFullNormVector(c1, c1NormEntry);
+            if (isIntra) {
+                c2Norm = c1Norm;
+            } else {
+                c2Norm = getFullNormVector(c2, c2NormEntry);
+            }
+        });
+    }
+
+    // the whole normalization vector of one of the chromosomes: read from the file when it stores one, otherwise
+    // computed from the chromosome's observed counts (VC, VC_SQRT, KR and SCALE) or from the on-disk cache of an
+    // earlier computation
+    shared_ptr<const vector<double>> getFullNormVector(int32_t chrIdx, indexEntry cNormEntry) {
+        if (cNormEntry.size > 0 || !canComputeNorm(norm)) {
+            return normVectorCache->get(chrIdx, norm, unit, resolution, cNormEntry, version, fileName);
+        }
+        return normVectorCache->getOrMake(chrIdx, norm, unit, resolution, [this, chrIdx]() {
+            stringstream key;
+            key << "norm_" << chrIdx << "_" << norm << "_" << unit << "_" << resolution;
+            string path = getComputedVectorPath(fileName, master, key.str());
+            vector<double> values;
+            if (readComputedVector(path, values)) {
+                return values;
+            }
+            int32_t numBins = chrIdx == c1 ? numBins1 : numBins2;
+            chromosome chrom{"", chrIdx, static_cast<int64_t>(numBins) * resolution};
+            int64_t fileSize = 0;
+            MatrixZoomData observed(chrom, chrom, "observed", "NONE", unit, resolution, version, master, fileSize,
+                                    fileName, normVectorCache);
+            SparseSymmetricMatrix matrix;
+            if (!observed.getSparseMatrix(matrix)) {
+                return values;
+            }
+            values = computeNormVector(matrix, norm);
+            writeComputedVector(path, values);
+            return values;
+        });
+    }
+
+    void loadBlockIndex() {
+        call_once(blockIndexOnce, [this]() {
+            if (!hasFooter()) {
+                return;
+            }
+            HiCFileStream stream(fileName);
+            indexEntry blockIndex{};
+            bool found;
+            if (stream.isHttp) {
+                // readMatrix will assign blockBinCount and blockColumnCount
+                found = readMatrixHttp(stream.curl, myFilePos, unit, resolution, sumCounts,
+                                       blockBinCount, blockColumnCount, blockIndex);
+            } else {
+                // readMatrix will assign blockBinCount and blockColumnCount
+                found = readMatrix(stream.fin, myFilePos, unit, resolution, sumCounts,
+                                   blockBinCount, blockColumnCount, blockIndex);
+            }
+            if (found) {
+                blockMap = readBlockIndex(stream, blockIndex);
+            }
+            stream.close();
+
+            if (!isIntra) {
+                avgCount = (sumCounts / numBins1) / numBins2;   // <= trying to avoid overflows
+            }
+        });
+    }
+
+    // the normalization values for bins [firstBin, lastBin]. small windows of vectors that have not been read in full
+    // yet are read on their own (see setPartialNormVectorReadFraction); otherwise the whole vector is read and cached
+    NormVectorSlice getNormSlice(int32_t chrIdx, indexEntry cNormEntry, int64_t firstBin, int64_t lastBin) {
+        if (norm == "NONE") {
+            return {0, c1Norm};
+        }
+        shared_ptr<const vector<double>> full = normVectorCache->find(chrIdx, norm, unit, resolution);
+        if (!full && cNormEntry.size <= 0) {
+            // not in the file; computed vectors are always made whole
+            full = getFullNormVector(chrIdx, cNormEntry);
+        } else if (!full) {
+            double maxFraction = partialNormVectorReadFraction;
+            if (maxFraction < 0) {
+                maxFraction = fileName.compare(0, 4, "http") == 0 ? 0.1 : 0;
+            }
+            int64_t headerSize = version > 8 ? sizeof(int64_t) : sizeof(int32_t);
+            int64_t entrySize = version > 8 ? sizeof(float) : sizeof(double);
+            int64_t nValues = (cNormEntry.size - headerSize) / entrySize;
+            firstBin = max(firstBin, (int64_t) 0);
+            lastBin = min(lastBin, nValues - 1);
+            if (firstBin <= lastBin && lastBin - firstBin + 1 < maxFraction * nValues) {
+                return {firstBin, make_shared<const vector<double>>(
+                        readNormalizationVectorSliceFromFooter(cNormEntry, version, fileName, firstBin, lastBin))};
+            }
+            full = normVectorCache->get(chrIdx, norm, unit, resolution, cNormEntry, version, fileName);
+        }
+        return {0, full};
+    }
+
+    // fills in the factor tables for a query over regionIndices (in bins); false if the records are returned as read
+    bool buildScaleTables(const int64_t *regionIndices, const NormVectorSlice &c1NormSlice,
+                          const NormVectorSlice &c2NormSlice, QueryScaling &scaling) {
+        bool normalize = norm != "NONE" && matrixType != "expected";
+        bool oe = matrixType == "oe";
+        bool expected = matrixType == "expected";
+        if (!normalize && !oe && !expected) {
+            return false;
+        }
+
+        // records are mirrored across the diagonal for intra matrices, so rows and columns both span the union
+        int64_t row0 = regionIndices[0], row1 = regionIndices[1], col0 = regionIndices[2], col1 = regionIndices[3];
+        if (isIntra) {
+            row0 = col0 = min(regionIndices[0], regionIndices[2]);
+            row1 = col1 = max(regionIndices[1], regionIndices[3]);
+        }
+        row0 = max(row0, (int64_t) 0);
+        col0 = max(col0, (int64_t) 0);
+        row1 = max(row0, min(row1, (int64_t) numBins1));
+        col1 = max(col0, min(col1, (int64_t) numBins2));
+
+        const vector<double> one(1, 1.0);
+        if (normalize) {
+            scaling.rowFactors = getReciprocalNormFactors(c1NormSlice, row0, row1);
+            scaling.colFactors = isIntra ? scaling.rowFactors : getReciprocalNormFactors(c2NormSlice, col0, col1);
+        } else {
+            scaling.rowFactors = scaling.colFactors = one;
+            row0 = col0 = 0;
+        }
+
+        scaleTables &tables = scaling.tables;
+        tables.constant = 1.0;
+        tables.replaceCounts = expected;
+        int64_t minDistance = 0;
+        if (isIntra && (oe || expected)) {
+            // expected values are looked up by |binY - binX|, capped at the last one
+            int64_t r0 = max(regionIndices[0], (int64_t) 0), r1 = max(r0, regionIndices[1]);
+            int64_t c0 = max(regionIndices[2], (int64_t) 0), c1 = max(c0, regionIndices[3]);
+            minDistance = r1 < c0 ? c0 - r1 : (c1 < r0 ? r0 - c1 : 0);
+            int64_t maxDistance = max(abs(c1 - r0), abs(r1 - c0));
+            if (!expectedValues.empty()) {
+                int64_t lastDistance = (int64_t) expectedValues.size() - 1;
+                minDistance = min(minDistance, lastDistance);
+                maxDistance = min(maxDistance, lastDistance);
+            }
+            scaling.distanceFactors.resize(static_cast<size_t>(maxDistance - minDistance + 1), NAN);
+            for (int64_t d = minDistance; d <= maxDistance && !expectedValues.empty(); d++) {
+                double e = expectedValues[d];
+                scaling.distanceFactors[d - minDistance] = expected ? e : 1.0 / e;
+            }
+        } else {
+            scaling.distanceFactors = one;
+            if (oe) {
+                tables.constant = 1.0 / avgCount;
+            } else if (expected) {
+                tables.constant = avgCount;
+            }
+        }
+
+        tables.rowFactors = scaling.rowFactors.data();
+        tables.rowOffset = static_cast<int32_t>(row0);
+        tables.rowSize = static_cast<int32_t>(scaling.rowFactors.size());
+        tables.colFactors = scaling.colFactors.data();
+        tables.colOffset = static_cast<int32_t>(col0);
+        tables.colSize = static_cast<int32_t>(scaling.colFactors.size());
+        tables.distanceFactors = scaling.distanceFactors.data();
+        tables.distanceOffset = static_cast<int32_t>(minDistance);
+        tables.distanceSize = static_cast<int32_t>(scaling.distanceFactors.size());
+        return true;
+    }
+
+    // loads everything getRecords needs; false if the file doesn't have this matrix or its expected values
+    bool loadForRecords() {
+        if (!hasFooter()) {
+            return false;
+        }
+        if (needsExpected()) {
+            loadExpected();
+            if (!foundExpected) {
+                return false;
+            }
+        }
+        loadBlockIndex();
+        return true;
+    }
+};
+
+// a run of consecutive blocks of one chromosome pair, decoded by one task with one open file
+struct BlockChunk {
+    size_t pairIndex;
+    vector<indexEntry> blocks;
 };
 
 class HiCFile {
@@ -1556,6 +2833,7 @@ public:
     vector<int32_t> resolutions;
     static int64_t totalFileSize;
     string fileName;
+    shared_ptr<NormVectorCache> normVectorCache;
 
     static size_t hdf(char *b, size_t size, size_t nitems, void *userdata) {
         size_t numbytes = size * nitems;
@@ -1611,6 +2889,7 @@ public:
             resolutions = readResolutionsFromHeader(fin);
             fin.close();
         }
+        this->normVectorCache = NormVectorCache::forFile(fileName, master);
     }
 
     string getGenomeID() const {
@@ -1643,7 +2922,134 @@ public:
         chromosome chrom1 = chromosomeMap[chr1];
         chromosome chrom2 = chromosomeMap[chr2];
         return new MatrixZoomData(chrom1, chrom2, (matrixType), (norm), (unit),
-                                  resolution, version, master, totalFileSize, fileName);
+                                  resolution, version, master, totalFileSize, fileName, normVectorCache);
+    }
+
+    // the normalizations the file stores vectors for at unit and resolution. remote files are only searched when
+    // their header points at the normalization vector index (v9)
+    vector<string> getStoredNormalizations(const string &unit, int32_t resolution) {
+        HiCFileStream stream(fileName);
+        vector<string> norms;
+        if (stream.isHttp) {
+            if (version > 8 && nviLength > 0) {
+                char *buffer = getData(stream.curl, nviPosition, nviLength);
+                memstream bufin(buffer, static_cast<int32_t>(nviLength));
+                norms = readStoredNormTypes(bufin, version, true, unit, resolution);
+                free(buffer);
+            }
+        } else {
+            stream.fin.seekg(master, ios::beg);
+            norms = readStoredNormTypes(stream.fin, version, false, unit, resolution);
+        }
+        stream.close();
+        return norms;
+    }
+
+    // the (normalized) coverage of every chromosome: the sum of each of its rows over the whole genome-wide matrix,
+    // intra and inter. the blocks of all matrices are cut into chunks that one pool of workers takes in turn, each
+    // summing into a genome-wide partial of its own, so each block is read once and small matrices don't idle cores.
+    map<string, vector<double>> getMarginals(const string &norm, const string &unit, int32_t resolution) {
+        vector<chromosome> chromosomes = getChromosomes();
+        // the rows of chromosome i are [firstRow[i], firstRow[i + 1]) of a partial
+        vector<size_t> firstRow(chromosomes.size() + 1, 0);
+        for (size_t i = 0; i < chromosomes.size(); i++) {
+            size_t numRows = chromosomes[i].index > 0 ? static_cast<size_t>(chromosomes[i].length / resolution) + 1 : 0;
+            firstRow[i + 1] = firstRow[i] + numRows;
+        }
+        vector<pair<size_t, size_t>> pairs;
+        for (size_t i = 0; i < chromosomes.size(); i++) {
+            if (chromosomes[i].index <= 0) continue;
+            for (size_t j = i; j < chromosomes.size(); j++) {
+                if (chromosomes[j].index > 0) pairs.emplace_back(i, j);
+            }
+        }
+
+        unsigned int numThreads = getNumWorkerThreads();
+        ThreadPool pool(numThreads);
+
+        // each pair's matrix, block index and normalize stage, found in parallel
+        vector<unique_ptr<MatrixZoomData>> matrices(pairs.size());
+        vector<QueryScaling> scalings(pairs.size());
+        vector<const scaleTables*> tables(pairs.size(), nullptr);
+        vector<future<bool>> loaded;
+        for (size_t p = 0; p < pairs.size(); p++) {
+            matrices[p].reset(new MatrixZoomData(chromosomes[pairs[p].first], chromosomes[pairs[p].second], "observed",
+                                                 norm, unit, resolution, version, master, totalFileSize, fileName,
+                                                 normVectorCache));
+            MatrixZoomData *mzd = matrices[p].get();
+            loaded.push_back(pool.enqueue([mzd, p, &scalings, &tables]() {
+                if (!mzd->hasFooter() || mzd->getBlockMap().empty()) return false;
+                bool ok;
+                tables[p] = mzd->getMatrixScaling(scalings[p], ok);
+                return ok;
+            }));
+        }
+        const size_t blocksPerChunk = 16;
+        vector<BlockChunk> chunks;
+        int64_t numBlocks = 0;
+        for (size_t p = 0; p < pairs.size(); p++) {
+            if (!loaded[p].get()) continue;
+            for (const auto &blockMapEntry : matrices[p]->getBlockMap()) {
+                if (chunks.empty() || chunks.back().pairIndex != p || chunks.back().blocks.size() == blocksPerChunk) {
+                    chunks.push_back({p, {}});
+                }
+                chunks.back().blocks.push_back(blockMapEntry.second);
+                numBlocks++;
+            }
+        }
+
+        atomic<size_t> nextChunk{0};
+        atomic<int64_t> contributed{0};
+        vector<future<vector<double>>> partials;
+        for (unsigned int t = 0; t < numThreads; t++) {
+            partials.push_back(pool.enqueue([&]() {
+                vector<double> partial(firstRow.back(), 0);
+                HiCFileStream stream(fileName);
+                for (size_t c = nextChunk++; c < chunks.size(); c = nextChunk++) {
+                    const MatrixZoomData *mzd = matrices[chunks[c].pairIndex].get();
+                    const scaleTables *pairTables = tables[chunks[c].pairIndex];
+                    const size_t rows1 = firstRow[pairs[chunks[c].pairIndex].first];
+                    const size_t rows2 = firstRow[pairs[chunks[c].pairIndex].second];
+                    const size_t numRows1 = firstRow[pairs[chunks[c].pairIndex].first + 1] - rows1;
+                    const size_t numRows2 = firstRow[pairs[chunks[c].pairIndex].second + 1] - rows2;
+                    for (const indexEntry &idx : chunks[c].blocks) {
+                        vector<contactRecord> blockRecords = readBlock(stream, idx, mzd->version);
+                        if (pairTables != nullptr) {
+                            scaleContactRecords(blockRecords.data(), blockRecords.size(), *pairTables);
+                        }
+                        if (!blockRecords.empty()) contributed++;
+                        // intra matrices are symmetric, so a contact adds to both of its rows, once on the diagonal
+                        for (const contactRecord &rec : blockRecords) {
+                            if (isnan(rec.counts) || isinf(rec.counts)) continue;
+                            if (rec.binX < 0 || rec.binY < 0) continue;
+                            if ((size_t) rec.binX < numRows1) partial[rows1 + rec.binX] += rec.counts;
+                            if ((!mzd->isIntra || rec.binX != rec.binY) && (size_t) rec.binY < numRows2) {
+                                partial[rows2 + rec.binY] += rec.counts;
+                            }
+                        }
+                    }
+                }
+                stream.close();
+                return partial;
+            }));
+        }
+        vector<double> sums(firstRow.back(), 0);
+        for (auto &future : partials) {
+            vector<double> partial = future.get();
+            for (size_t i = 0; i < sums.size(); i++) {
+                sums[i] += partial[i];
+            }
+        }
+        totalBlocksRead += numBlocks;
+        totalBlocksContributed += contributed;
+
+        map<string, vector<double>> marginals;
+        for (size_t i = 0; i < chromosomes.size(); i++) {
+            if (chromosomes[i].index > 0) {
+                marginals[chromosomes[i].name].assign(sums.begin() + firstRow[i], sums.begin() + firstRow[i + 1]);
+            }
+        }
+        return marginals;
     }
 };
 
@@ -1692,11 +3098,557 @@ vector<contactRecord> straw(const string &matrixType, const string &norm, const
     }
 }
 
-vector<vector<float> > strawAsMatrix(const string &matrixType, const string &norm, const string &fileName, const string &chr1loc,
-                   const string &chr2loc, const string &unit, int32_t binsize) {
+map<string, vector<double>> getMarginals(const string &norm, const string &fname, const string &unit, int32_t binsize) {
+    HiCFile *hiCFile = new HiCFile(fname);
+    map<string, vector<double>> marginals = hiCFile->getMarginals(norm, unit, binsize);
+    delete hiCFile;
+    return marginals;
+}
+
+vector<contactRecord> strawBand(const string &matrixType, const string &norm, const string &fileName,
+                                const string &chrloc, const string &unit, int32_t binsize, int64_t maxDistance) {
     if (!(unit == "BP" || unit == "FRAG")) {
         cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
-        cerr << "Usage: straw [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
+        return {};
+    }
+
+    HiCFile *hiCFile = new HiCFile(fileName);
+    string chr;
+    int64_t start = -100LL, end = -100LL;
+    parsePositions(chrloc, chr, start, end, hiCFile->chromosomeMap);
+    MatrixZoomData *mzd = hiCFile->getMatrixZoomData(chr, chr, matrixType, norm, unit, binsize);
+    vector<contactRecord> records = mzd->getBandRecords(start, end, maxDistance);
+    delete mzd;
+    delete hiCFile;
+    return records;
+}
+
+void strawToArrow(const string &matrixType, const string &norm, const string &fileName, const string &chr1loc,
+                  const string &chr2loc, const string &unit, int32_t binsize, const string &outputPath) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return;
+    }
+
+    HiCFile *hiCFile = new HiCFile(fileName);
+    string chr1, chr2;
+    int64_t origRegionIndices[4] = {-100LL, -100LL, -100LL, -100LL};
+    parsePositions((chr1loc), chr1, origRegionIndices[0], origRegionIndices[1], hiCFile->chromosomeMap);
+    parsePositions((chr2loc), chr2, origRegionIndices[2], origRegionIndices[3], hiCFile->chromosomeMap);
+
+    // as in straw, records run along the chromosome of lower index first
+    if (hiCFile->chromosomeMap[chr1].index > hiCFile->chromosomeMap[chr2].index) {
+        swap(chr1, chr2);
+        swap(origRegionIndices[0], origRegionIndices[2]);
+        swap(origRegionIndices[1], origRegionIndices[3]);
+    }
+    MatrixZoomData *mzd = hiCFile->getMatrixZoomData(chr1, chr2, matrixType, norm, unit, binsize);
+    vector<contactRecord> records = mzd->getRecords(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2],
+                                                    origRegionIndices[3]);
+    delete mzd;
+    delete hiCFile;
+
+    bool streamFormat = false;
+    isArrowPath(outputPath, streamFormat);
+    vector<string> chromosomeNames = {chr1};
+    if (chr2 != chr1) chromosomeNames.push_back(chr2);
+    ArrowContactWriter writer(outputPath, chromosomeNames, false, binsize, unit, streamFormat || outputPath == "-");
+    if (!writer.isOpen()) {
+        cerr << "Error: Could not open output file " << outputPath << endl;
+        return;
+    }
+    const size_t recordsPerBatch = 1 << 16;
+    vector<int32_t> binX, binY;
+    vector<float> counts;
+    for (size_t start = 0; start < records.size(); start += recordsPerBatch) {
+        size_t end = min(records.size(), start + recordsPerBatch);
+        binX.clear();
+        binY.clear();
+        counts.clear();
+        for (size_t i = start; i < end; i++) {
+            binX.push_back(records[i].binX);
+            binY.push_back(records[i].binY);
+            counts.push_back(records[i].counts);
+        }
+        writer.writeBatch(0, static_cast<int16_t>(chromosomeNames.size() - 1), binX, binY, counts);
+    }
+    writer.close();
+}
+
+vector<vector<contactRecord>> strawForRegions(const string &matrixType, const string &norm, const string &fileName,
+                                              const vector<string> &chr1locs, const vector<string> &chr2locs,
+                                              const string &unit, int32_t binsize) {
+    vector<vector<contactRecord>> results(chr1locs.size());
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return results;
+    }
+    if (chr1locs.size() != chr2locs.size()) {
+        cerr << "Got " << chr1locs.size() << " chr1 locations but " << chr2locs.size() << " chr2 locations" << endl;
+        return results;
+    }
+
+    HiCFile *hiCFile = new HiCFile(fileName);
+
+    // group the regions by chromosome pair so that each matrix is set up once and shares its blocks across regions
+    map<pair<string, string>, pair<vector<queryRegion>, vector<size_t>>> regionsForPair;
+    for (size_t i = 0; i < chr1locs.size(); i++) {
+        string chr1, chr2;
+        int64_t origRegionIndices[4] = {-100LL, -100LL, -100LL, -100LL};
+        parsePositions(chr1locs[i], chr1, origRegionIndices[0], origRegionIndices[1], hiCFile->chromosomeMap);
+        parsePositions(chr2locs[i], chr2, origRegionIndices[2], origRegionIndices[3], hiCFile->chromosomeMap);
+
+        queryRegion region{};
+        if (hiCFile->chromosomeMap[chr1].index > hiCFile->chromosomeMap[chr2].index) {
+            swap(chr1, chr2);
+            region = {origRegionIndices[2], origRegionIndices[3], origRegionIndices[0], origRegionIndices[1]};
+        } else {
+            region = {origRegionIndices[0], origRegionIndices[1], origRegionIndices[2], origRegionIndices[3]};
+        }
+        auto &entry = regionsForPair[make_pair(chr1, chr2)];
+        entry.first.push_back(region);
+        entry.second.push_back(i);
+    }
+
+    for (const auto &pairRegions : regionsForPair) {
+        MatrixZoomData *mzd = hiCFile->getMatrixZoomData(pairRegions.first.first, pairRegions.first.second,
+                                                         matrixType, norm, unit, binsize);
+        vector<vector<contactRecord>> records = mzd->getRecordsForRegions(pairRegions.second.first);
+        for (size_t k = 0; k < records.size(); k++) {
+            results[pairRegions.second.second[k]] = move(records[k]);
+        }
+        delete mzd;
+    }
+    delete hiCFile;
+    return results;
+}
+
+vector<anchorPair> readBedpe(const string &fileName) {
+    vector<anchorPair> loops;
+    ifstream fin(fileName);
+    if (!fin) {
+        cerr << "File " << fileName << " cannot be opened for reading" << endl;
+        return loops;
+    }
+    string line;
+    while (getline(fin, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        stringstream ss(line);
+        anchorPair loop;
+        // header lines fail to parse the positions and are skipped
+        if (ss >> loop.chr1 >> loop.start1 >> loop.end1 >> loop.chr2 >> loop.start2 >> loop.end2) {
+            loops.push_back(loop);
+        }
+    }
+    return loops;
+}
+
+// the name the file uses for a chromosome, trying it with and without a "chr" prefix; empty if it isn't there
+static string findChromosomeName(const map<string, chromosome> &chromosomeMap, const string &name) {
+    if (chromosomeMap.count(name)) {
+        return name;
+    }
+    string other = name.compare(0, 3, "chr") == 0 ? name.substr(3) : "chr" + name;
+    if (chromosomeMap.count(other)) {
+        return other;
+    }
+    return "";
+}
+
+pileupResult pileup(const string &matrixType, const string &norm, const string &fname, const vector<anchorPair> &loops,
+                    int32_t window, const string &unit, int32_t binsize) {
+    pileupResult result{};
+    result.width = 2 * window + 1;
+    if (window < 0 || binsize <= 0) {
+        cerr << "Window and bin size must be positive" << endl;
+        result.width = 0;
+        return result;
+    }
+    result.sum.assign(static_cast<size_t>(result.width) * result.width, 0);
+
+    HiCFile *hiCFile = new HiCFile(fname);
+
+    // loop centers in bins, grouped by chromosome pair with the lower-index chromosome first; intra loops are put
+    // above the diagonal
+    map<pair<string, string>, vector<pair<int64_t, int64_t>>> centersForPair;
+    int64_t numUnknown = 0;
+    for (const anchorPair &loop : loops) {
+        string chr1 = findChromosomeName(hiCFile->chromosomeMap, loop.chr1);
+        string chr2 = findChromosomeName(hiCFile->chromosomeMap, loop.chr2);
+        if (chr1.empty() || chr2.empty()) {
+            numUnknown++;
+            continue;
+        }
+        int64_t center1 = (loop.start1 + loop.end1) / 2 / binsize;
+        int64_t center2 = (loop.start2 + loop.end2) / 2 / binsize;
+        int32_t index1 = hiCFile->chromosomeMap[chr1].index;
+        int32_t index2 = hiCFile->chromosomeMap[chr2].index;
+        if (index1 > index2 || (index1 == index2 && center1 > center2)) {
+            swap(chr1, chr2);
+            swap(center1, center2);
+        }
+        centersForPair[make_pair(chr1, chr2)].emplace_back(center1, center2);
+    }
+    if (numUnknown > 0) {
+        cerr << "Skipped " << numUnknown << " loops on chromosomes not in " << fname << endl;
+    }
+
+    for (const auto &pairCenters : centersForPair) {
+        MatrixZoomData *mzd = hiCFile->getMatrixZoomData(pairCenters.first.first, pairCenters.first.second,
+                                                         matrixType, norm, unit, binsize);
+        result.numLoops += mzd->addPileup(pairCenters.second, window, result.sum);
+        delete mzd;
+    }
+    delete hiCFile;
+    return result;
+}
+
+// the chromosomes of the file with these names (all but "All" when there are none); unknown names are reported
+static vector<chromosome> selectChromosomes(HiCFile *hiCFile, const vector<string> &names) {
+    vector<chromosome> selected;
+    if (names.empty()) {
+        for (const chromosome &chrom : hiCFile->getChromosomes()) {
+            if (chrom.index > 0) selected.push_back(chrom);
+        }
+        return selected;
+    }
+    for (const string &name : names) {
+        string chr = findChromosomeName(hiCFile->chromosomeMap, name);
+        if (chr.empty()) {
+            cerr << "chromosome " << name << " not found in the file." << endl;
+            continue;
+        }
+        selected.push_back(hiCFile->chromosomeMap[chr]);
+    }
+    return selected;
+}
+
+// bins 0 to numBins - 1 of a chromosome that have a finite, positive value in its norm vector; all of them for NONE
+static vector<bool> getValidBins(MatrixZoomData *mzd, int32_t chrIdx, const string &norm, int64_t numBins) {
+    vector<bool> valid(static_cast<size_t>(numBins), true);
+    if (norm != "NONE") {
+        const vector<double> &normVector = mzd->getNormVector(chrIdx);
+        for (int64_t i = 0; i < numBins; i++) {
+            valid[i] = i < (int64_t) normVector.size() && normVector[i] > 0 && !isinf(normVector[i]);
+        }
+    }
+    return valid;
+}
+
+// bin pairs at each distance from the diagonal (0 to valid.size() - 1) whose bins are both valid. pairs of the rarer
+// kind of bin are enumerated, so this stays fast when few bins are invalid (or few are valid).
+static vector<int64_t> countValidPairsByDistance(const vector<bool> &valid) {
+    const auto numBins = static_cast<int64_t>(valid.size());
+    vector<int64_t> validBins, invalidBins;
+    for (int64_t i = 0; i < numBins; i++) {
+        (valid[i] ? validBins : invalidBins).push_back(i);
+    }
+    vector<int64_t> pairs(static_cast<size_t>(numBins), 0);
+    if (validBins.size() <= invalidBins.size()) {
+        for (size_t a = 0; a < validBins.size(); a++) {
+            for (size_t b = a; b < validBins.size(); b++) {
+                pairs[validBins[b] - validBins[a]]++;
+            }
+        }
+        return pairs;
+    }
+    // all pairs, less those with an invalid first bin (i < numBins - d) or second bin (i >= d), plus those with both
+    // (subtracted twice). the first two come from prefix counts of the invalid bins in one pass over the distances.
+    vector<int64_t> invalidBefore(static_cast<size_t>(numBins) + 1, 0);
+    for (int64_t i = 0; i < numBins; i++) {
+        invalidBefore[i + 1] = invalidBefore[i] + (valid[i] ? 0 : 1);
+    }
+    const int64_t numInvalid = invalidBefore[numBins];
+    for (int64_t d = 0; d < numBins; d++) {
+        pairs[d] = numBins - d - invalidBefore[numBins - d] - (numInvalid - invalidBefore[d]);
+    }
+    for (size_t a = 0; a < invalidBins.size(); a++) {
+        pairs[0]++;
+        for (size_t b = a + 1; b < invalidBins.size(); b++) {
+            pairs[invalidBins[b] - invalidBins[a]]++;
+        }
+    }
+    return pairs;
+}
+
+// genome-wide expected values and per-chromosome factors for one (norm, unit, resolution), as juicer computes them:
+// the contact density at each distance is the summed (normalized) counts over the valid bin pairs at that distance,
+// widened over neighbouring distances until it covers at least 400 counts, and a chromosome's expected values are the
+// density divided by its factor, the ratio of its expected to its observed total
+struct ComputedExpected {
+    once_flag computed;
+    bool found = false;
+    vector<double> density;
+    vector<double> chrFactors; // by chromosome index
+};
+
+static bool computeGenomeExpected(const string &fileName, const string &norm, const string &unit, int32_t resolution,
+                                  ComputedExpected &result) {
+    HiCFile *hiCFile = new HiCFile(fileName);
+    stringstream key;
+    key << "expected_" << norm << "_" << unit << "_" << resolution;
+    string densityPath = getComputedVectorPath(fileName, hiCFile->master, key.str());
+    string factorsPath = getComputedVectorPath(fileName, hiCFile->master, key.str() + "_factors");
+    if (readComputedVector(densityPath, result.density) && readComputedVector(factorsPath, result.chrFactors)) {
+        delete hiCFile;
+        return true;
+    }
+
+    vector<chromosome> chromosomes = selectChromosomes(hiCFile, {});
+    int64_t maxBins = 0;
+    for (const chromosome &chrom : chromosomes) {
+        maxBins = max(maxBins, chrom.length / resolution + 1);
+    }
+    vector<int32_t> distanceBins(static_cast<size_t>(maxBins));
+    for (int64_t d = 0; d < maxBins; d++) {
+        distanceBins[d] = static_cast<int32_t>(d);
+    }
+
+    // contacts and valid bin pairs by distance, per chromosome and in total
+    vector<double> contacts(static_cast<size_t>(maxBins), 0), pairs(static_cast<size_t>(maxBins), 0);
+    map<int32_t, pair<vector<double>, vector<int64_t>>> perChromosome;
+    for (const chromosome &chrom : chromosomes) {
+        MatrixZoomData *mzd = hiCFile->getMatrixZoomData(chrom.name, chrom.name, "observed", norm, unit, resolution);
+        vector<double> chrContacts;
+        if (!mzd->addDistanceDecay(distanceBins, chrContacts)) {
+            delete mzd;
+            continue;
+        }
+        // as in juicer, only bins that lie wholly within the chromosome count towards the possible pairs
+        const int64_t numBins = chrom.length / resolution;
+        vector<int64_t> chrPairs = countValidPairsByDistance(getValidBins(mzd, chrom.index, norm, numBins));
+        delete mzd;
+        for (int64_t d = 0; d < numBins; d++) {
+            contacts[d] += chrContacts[d];
+            pairs[d] += chrPairs[d];
+        }
+        perChromosome[chrom.index] = make_pair(move(chrContacts), move(chrPairs));
+    }
+    if (perChromosome.empty()) {
+        delete hiCFile;
+        return false;
+    }
+
+    const double minCounts = 400;
+    result.density.assign(static_cast<size_t>(maxBins), 0);
+    for (int64_t d = 0; d < maxBins; d++) {
+        double numSum = contacts[d], denSum = pairs[d];
+        int64_t lo = d, hi = d;
+        while (numSum < minCounts && (lo > 0 || hi < maxBins - 1)) {
+            if (lo > 0) {
+                lo--;
+                numSum += contacts[lo];
+                denSum += pairs[lo];
+            }
+            if (hi < maxBins - 1) {
+                hi++;
+                numSum += contacts[hi];
+                denSum += pairs[hi];
+            }
+        }
+        result.density[d] = denSum > 0 ? numSum / denSum : 0;
+    }
+
+    result.chrFactors.assign(hiCFile->chromosomeMap.size(), 1);
+    for (const auto &entry : perChromosome) {
+        double expectedTotal = 0, observedTotal = 0;
+        for (size_t d = 0; d < entry.second.second.size(); d++) {
+            expectedTotal += entry.second.second[d] * result.density[d];
+            observedTotal += entry.second.first[d];
+        }
+        if (observedTotal > 0 && expectedTotal > 0) {
+            result.chrFactors[entry.first] = expectedTotal / observedTotal;
+        }
+    }
+    writeComputedVector(densityPath, result.density);
+    writeComputedVector(factorsPath, result.chrFactors);
+    delete hiCFile;
+    return true;
+}
+
+static bool computeExpectedValues(const string &fileName, int64_t master, const string &norm, const string &unit,
+                                  int32_t resolution, int32_t chrIdx, vector<double> &expectedValues,
+                                  shared_ptr<ComputedExpected> &computed) {
+    // keyed like the disk cache, by the file's name and master index position, and released with the last caller
+    // holding it, as the norm vector caches are
+    static mutex registryMutex;
+    static map<tuple<string, int64_t, string, string, int32_t>, weak_ptr<ComputedExpected>> registry;
+    {
+        lock_guard<mutex> lock(registryMutex);
+        for (auto it = registry.begin(); it != registry.end();) {
+            it = it->second.expired() ? registry.erase(it) : next(it);
+        }
+        weak_ptr<ComputedExpected> &slot = registry[make_tuple(fileName, master, norm, unit, resolution)];
+        computed = slot.lock();
+        if (!computed) {
+            computed = make_shared<ComputedExpected>();
+            slot = computed;
+        }
+    }
+    call_once(computed->computed, [&]() {
+        computed->found = computeGenomeExpected(fileName, norm, unit, resolution, *computed);
+    });
+    if (!computed->found || chrIdx < 0 || chrIdx >= (int32_t) computed->chrFactors.size()) {
+        return false;
+    }
+    expectedValues = computed->density;
+    for (double &value : expectedValues) {
+        value /= computed->chrFactors[chrIdx];
+    }
+    return true;
+}
+
+// maps each distance from the diagonal in bins, 0 to maxDistance, to a log-spaced distance bin: 0 on its own, then
+// binsPerDecade bins per factor of 10 (merging the ones no whole distance falls in). returns the smallest distance of
+// each bin.
+static vector<int64_t> getLogDistanceBins(int64_t maxDistance, int32_t binsPerDecade, vector<int32_t> &distanceBins) {
+    vector<int64_t> firstDistances;
+    distanceBins.assign(static_cast<size_t>(maxDistance + 1), 0);
+    int64_t previous = -1;
+    for (int64_t d = 0; d <= maxDistance; d++) {
+        int64_t logBin = d == 0 ? 0 : 1 + static_cast<int64_t>(floor(log10((double) d) * binsPerDecade + 1e-9));
+        if (logBin != previous) {
+            firstDistances.push_back(d);
+            previous = logBin;
+        }
+        distanceBins[d] = static_cast<int32_t>(firstDistances.size() - 1);
+    }
+    return firstDistances;
+}
+
+vector<distanceDecayCurve> distanceDecay(const string &norm, const string &fname, const string &unit, int32_t binsize,
+                                         int32_t binsPerDecade, const vector<string> &chromosomes) {
+    vector<distanceDecayCurve> curves;
+    if (binsize <= 0 || binsPerDecade <= 0) {
+        cerr << "Bin size and bins per decade must be positive" << endl;
+        return curves;
+    }
+    HiCFile *hiCFile = new HiCFile(fname);
+    vector<chromosome> selected = selectChromosomes(hiCFile, chromosomes);
+
+    // one table for the longest chromosome, so all curves share their distance bins
+    int64_t maxBins = 0;
+    for (const chromosome &chrom : selected) {
+        maxBins = max(maxBins, chrom.length / binsize);
+    }
+    vector<int32_t> distanceBins;
+    vector<int64_t> firstDistances = getLogDistanceBins(maxBins, binsPerDecade, distanceBins);
+
+    for (const chromosome &chrom : selected) {
+        const int64_t lastBin = chrom.length / binsize;
+        distanceDecayCurve curve;
+        curve.chr = chrom.name;
+        MatrixZoomData *mzd = hiCFile->getMatrixZoomData(chrom.name, chrom.name, "observed", norm, unit, binsize);
+        if (!mzd->addDistanceDecay(distanceBins, curve.contacts)) {
+            delete mzd;
+            continue;
+        }
+        // with a norm, only pairs of bins that have a norm value can hold a contact
+        vector<int64_t> pairs = countValidPairsByDistance(getValidBins(mzd, chrom.index, norm, lastBin + 1));
+        delete mzd;
+        const size_t numDistanceBins = static_cast<size_t>(distanceBins[lastBin]) + 1;
+        curve.contacts.resize(numDistanceBins, 0);
+        curve.numPairs.assign(numDistanceBins, 0);
+        for (int64_t d = 0; d <= lastBin; d++) {
+            curve.numPairs[distanceBins[d]] += pairs[d];
+        }
+        for (size_t i = 0; i < numDistanceBins; i++) {
+            curve.distances.push_back(firstDistances[i] * binsize);
+        }
+        curves.push_back(move(curve));
+    }
+    delete hiCFile;
+    return curves;
+}
+
+// bins at local minima of the normalized insulation score that lie at least minStrength below the highest score on
+// either side within window bins; the strength is the smaller of the two drops
+static void callInsulationBoundaries(insulationTrack &track, int32_t window, double minStrength) {
+    const vector<double> &score = track.normalizedScore;
+    const auto numBins = static_cast<int64_t>(score.size());
+    for (int64_t i = 1; i + 1 < numBins; i++) {
+        if (isnan(score[i]) || !(score[i] < score[i - 1]) || !(score[i] <= score[i + 1])) continue;
+        double leftPeak = score[i], rightPeak = score[i];
+        for (int64_t k = max<int64_t>(0, i - window); k < i; k++) {
+            if (!isnan(score[k])) leftPeak = max(leftPeak, score[k]);
+        }
+        for (int64_t k = i + 1; k <= min(numBins - 1, i + window); k++) {
+            if (!isnan(score[k])) rightPeak = max(rightPeak, score[k]);
+        }
+        double strength = min(leftPeak, rightPeak) - score[i];
+        if (strength >= minStrength) {
+            track.boundaries.push_back(i);
+            track.boundaryStrengths.push_back(strength);
+        }
+    }
+}
+
+vector<insulationTrack> insulation(const string &norm, const string &fname, const string &unit, int32_t binsize,
+                                   int32_t window, double boundaryStrength, const vector<string> &chromosomes) {
+    vector<insulationTrack> tracks;
+    if (binsize <= 0 || window < 1) {
+        cerr << "Bin size and window must be positive" << endl;
+        return tracks;
+    }
+    HiCFile *hiCFile = new HiCFile(fname);
+    vector<chromosome> selected = selectChromosomes(hiCFile, chromosomes);
+
+    // one chromosome per task; each one streams its own blocks in order
+    vector<unique_ptr<MatrixZoomData>> matrices;
+    for (const chromosome &chrom : selected) {
+        matrices.emplace_back(hiCFile->getMatrixZoomData(chrom.name, chrom.name, "observed", norm, unit, binsize));
+    }
+    unsigned int maxThreads = getNumWorkerThreads();
+    size_t numThreads = max(1u, min(maxThreads, static_cast<unsigned int>(selected.size())));
+    vector<future<insulationTrack>> futures;
+    {
+        ThreadPool pool(numThreads);
+        for (size_t c = 0; c < selected.size(); c++) {
+            futures.push_back(pool.enqueue([&selected, &matrices, c, window, boundaryStrength]() {
+                insulationTrack track;
+                track.chr = selected[c].name;
+                vector<double> sums;
+                if (!matrices[c]->getInsulationSums(window, sums)) {
+                    return track;
+                }
+                const auto numBins = static_cast<int64_t>(sums.size());
+                double total = 0;
+                int64_t count = 0;
+                track.score.assign(sums.size(), NAN);
+                for (int64_t i = window; i + window < numBins; i++) {
+                    track.score[i] = sums[i];
+                    if (sums[i] > 0) {
+                        total += sums[i];
+                        count++;
+                    }
+                }
+                double mean = count > 0 ? total / count : 0;
+                track.normalizedScore.assign(sums.size(), NAN);
+                for (int64_t i = 0; i < numBins; i++) {
+                    if (track.score[i] > 0) {
+                        track.normalizedScore[i] = log2(track.score[i] / mean);
+                    }
+                }
+                callInsulationBoundaries(track, window, boundaryStrength);
+                return track;
+            }));
+        }
+        for (auto &future : futures) {
+            insulationTrack track = future.get();
+            if (!track.score.empty()) {
+                tracks.push_back(move(track));
+            }
+        }
+    }
+    delete hiCFile;
+    return tracks;
+}
+
+vector<vector<float> > strawAsMatrix(const string &matrixType, const string &norm, const string &fileName, const string &chr1loc,
+                   const string &chr2loc, const string &unit, int32_t binsize) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        cerr << "Usage: straw [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
              << endl;
         vector<vector<float> > res = vector<vector<float> >(1, vector<float>(1, 0));
         return res;
@@ -1717,6 +3669,13 @@ vector<vector<float> > strawAsMatrix(const string &matrixType, const string &nor
     }
 }
 
+blockReadStats getBlockReadStats() {
+    blockReadStats stats{};
+    stats.blocksRead = totalBlocksRead;
+    stats.blocksContributed = totalBlocksContributed;
+    return stats;
+}
+
 int64_t getNumRecordsForFile(const string &fileName, int32_t binsize, bool interOnly) {
     HiCFile *hiCFile = new HiCFile(fileName);
     int64_t totalNumRecords = 0;
@@ -1759,13 +3718,15 @@ int64_t getNumRecordsForChromosomes(const string &fileName, int32_t binsize, boo
 
 // Add these implementations to straw.cpp (near the end of the file)
 
-void writeCompressedBuffer(gzFile& file, const char* buffer, size_t size) {
-    gzwrite(file, buffer, size);
+void writeCompressedBuffer(HicSliceWriter& file, const char* buffer, size_t size) {
+    file.write(buffer, size);
 }
 
-void writeHeader(gzFile& file, const HicSliceHeader& header) {
+void writeHeader(HicSliceWriter& file, const HicSliceHeader& header) {
     // Write magic string
-    writeCompressedBuffer(file, HICSLICE_MAGIC.c_str(), HICSLICE_MAGIC.length());
+    const string& magic = header.version == 3 ? HICSLICE_V3_MAGIC : header.version == 2 ? HICSLICE_V2_MAGIC
+                                                                                        : HICSLICE_MAGIC;
+    writeCompressedBuffer(file, magic.c_str(), magic.length());
     
     // Write resolution
     writeCompressedBuffer(file, (char*)&header.resolution, sizeof(int32_t));
@@ -1787,21 +3748,273 @@ void writeHeader(gzFile& file, const HicSliceHeader& header) {
     }
 }
 
-void writeContactRecord(gzFile& file, const CompressedContactRecord& record) {
+void writeContactRecord(HicSliceWriter& file, const CompressedContactRecord& record) {
     writeCompressedBuffer(file, (char*)&record, sizeof(CompressedContactRecord));
 }
 
+// the index of a version 2 or 3 file: the number of chunks, then each chunk's fields in order
+void writeIndex(HicSliceWriter& file, const vector<HicSliceChunk>& chunks) {
+    int32_t numChunks = static_cast<int32_t>(chunks.size());
+    writeCompressedBuffer(file, (char*)&numChunks, sizeof(int32_t));
+    for (const HicSliceChunk& chunk : chunks) {
+        writeCompressedBuffer(file, (char*)&chunk.chr1Key, sizeof(int16_t));
+        writeCompressedBuffer(file, (char*)&chunk.chr2Key, sizeof(int16_t));
+        writeCompressedBuffer(file, (char*)&chunk.offset, sizeof(int64_t));
+        writeCompressedBuffer(file, (char*)&chunk.size, sizeof(int64_t));
+        writeCompressedBuffer(file, (char*)&chunk.numRecords, sizeof(int64_t));
+        writeCompressedBuffer(file, (char*)&chunk.binXStart, sizeof(int32_t));
+        writeCompressedBuffer(file, (char*)&chunk.binXEnd, sizeof(int32_t));
+        writeCompressedBuffer(file, (char*)&chunk.binYStart, sizeof(int32_t));
+        writeCompressedBuffer(file, (char*)&chunk.binYEnd, sizeof(int32_t));
+    }
+}
+
+// how far an interrupted dump got: the pairs before firstPair are complete, their chunks are in index and the output
+// file holds them in its first length bytes
+struct DumpCheckpoint {
+    size_t firstPair = 0;
+    int64_t length = 0;
+    int64_t numRecords = 0;
+    vector<HicSliceChunk> index;
+};
+
+// the first line of a dump manifest, naming everything the output depends on, so a manifest is only used to resume
+// the same dump
+string getDumpManifestHeader(const string &matrixType, const string &norm, const string &filePath, const string &unit,
+                             int32_t resolution, bool sorted, size_t numPairs) {
+    stringstream header;
+    header << "straw dump manifest 1\t" << matrixType << "\t" << norm << "\t" << unit << "\t" << resolution << "\t"
+           << (sorted ? "sorted" : "unsorted") << "\t" << numPairs << "\t" << filePath;
+    return header.str();
+}
+
+void writeManifestChunk(ostream &manifest, const HicSliceChunk &chunk) {
+    manifest << "chunk " << chunk.chr1Key << " " << chunk.chr2Key << " " << chunk.offset << " " << chunk.size << " "
+             << chunk.numRecords << " " << chunk.binXStart << " " << chunk.binXEnd << " " << chunk.binYStart << " "
+             << chunk.binYEnd << "\n";
+}
+
+// the last checkpoint of a manifest with the given header: "chunk" lines for the index, then a "done" line with the
+// pair, the length of the output and the number of records so far. lines after the last "done" belong to a pair that
+// did not finish, and a line without its newline was cut off
+bool readDumpManifest(const string &path, const string &header, DumpCheckpoint &checkpoint) {
+    ifstream in(path);
+    string line;
+    if (!getline(in, line) || line != header) {
+        return false;
+    }
+    bool found = false;
+    vector<HicSliceChunk> pending;
+    while (getline(in, line) && !in.eof()) {
+        istringstream fields(line);
+        string kind;
+        fields >> kind;
+        if (kind == "chunk") {
+            HicSliceChunk chunk{};
+            fields >> chunk.chr1Key >> chunk.chr2Key >> chunk.offset >> chunk.size >> chunk.numRecords
+                   >> chunk.binXStart >> chunk.binXEnd >> chunk.binYStart >> chunk.binYEnd;
+            if (!fields) break;
+            pending.push_back(chunk);
+        } else if (kind == "done") {
+            size_t pairIndex;
+            int64_t length, numRecords;
+            fields >> pairIndex >> length >> numRecords;
+            if (!fields) break;
+            checkpoint.firstPair = pairIndex + 1;
+            checkpoint.length = length;
+            checkpoint.numRecords = numRecords;
+            checkpoint.index.insert(checkpoint.index.end(), pending.begin(), pending.end());
+            pending.clear();
+            found = true;
+        } else {
+            break;
+        }
+    }
+    return found;
+}
+
+// sorts more records than fit in memory. records are collected until they take memoryBudget bytes, then that run is
+// sorted and spilled to a temporary file (pathPrefix and a number); finish merges the spilled runs and the records still
+// in memory into one sorted sequence. records that fit in the budget are sorted in memory and never touch the disk.
+template<typename T, typename Less>
+class ExternalSorter {
+public:
+    ExternalSorter(int64_t memoryBudget, string pathPrefix, Less less)
+            : maxRecords(max<size_t>(1024, static_cast<size_t>(memoryBudget) / sizeof(T))),
+              pathPrefix(move(pathPrefix)), less(less) {}
+
+    ~ExternalSorter() {
+        for (SpilledRun &run : runs) {
+            closeRun(run);
+        }
+    }
+
+    bool empty() const {
+        return buffer.empty() && runs.empty();
+    }
+
+    int64_t getNumRunsSpilled() const {
+        return numRunsSpilled;
+    }
+
+    void add(const T *records, size_t n) {
+        for (size_t i = 0; i < n;) {
+            size_t take = min(n - i, maxRecords - buffer.size());
+            buffer.insert(buffer.end(), records + i, records + i + take);
+            i += take;
+            if (buffer.size() == maxRecords) {
+                spill();
+            }
+        }
+    }
+
+    // hands every record added so far to emit, in order and at most batchSize at a time, and starts over; false if a
+    // temporary file could not be written or read
+    template<typename Emit>
+    bool finish(size_t batchSize, Emit emit) {
+        if (runs.empty()) {
+            sort(buffer.begin(), buffer.end(), less);
+            for (size_t start = 0; start < buffer.size(); start += batchSize) {
+                emit(vector<T>(buffer.begin() + start, buffer.begin() + min(buffer.size(), start + batchSize)));
+            }
+            buffer.clear();
+            return true;
+        }
+        if (!buffer.empty()) {
+            spill();
+        }
+        vector<T>().swap(buffer); // the merge buffers take the budget instead
+
+        // more runs than can be merged at once are first merged into longer runs
+        while (runs.size() > MAX_FAN_IN) {
+            vector<SpilledRun> group(runs.begin(), runs.begin() + MAX_FAN_IN);
+            runs.erase(runs.begin(), runs.begin() + MAX_FAN_IN);
+            SpilledRun merged = createRun();
+            merge(group, batchSize, [this, &merged](const vector<T> &batch) {
+                if (merged.file == nullptr || fwrite(batch.data(), sizeof(T), batch.size(), merged.file) != batch.size()) {
+                    failed = true;
+                }
+            });
+            if (merged.file != nullptr) rewind(merged.file);
+            runs.push_back(merged);
+        }
+        merge(runs, batchSize, emit);
+        runs.clear();
+        bool ok = !failed;
+        failed = false;
+        return ok;
+    }
+
+private:
+    struct SpilledRun {
+        FILE *file;
+        string path;
+    };
+    static const size_t MAX_FAN_IN = 64;
+
+    size_t maxRecords;
+    string pathPrefix;
+    Less less;
+    vector<T> buffer;
+    vector<SpilledRun> runs;
+    int64_t numRunsSpilled = 0;
+    int64_t numRunsCreated = 0;
+    bool failed = false;
+
+    SpilledRun createRun() {
+        SpilledRun run{nullptr, pathPrefix + to_string(numRunsCreated++)};
+        run.file = fopen(run.path.c_str(), "w+b");
+        if (run.file == nullptr) {
+            cerr << "Could not create temporary file " << run.path << endl;
+            failed = true;
+        }
+        return run;
+    }
+
+    static void closeRun(SpilledRun &run) {
+        if (run.file != nullptr) {
+            fclose(run.file);
+            remove(run.path.c_str());
+        }
+        run.file = nullptr;
+    }
+
+    void spill() {
+        sort(buffer.begin(), buffer.end(), less);
+        SpilledRun run = createRun();
+        if (run.file != nullptr) {
+            if (fwrite(buffer.data(), sizeof(T), buffer.size(), run.file) != buffer.size()) {
+                cerr << "Could not write temporary file " << run.path << endl;
+                failed = true;
+            }
+            rewind(run.file);
+        }
+        runs.push_back(run);
+        buffer.clear();
+        numRunsSpilled++;
+    }
+
+    // k-way merge of sorted runs, each read through a buffer of its share of the memory budget. the runs are closed
+    // and removed once read
+    template<typename Emit>
+    void merge(vector<SpilledRun> &inputs, size_t batchSize, Emit emit) {
+        size_t recordsPerRun = max<size_t>(1024, maxRecords / (inputs.size() + 1));
+        vector<vector<T>> buffers(inputs.size());
+        vector<size_t> positions(inputs.size(), 0);
+        auto refill = [&inputs, &buffers, &positions, recordsPerRun](size_t r) {
+            if (inputs[r].file == nullptr) return false;
+            buffers[r].resize(recordsPerRun);
+            buffers[r].resize(fread(buffers[r].data(), sizeof(T), recordsPerRun, inputs[r].file));
+            positions[r] = 0;
+            return !buffers[r].empty();
+        };
+        // a min-heap of the runs by their next record
+        auto later = [this, &buffers, &positions](size_t a, size_t b) {
+            return less(buffers[b][positions[b]], buffers[a][positions[a]]);
+        };
+        priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+        for (size_t r = 0; r < inputs.size(); r++) {
+            if (refill(r)) heads.push(r);
+        }
+        vector<T> batch;
+        batch.reserve(batchSize);
+        while (!heads.empty()) {
+            size_t r = heads.top();
+            heads.pop();
+            batch.push_back(buffers[r][positions[r]++]);
+            if (batch.size() == batchSize) {
+                emit(batch);
+                batch.clear();
+            }
+            if (positions[r] < buffers[r].size() || refill(r)) {
+                heads.push(r);
+            }
+        }
+        if (!batch.empty()) {
+            emit(batch);
+        }
+        for (SpilledRun &run : inputs) {
+            closeRun(run);
+        }
+    }
+};
+
 void dumpGenomeWideDataAtResolution(const std::string& matrixType,
                                   const std::string& norm,
                                   const std::string& filePath,
                                   const std::string& unit,
                                   int32_t resolution,
-                                  const std::string& outputPath) {
+                                  const std::string& outputPath,
+                                  int32_t compressionLevel,
+                                  int64_t sortMemory) {
+    auto startTime = chrono::steady_clock::now();
+
     // Open HiC file
     HiCFile* hicFile = new HiCFile(filePath);
     
     // Create header
     HicSliceHeader header;
+    header.version = 3;
     header.resolution = resolution;
     
     // Get chromosomes and create mapping
@@ -1814,65 +4027,507 @@ void dumpGenomeWideDataAtResolution(const std::string& matrixType,
     }
     header.numChromosomes = header.chromosomeKeys.size();
     
-    // Open output file
-    gzFile outFile = gzopen(outputPath.c_str(), "wb");
-    if (!outFile) {
+    unsigned int numThreads = getNumWorkerThreads();
+
+    // chromosome pairs in output order
+    vector<pair<chromosome, chromosome>> pairs;
+    for (const auto& chr1 : chromosomes) {
+        if (chr1.index <= 0) continue;
+        for (const auto& chr2 : chromosomes) {
+            if (chr2.index <= 0 || chr2.index < chr1.index) continue;
+            pairs.emplace_back(chr1, chr2);
+        }
+    }
+
+    // slice dumps record each pair that has reached the output file in a manifest next to it, so a dump that was
+    // interrupted picks up after the last such pair instead of starting over. the manifest goes once the dump is done.
+    bool streamFormat = false;
+    bool arrowOutput = isArrowPath(outputPath, streamFormat);
+    string manifestPath = outputPath + ".manifest";
+    string manifestHeader = getDumpManifestHeader(matrixType, norm, filePath, unit, resolution, sortMemory > 0,
+                                                  pairs.size());
+    DumpCheckpoint resumed;
+    struct stat outputStat{};
+    bool resuming = !arrowOutput && readDumpManifest(manifestPath, manifestHeader, resumed) &&
+                    stat(outputPath.c_str(), &outputStat) == 0 && outputStat.st_size >= resumed.length;
+    if (!resuming) {
+        resumed = DumpCheckpoint();
+    }
+
+    // Open output file: Arrow for .arrow/.feather/.arrows paths, otherwise a slice file whose chunks are compressed on
+    // their own threads, apart from the decoding pool
+    unique_ptr<ArrowContactWriter> arrowFile;
+    unique_ptr<HicSliceWriter> outFile;
+    if (arrowOutput) {
+        vector<string> chromosomeNames(header.chromosomeKeys.size());
+        for (const auto& chr : header.chromosomeKeys) {
+            chromosomeNames[chr.second] = chr.first;
+        }
+        arrowFile.reset(new ArrowContactWriter(outputPath, chromosomeNames, true, resolution, unit, streamFormat));
+    } else {
+        outFile.reset(new HicSliceWriter(outputPath, compressionLevel, static_cast<int32_t>(numThreads), 4 << 20,
+                                         resuming ? resumed.length : -1));
+    }
+    if (arrowFile ? !arrowFile->isOpen() : !outFile->isOpen()) {
         std::cerr << "Error: Could not open output file " << outputPath << std::endl;
+        delete hicFile;
         return;
     }
     
-    // Write header
-    writeHeader(outFile, header);
+    // Write header, in a gzip member of its own
+    ofstream manifest;
+    if (outFile) {
+        if (resuming) {
+            cerr << "Resuming the dump in " << outputPath << " after " << resumed.firstPair << " of " << pairs.size()
+                 << " chromosome pairs" << endl;
+        } else {
+            writeHeader(*outFile, header);
+            outFile->endMember();
+        }
+        // the manifest starts over from the checkpoint it was resumed at, dropping whatever came after it
+        manifest.open(manifestPath, ios::out | ios::trunc);
+        manifest << manifestHeader << "\n";
+        if (resuming) {
+            for (const HicSliceChunk &chunk : resumed.index) {
+                writeManifestChunk(manifest, chunk);
+            }
+            manifest << "done " << resumed.firstPair - 1 << " " << resumed.length << " " << resumed.numRecords << "\n";
+        }
+        manifest.flush();
+    }
+
+    ThreadPool pool(numThreads);
+
+    // find each pair's matrix, block index and normalize stage (normalization vectors and expected values, read from
+    // the file or computed, for norm and oe) in parallel, then cut its blocks into chunks in block order
+    vector<unique_ptr<MatrixZoomData>> matrices(pairs.size());
+    vector<QueryScaling> scalings(pairs.size());
+    vector<const scaleTables*> tables(pairs.size(), nullptr);
+    vector<future<bool>> loaded;
+    for (size_t p = 0; p < pairs.size(); p++) {
+        matrices[p].reset(hicFile->getMatrixZoomData(pairs[p].first.name, pairs[p].second.name, matrixType, norm,
+                                                     unit, resolution));
+        MatrixZoomData *mzd = matrices[p].get();
+        size_t firstPair = resumed.firstPair;
+        loaded.push_back(pool.enqueue([mzd, p, firstPair, &scalings, &tables]() {
+            if (p < firstPair || !mzd->hasFooter() || mzd->getBlockMap().empty()) return false;
+            bool ok;
+            tables[p] = mzd->getMatrixScaling(scalings[p], ok);
+            return ok;
+        }));
+    }
+    const size_t blocksPerChunk = 16;
+    vector<BlockChunk> chunks;
+    for (size_t p = 0; p < pairs.size(); p++) {
+        bool found;
+        try {
+            found = loaded[p].get();
+        } catch (const std::exception& e) {
+            std::cerr << "Skipping chromosome pair " << pairs[p].first.name << "-" << pairs[p].second.name
+                      << " (indices " << pairs[p].first.index << "-" << pairs[p].second.index
+                      << "): " << e.what() << std::endl;
+            continue;
+        }
+        if (!found) continue;
+        for (const auto& blockMapEntry : matrices[p]->getBlockMap()) {
+            if (chunks.empty() || chunks.back().pairIndex != p || chunks.back().blocks.size() == blocksPerChunk) {
+                chunks.push_back({p, {}});
+            }
+            chunks.back().blocks.push_back(blockMapEntry.second);
+        }
+    }
+
+    // chunks are decoded on all cores, a bounded number ahead of the writer, and written strictly in order, so the
+    // output is the same as a serial dump. the writer groups them into index chunks of at most about recordsPerChunk
+    // records of one pair, each encoded in columns and compressed as gzip members of its own so it can be read alone.
+    auto decodeChunk = [&matrices, &pairs, &header, &tables](const BlockChunk *chunk) {
+        const MatrixZoomData *mzd = matrices[chunk->pairIndex].get();
+        const scaleTables *pairTables = tables[chunk->pairIndex];
+        int16_t chr1Key = header.chromosomeKeys.at(pairs[chunk->pairIndex].first.name);
+        int16_t chr2Key = header.chromosomeKeys.at(pairs[chunk->pairIndex].second.name);
+        vector<CompressedContactRecord> out;
+        HiCFileStream stream(mzd->fileName);
+        for (const indexEntry &idx : chunk->blocks) {
+            vector<contactRecord> blockRecords = readBlock(stream, idx, mzd->version);
+            if (pairTables != nullptr) {
+                scaleContactRecords(blockRecords.data(), blockRecords.size(), *pairTables);
+            }
+            for (const contactRecord& rec : blockRecords) {
+                // Only write records with valid, positive counts
+                if (rec.counts > 0 && !isnan(rec.counts) && !isinf(rec.counts)) {
+                    CompressedContactRecord compressedRecord;
+                    memset(&compressedRecord, 0, sizeof(compressedRecord)); // padding too, so output is reproducible
+                    compressedRecord.chr1Key = chr1Key;
+                    compressedRecord.binX = rec.binX;
+                    compressedRecord.chr2Key = chr2Key;
+                    compressedRecord.binY = rec.binY;
+                    compressedRecord.value = rec.counts;
+                    out.push_back(compressedRecord);
+                }
+            }
+        }
+        stream.close();
+        return out;
+    };
+    const size_t maxInFlight = 4 * static_cast<size_t>(numThreads);
+    deque<future<vector<CompressedContactRecord>>> inFlight;
+    size_t nextChunk = 0;
+    const int64_t recordsPerChunk = 1 << 16;
+    vector<HicSliceChunk> index = resumed.index;
+    const size_t numRestored = index.size();
+    vector<pair<size_t, size_t>> indexMembers; // first member and end of each index chunk after the restored ones
+    vector<CompressedContactRecord> chunkRecords;
+    string encoded;
+    auto endIndexChunk = [&outFile, &indexMembers, &chunkRecords, &encoded]() {
+        if (chunkRecords.empty()) return;
+        encoded.clear();
+        encodeHicSliceChunk(chunkRecords, encoded);
+        writeCompressedBuffer(*outFile, encoded.data(), encoded.size());
+        indexMembers.back().second = outFile->endMember();
+        chunkRecords.clear();
+    };
+    int64_t numRecords = resumed.numRecords, numBlocks = 0;
+    // records of one chromosome pair, in block order or sorted
+    auto writeRecords = [&](const vector<CompressedContactRecord> &records) {
+        const CompressedContactRecord &first = records.front();
+        numRecords += static_cast<int64_t>(records.size());
+        if (arrowFile) {
+            // one record batch per decoded chunk, or per recordsPerChunk sorted records
+            vector<int32_t> binX(records.size()), binY(records.size());
+            vector<float> counts(records.size());
+            for (size_t i = 0; i < records.size(); i++) {
+                binX[i] = records[i].binX;
+                binY[i] = records[i].binY;
+                counts[i] = records[i].value;
+            }
+            arrowFile->writeBatch(first.chr1Key, first.chr2Key, binX, binY, counts);
+            return;
+        }
+        if (index.empty() || index.back().chr1Key != first.chr1Key || index.back().chr2Key != first.chr2Key ||
+            index.back().numRecords >= recordsPerChunk) {
+            endIndexChunk();
+            index.push_back({first.chr1Key, first.chr2Key, 0, 0, 0, first.binX, first.binX, first.binY, first.binY});
+            indexMembers.emplace_back(outFile->endMember(), 0);
+        }
+        HicSliceChunk &current = index.back();
+        for (const CompressedContactRecord& record : records) {
+            current.binXStart = min(current.binXStart, record.binX);
+            current.binXEnd = max(current.binXEnd, record.binX);
+            current.binYStart = min(current.binYStart, record.binY);
+            current.binYEnd = max(current.binYEnd, record.binY);
+        }
+        current.numRecords += static_cast<int64_t>(records.size());
+        chunkRecords.insert(chunkRecords.end(), records.begin(), records.end());
+    };
+
+    // sorted dumps collect each pair's records in the sorter and write them once the next pair starts
+    auto byBins = [](const CompressedContactRecord &a, const CompressedContactRecord &b) {
+        return a.binX < b.binX || (a.binX == b.binX && a.binY < b.binY);
+    };
+    typedef ExternalSorter<CompressedContactRecord, decltype(byBins)> RecordSorter;
+    unique_ptr<RecordSorter> sorter;
+    if (sortMemory > 0) {
+        sorter.reset(new RecordSorter(sortMemory, outputPath + ".sort", byBins));
+    }
+    bool sortedOk = true;
+    auto writeSorted = [&sorter, &sortedOk, &writeRecords, recordsPerChunk]() {
+        if (!sorter->empty()) {
+            sortedOk = sorter->finish(static_cast<size_t>(recordsPerChunk), writeRecords) && sortedOk;
+        }
+    };
+
+    // a finished pair is checkpointed once all of its members are in the file, which the writer gets to on its own
+    // time, so checkpoints never hold up compression
+    struct PairCheckpoint {
+        size_t pairIndex;
+        size_t endMember;
+        size_t numChunks;
+        int64_t numRecords;
+    };
+    deque<PairCheckpoint> checkpoints;
+    size_t numChunksInManifest = numRestored;
+    auto finishPair = [&](size_t pairIndex) {
+        if (sorter) {
+            writeSorted();
+        }
+        if (outFile) {
+            endIndexChunk();
+            checkpoints.push_back({pairIndex, outFile->endMember(), index.size(), numRecords});
+        }
+    };
+    auto writeCheckpoints = [&]() {
+        if (checkpoints.empty() || outFile->getMembersWritten() < checkpoints.front().endMember) return;
+        outFile->syncFile();
+        while (!checkpoints.empty() && outFile->getMembersWritten() >= checkpoints.front().endMember) {
+            const PairCheckpoint &checkpoint = checkpoints.front();
+            for (; numChunksInManifest < checkpoint.numChunks; numChunksInManifest++) {
+                HicSliceChunk chunk = index[numChunksInManifest];
+                const pair<size_t, size_t> &members = indexMembers[numChunksInManifest - numRestored];
+                chunk.offset = outFile->getMemberOffset(members.first);
+                chunk.size = outFile->getMemberOffset(members.second) - chunk.offset;
+                writeManifestChunk(manifest, chunk);
+            }
+            manifest << "done " << checkpoint.pairIndex << " " << outFile->getMemberOffset(checkpoint.endMember) << " "
+                     << checkpoint.numRecords << " " << pairs[checkpoint.pairIndex].first.name << "-"
+                     << pairs[checkpoint.pairIndex].second.name << "\n";
+            checkpoints.pop_front();
+        }
+        manifest.flush();
+    };
+    size_t currentPair = 0, writtenChunks = 0;
+
+    while (nextChunk < chunks.size() || !inFlight.empty()) {
+        while (nextChunk < chunks.size() && inFlight.size() < maxInFlight) {
+            const BlockChunk *chunk = &chunks[nextChunk++];
+            inFlight.push_back(pool.enqueue([&decodeChunk, chunk]() { return decodeChunk(chunk); }));
+        }
+        vector<CompressedContactRecord> records = inFlight.front().get();
+        inFlight.pop_front();
+        size_t pairIndex = chunks[writtenChunks++].pairIndex;
+        if (writtenChunks > 1 && pairIndex != currentPair) {
+            finishPair(currentPair);
+        }
+        currentPair = pairIndex;
+        if (!records.empty()) {
+            if (sorter) {
+                sorter->add(records.data(), records.size());
+            } else {
+                writeRecords(records);
+            }
+        }
+        if (outFile) {
+            writeCheckpoints();
+        }
+    }
+    if (!chunks.empty()) {
+        finishPair(currentPair);
+    }
+    if (sorter && !sortedOk) {
+        cerr << "Error: sorting through temporary files failed; the output is incomplete" << endl;
+    }
+    for (const BlockChunk &chunk : chunks) {
+        numBlocks += static_cast<int64_t>(chunk.blocks.size());
+    }
+
+    if (outFile) {
+        endIndexChunk();
+
+        // once every member is written their offsets are known; the index follows them, then the trailer pointing at it
+        outFile->flush();
+        for (size_t i = numRestored; i < index.size(); i++) {
+            index[i].offset = outFile->getMemberOffset(indexMembers[i - numRestored].first);
+            index[i].size = outFile->getMemberOffset(indexMembers[i - numRestored].second) - index[i].offset;
+        }
+        int64_t indexOffset = outFile->getBytesWritten();
+        writeIndex(*outFile, index);
+        outFile->writeTrailer(indexOffset);
+        outFile->close();
+        manifest.close();
+        remove(manifestPath.c_str());
+    } else {
+        arrowFile->close();
+    }
     
-    // Process each chromosome pair
-    for (const auto& chr1 : chromosomes) {
-        if (chr1.index <= 0) continue;
-        
-        for (const auto& chr2 : chromosomes) {
-            if (chr2.index <= 0 || chr2.index < chr1.index) continue;
-            
-            try {
-                MatrixZoomData* mzd = hicFile->getMatrixZoomData(
-                    chr1.name, chr2.name, matrixType, norm, unit, resolution
-                );
-                
-                if (mzd && mzd->foundFooter) {
-                    // Process each block in the blockMap
-                    for (const auto& blockMapEntry : mzd->blockMap) {
-                        // Directly read and write records
-                        vector<contactRecord> records = readBlock(mzd->fileName, blockMapEntry.second, mzd->version);
-                        
-                        for (const contactRecord& rec : records) {
-                            // Only write records with valid, positive counts
-                            if (rec.counts > 0 && !isnan(rec.counts) && !isinf(rec.counts)) {
-                                CompressedContactRecord compressedRecord;
-                                compressedRecord.chr1Key = header.chromosomeKeys[chr1.name];
-                                compressedRecord.binX = rec.binX;
-                                compressedRecord.chr2Key = header.chromosomeKeys[chr2.name];
-                                compressedRecord.binY = rec.binY;
-                                compressedRecord.value = rec.counts;
-                                
-                                writeContactRecord(outFile, compressedRecord);
-                            }
+    // Cleanup
+    matrices.clear();
+    delete hicFile;
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    cerr << "Dumped " << numRecords << " records from " << numBlocks << " blocks of " << pairs.size()
+         << " chromosome pairs in " << seconds << " s (" << static_cast<int64_t>(numRecords / max(seconds, 1e-9))
+         << " records/s)";
+    if (outFile) {
+        cerr << ", " << outFile->getBytesWritten() << " compressed bytes in " << index.size() << " chunks";
+    }
+    if (sorter) {
+        cerr << ", sorted with " << sorter->getNumRunsSpilled() << " runs spilled to disk";
+    }
+    cerr << endl;
+}
+
+// a pixel of a cooler: global bin ids along the genome-wide matrix, and the count
+struct CoolerPixel {
+    int64_t bin1;
+    int64_t bin2;
+    double count;
+
+    bool operator<(const CoolerPixel &other) const {
+        return bin1 < other.bin1 || (bin1 == other.bin1 && bin2 < other.bin2);
+    }
+};
+
+void convertToCooler(const string &fileName, const string &outputPath, const vector<int32_t> &resolutions,
+                     const vector<string> &norms, int64_t sortMemory) {
+    auto startTime = chrono::steady_clock::now();
+    HiCFile *hicFile = new HiCFile(fileName);
+    vector<int32_t> binSizes = resolutions.empty() ? hicFile->getResolutions() : resolutions;
+    for (int32_t binSize : binSizes) {
+        const vector<int32_t> &available = hicFile->resolutions;
+        if (find(available.begin(), available.end(), binSize) == available.end()) {
+            cerr << "File does not have BP resolution " << binSize << "; it has";
+            for (int32_t resolution : available) {
+                cerr << " " << resolution;
+            }
+            cerr << endl;
+            delete hicFile;
+            return;
+        }
+    }
+    bool multiResolution = binSizes.size() > 1 ||
+                           (outputPath.size() >= 6 && outputPath.compare(outputPath.size() - 6, 6, ".mcool") == 0);
+    CoolerWriter writer(outputPath, multiResolution);
+    if (!writer.isOpen()) {
+        cerr << "Error: Could not open output file " << outputPath << endl;
+        delete hicFile;
+        return;
+    }
+
+    vector<chromosome> chromosomes;
+    vector<string> chromNames;
+    vector<int64_t> chromLengths;
+    for (const chromosome &chrom : hicFile->getChromosomes()) {
+        if (chrom.index > 0) {
+            chromosomes.push_back(chrom);
+            chromNames.push_back(chrom.name);
+            chromLengths.push_back(chrom.length);
+        }
+    }
+
+    unsigned int numThreads = getNumWorkerThreads();
+    ThreadPool pool(numThreads);
+    const size_t maxInFlight = 4 * static_cast<size_t>(numThreads);
+    typedef ExternalSorter<CoolerPixel, less<CoolerPixel>> PixelSorter;
+    PixelSorter sorter(sortMemory, outputPath + ".sort", less<CoolerPixel>());
+    bool sortedOk = true;
+    int64_t numPixels = 0;
+    for (int32_t binSize : binSizes) {
+        // first bin of each chromosome; cooler bins end at the chromosome's end
+        vector<int64_t> binOffsets(1, 0);
+        for (int64_t length : chromLengths) {
+            binOffsets.push_back(binOffsets.back() + (length + binSize - 1) / binSize);
+        }
+
+        // bin weights: cooler balances by multiplying counts with the weights of both bins, where straw divides them
+        // by both normalization values, so the weights are their inverses (NaN where there is none)
+        vector<string> weightNames = norms.empty() ? hicFile->getStoredNormalizations("BP", binSize) : norms;
+        vector<vector<double>> weights(weightNames.size(), vector<double>(binOffsets.back(), NAN));
+        vector<future<void>> weighted;
+        for (size_t w = 0; w < weightNames.size(); w++) {
+            for (size_t c = 0; c < chromosomes.size(); c++) {
+                weighted.push_back(pool.enqueue([&, w, c]() {
+                    unique_ptr<MatrixZoomData> mzd(hicFile->getMatrixZoomData(chromNames[c], chromNames[c],
+                                                                              "observed", weightNames[w], "BP",
+                                                                              binSize));
+                    const vector<double> &normVector = mzd->getNormVector(chromosomes[c].index);
+                    int64_t numBins = binOffsets[c + 1] - binOffsets[c];
+                    for (int64_t b = 0; b < numBins && b < static_cast<int64_t>(normVector.size()); b++) {
+                        if (normVector[b] > 0 && !isinf(normVector[b])) {
+                            weights[w][binOffsets[c] + b] = 1.0 / normVector[b];
                         }
                     }
+                }));
+            }
+        }
+        for (future<void> &done : weighted) {
+            done.get();
+        }
+        // the first normalization is also the weight column cooler balances with by default
+        if (!weightNames.empty()) {
+            weightNames.push_back("weight");
+            weights.push_back(weights.front());
+        }
+        if (!writer.beginResolution(binSize, chromNames, chromLengths, hicFile->getGenomeID(), weightNames, weights)) {
+            break;
+        }
+
+        // pixels are ordered by bin1, so the rows of each chromosome (its matrices with itself and every later
+        // chromosome) form a band that is sorted on its own. the blocks are decoded in parallel, a bounded number ahead,
+        // into the sorter, which spills runs beyond sortMemory to disk; each band is written once the next one starts
+        vector<pair<size_t, size_t>> pairs;
+        vector<unique_ptr<MatrixZoomData>> matrices;
+        vector<future<bool>> loaded;
+        for (size_t c1 = 0; c1 < chromosomes.size(); c1++) {
+            for (size_t c2 = c1; c2 < chromosomes.size(); c2++) {
+                pairs.emplace_back(c1, c2);
+                matrices.emplace_back(hicFile->getMatrixZoomData(chromNames[c1], chromNames[c2], "observed", "NONE",
+                                                                 "BP", binSize));
+                MatrixZoomData *mzd = matrices.back().get();
+                loaded.push_back(pool.enqueue([mzd]() { return mzd->hasFooter() && !mzd->getBlockMap().empty(); }));
+            }
+        }
+        const size_t blocksPerChunk = 16;
+        vector<BlockChunk> chunks;
+        for (size_t p = 0; p < pairs.size(); p++) {
+            if (!loaded[p].get()) continue;
+            for (const auto &blockMapEntry : matrices[p]->getBlockMap()) {
+                if (chunks.empty() || chunks.back().pairIndex != p || chunks.back().blocks.size() == blocksPerChunk) {
+                    chunks.push_back({p, {}});
                 }
-                delete mzd;
-            } catch (const std::exception& e) {
-                std::cerr << "Skipping chromosome pair " << chr1.name << "-" << chr2.name 
-                         << " (indices " << chr1.index << "-" << chr2.index 
-                         << "): " << e.what() << std::endl;
-                continue;
-            } catch (...) {
-                std::cerr << "Skipping chromosome pair " << chr1.name << "-" << chr2.name 
-                         << " (indices " << chr1.index << "-" << chr2.index 
-                         << "): Unknown error" << std::endl;
-                continue;
+                chunks.back().blocks.push_back(blockMapEntry.second);
             }
         }
+        auto decodeChunk = [&matrices, &pairs, &binOffsets](const BlockChunk *chunk) {
+            const MatrixZoomData *mzd = matrices[chunk->pairIndex].get();
+            size_t c1 = pairs[chunk->pairIndex].first, c2 = pairs[chunk->pairIndex].second;
+            int64_t numBins1 = binOffsets[c1 + 1] - binOffsets[c1], numBins2 = binOffsets[c2 + 1] - binOffsets[c2];
+            vector<CoolerPixel> pixels;
+            HiCFileStream stream(mzd->fileName);
+            for (const indexEntry &idx : chunk->blocks) {
+                for (const contactRecord &rec : readBlock(stream, idx, mzd->version)) {
+                    int64_t binX = rec.binX, binY = rec.binY;
+                    if (c1 == c2 && binX > binY) swap(binX, binY);
+                    if (rec.counts > 0 && !isnan(rec.counts) && binX < numBins1 && binY < numBins2) {
+                        pixels.push_back({binOffsets[c1] + binX, binOffsets[c2] + binY, rec.counts});
+                    }
+                }
+            }
+            stream.close();
+            return pixels;
+        };
+
+        const size_t pixelsPerWrite = 1 << 20;
+        vector<int64_t> bin1, bin2;
+        vector<double> counts;
+        auto writeBand = [&]() {
+            sortedOk = sorter.finish(pixelsPerWrite, [&](const vector<CoolerPixel> &pixels) {
+                bin1.clear();
+                bin2.clear();
+                counts.clear();
+                for (const CoolerPixel &pixel : pixels) {
+                    bin1.push_back(pixel.bin1);
+                    bin2.push_back(pixel.bin2);
+                    counts.push_back(pixel.count);
+                }
+                writer.writePixels(bin1, bin2, counts);
+                numPixels += static_cast<int64_t>(pixels.size());
+            }) && sortedOk;
+        };
+        deque<future<vector<CoolerPixel>>> inFlight;
+        size_t nextChunk = 0, writtenChunks = 0, currentBand = 0;
+        while (nextChunk < chunks.size() || !inFlight.empty()) {
+            while (nextChunk < chunks.size() && inFlight.size() < maxInFlight) {
+                const BlockChunk *chunk = &chunks[nextChunk++];
+                inFlight.push_back(pool.enqueue([&decodeChunk, chunk]() { return decodeChunk(chunk); }));
+            }
+            vector<CoolerPixel> pixels = inFlight.front().get();
+            inFlight.pop_front();
+            size_t band = pairs[chunks[writtenChunks++].pairIndex].first;
+            if (band != currentBand) {
+                writeBand();
+                currentBand = band;
+            }
+            sorter.add(pixels.data(), pixels.size());
+        }
+        writeBand();
+        writer.endResolution();
     }
-    
-    // Close files and cleanup
-    gzclose(outFile);
+    writer.close();
     delete hicFile;
+    if (!sortedOk) {
+        cerr << "Error: sorting through temporary files failed; the output is incomplete" << endl;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    cerr << "Converted " << numPixels << " pixels at " << binSizes.size() << " resolutions in " << seconds << " s, "
+         << "sorted with " << sorter.getNumRunsSpilled() << " runs spilled to disk" << endl;
 }
@@ -86,6 +86,59 @@ struct memstream : virtual membuf, std::istream {
     }
 };
 
+// blocks read by queries so far, and how many of them held records inside the queried region
+struct blockReadStats {
+    int64_t blocksRead;
+    int64_t blocksContributed;
+};
+
+// a query rectangle in genomic coordinates: [x0, x1] on the first chromosome of a matrix and [y0, y1] on the second
+struct queryRegion {
+    int64_t x0;
+    int64_t x1;
+    int64_t y0;
+    int64_t y1;
+};
+
+// two loop anchors, as in the first six columns of a BEDPE line
+struct anchorPair {
+    std::string chr1;
+    int64_t start1;
+    int64_t end1;
+    std::string chr2;
+    int64_t start2;
+    int64_t end2;
+};
+
+// an aggregate (APA) matrix: the sum of the width x width submatrices centered on numLoops anchor pairs, row-major with
+// rows along the first anchor
+struct pileupResult {
+    int32_t width;
+    int64_t numLoops;
+    std::vector<double> sum;
+};
+
+// a contact vs distance (P(s)) curve of one chromosome, over log-spaced distance bins. contacts[i] / numPairs[i] is
+// the mean contact count of the bin pairs whose distance from the diagonal falls in bin i
+struct distanceDecayCurve {
+    std::string chr;
+    std::vector<int64_t> distances; // smallest distance in each bin, in units
+    std::vector<double> contacts;   // summed counts at those distances
+    std::vector<int64_t> numPairs;  // number of bin pairs at those distances (with a norm, those whose bins have one)
+};
+
+// the insulation track of one chromosome. score[i] is the contact sum between bins [i - window, i - 1] and
+// [i + 1, i + window] (NaN where that square runs off the chromosome) and normalizedScore[i] is log2 of score[i] over the
+// chromosome's mean score (NaN for empty squares). boundaries are the bins at local minima of normalizedScore, with
+// their strength: how far they lie below the highest score on either side within window bins.
+struct insulationTrack {
+    std::string chr;
+    std::vector<double> score;
+    std::vector<double> normalizedScore;
+    std::vector<int64_t> boundaries;
+    std::vector<double> boundaryStrengths;
+};
+
 // for holding data from URL call
 struct MemoryStruct {
     char *memory;
@@ -102,8 +155,62 @@ std::vector<std::vector<float>> strawAsMatrix(const std::string& matrixType, con
                                             const std::string& chr2loc, const std::string& unit, 
                                             int32_t binsize);
 
+// the records of chrloc (chr[:start:end]) against itself at most maxDistance (in units) from the diagonal, as straw would
+// return them for the same region after dropping the contacts further away. only the blocks reaching into that band of
+// the matrix are read, which for small distances is a small fraction of the region.
+std::vector<contactRecord> strawBand(const std::string& matrixType, const std::string& norm, const std::string& fname,
+                                     const std::string& chrloc, const std::string& unit, int32_t binsize,
+                                     int64_t maxDistance);
+
+// the records for many regions, as straw(matrixType, norm, fname, chr1locs[i], chr2locs[i], unit, binsize) would return
+// for each i. the file is opened once and each block is read once, however many of the regions need it.
+std::vector<std::vector<contactRecord>> strawForRegions(const std::string& matrixType, const std::string& norm,
+                                                        const std::string& fname,
+                                                        const std::vector<std::string>& chr1locs,
+                                                        const std::vector<std::string>& chr2locs,
+                                                        const std::string& unit, int32_t binsize);
+
+// reads the anchor pairs of a BEDPE file; header and comment lines are skipped
+std::vector<anchorPair> readBedpe(const std::string& fileName);
+
+// aggregate peak analysis: sums the (2 * window + 1) x (2 * window + 1) bin submatrices centered on the midpoints of
+// each pair of anchors. pairs whose window runs off a chromosome, or whose chromosomes aren't in the file, are skipped.
+// every block is read once however many loops it covers, and the sum is reduced over per-thread partial sums.
+pileupResult pileup(const std::string& matrixType, const std::string& norm, const std::string& fname,
+                    const std::vector<anchorPair>& loops, int32_t window, const std::string& unit, int32_t binsize);
+
+// the (normalized) coverage of every chromosome, by name: the sum of each row of the genome-wide matrix, intra and inter
+// contacts alike. each block of the file is read once, in parallel, into per-thread partial sums.
+std::map<std::string, std::vector<double>> getMarginals(const std::string& norm, const std::string& fname,
+                                                        const std::string& unit, int32_t binsize);
+
+// distance decay curves of the given chromosomes (all of them when empty), with binsPerDecade log-spaced distance bins
+// per factor of 10. each chromosome's blocks are streamed once in parallel into per-thread sums; no records are kept.
+std::vector<distanceDecayCurve> distanceDecay(const std::string& norm, const std::string& fname, const std::string& unit,
+                                              int32_t binsize, int32_t binsPerDecade,
+                                              const std::vector<std::string>& chromosomes = {});
+
+// insulation tracks of the given chromosomes (all of them when empty) for a window of that many bins, with the
+// boundaries at least boundaryStrength strong. chromosomes are computed in parallel, each in a single pass over the
+// blocks near its diagonal.
+std::vector<insulationTrack> insulation(const std::string& norm, const std::string& fname, const std::string& unit,
+                                        int32_t binsize, int32_t window, double boundaryStrength,
+                                        const std::vector<std::string>& chromosomes = {});
+
 int64_t getNumRecordsForFile(const std::string& filename, int32_t binsize, bool interOnly);
 
 int64_t getNumRecordsForChromosomes(const std::string& filename, int32_t binsize, bool interOnly);
 
+blockReadStats getBlockReadStats();
+
+// queries covering less than this fraction of a chromosome's normalization vector read only the entries they need
+// instead of the whole vector; 0 always reads (and caches) whole vectors. defaults to 0.1 for remote files and 0 for
+// local ones.
+void setPartialNormVectorReadFraction(double maxFraction);
+
+// directory that normalization and expected vectors straw computes for files lacking them are cached in, so they are
+// computed once and then used like stored vectors. defaults to $STRAW_CACHE_DIR, or ~/.cache/straw; empty turns the
+// on-disk cache off.
+void setComputedVectorCacheDirectory(const std::string& directory);
+
 #endif
@@ -0,0 +1,357 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include "straw_arrow.h"
+
+using namespace std;
+
+// Arrow IPC messages are flatbuffers (see Schema.fbs, Message.fbs and File.fbs in the Arrow format). this is just
+// enough of a flatbuffer builder for them: tables are written front to back, each vtable right before its table and
+// each child object (table, vector or string) after the table pointing at it, so every offset points forward.
+class FlatBuffer {
+public:
+    string data;
+
+    void align(size_t alignment) {
+        while (data.size() % alignment != 0) data.push_back(0);
+    }
+
+    template<typename T>
+    size_t put(T value) {
+        align(sizeof(T));
+        size_t at = data.size();
+        data.append((const char *) &value, sizeof(T));
+        return at;
+    }
+
+    template<typename T>
+    void patch(size_t at, T value) {
+        memcpy(&data[at], &value, sizeof(T));
+    }
+};
+
+// writes an object into the buffer and returns its position
+typedef function<size_t(FlatBuffer &)> FlatWriter;
+
+// a table field: a scalar (its bytes) or an offset to an object written by child
+struct FlatField {
+    int32_t id;
+    string scalar;
+    FlatWriter child;
+};
+
+template<typename T>
+static FlatField scalarField(int32_t id, T value) {
+    return {id, string((const char *) &value, sizeof(T)), nullptr};
+}
+
+static FlatField offsetField(int32_t id, FlatWriter child) {
+    return {id, string(), move(child)};
+}
+
+static size_t writeTable(FlatBuffer &fb, const vector<FlatField> &fields) {
+    int32_t numSlots = 0;
+    vector<uint16_t> fieldOffsets(fields.size());
+    uint16_t tableSize = 4; // the offset to the vtable comes first
+    for (size_t i = 0; i < fields.size(); i++) {
+        numSlots = max(numSlots, fields[i].id + 1);
+        uint16_t size = fields[i].child ? 4 : static_cast<uint16_t>(fields[i].scalar.size());
+        tableSize = static_cast<uint16_t>((tableSize + size - 1) / size * size);
+        fieldOffsets[i] = tableSize;
+        tableSize += size;
+    }
+    vector<uint16_t> slots(static_cast<size_t>(numSlots), 0);
+    for (size_t i = 0; i < fields.size(); i++) {
+        slots[fields[i].id] = fieldOffsets[i];
+    }
+    size_t vtable = fb.put<uint16_t>(static_cast<uint16_t>(4 + 2 * numSlots));
+    fb.put<uint16_t>(tableSize);
+    for (uint16_t slot : slots) {
+        fb.put<uint16_t>(slot);
+    }
+
+    // tables start 8-aligned, so fields aligned within the table are aligned in the buffer
+    fb.align(8);
+    size_t table = fb.data.size();
+    fb.data.resize(table + tableSize, 0);
+    fb.patch<int32_t>(table, static_cast<int32_t>(table - vtable));
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (!fields[i].child) {
+            memcpy(&fb.data[table + fieldOffsets[i]], fields[i].scalar.data(), fields[i].scalar.size());
+        }
+    }
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].child) {
+            size_t at = table + fieldOffsets[i];
+            size_t child = fields[i].child(fb);
+            fb.patch<uint32_t>(at, static_cast<uint32_t>(child - at));
+        }
+    }
+    return table;
+}
+
+static FlatWriter tableWriter(vector<FlatField> fields) {
+    return [fields](FlatBuffer &fb) { return writeTable(fb, fields); };
+}
+
+static FlatWriter tableVectorWriter(vector<FlatWriter> elements) {
+    return [elements](FlatBuffer &fb) {
+        size_t vector = fb.put<uint32_t>(static_cast<uint32_t>(elements.size()));
+        for (size_t i = 0; i < elements.size(); i++) {
+            fb.put<uint32_t>(0);
+        }
+        for (size_t i = 0; i < elements.size(); i++) {
+            size_t at = vector + 4 + 4 * i;
+            size_t element = elements[i](fb);
+            fb.patch<uint32_t>(at, static_cast<uint32_t>(element - at));
+        }
+        return vector;
+    };
+}
+
+// a vector of count 8-aligned structs, given as their bytes
+static FlatWriter structVectorWriter(string bytes, size_t count) {
+    return [bytes, count](FlatBuffer &fb) {
+        fb.align(4);
+        if (fb.data.size() % 8 == 0) fb.put<uint32_t>(0);
+        size_t vector = fb.put<uint32_t>(static_cast<uint32_t>(count));
+        fb.data += bytes;
+        return vector;
+    };
+}
+
+static FlatWriter stringWriter(string value) {
+    return [value](FlatBuffer &fb) {
+        size_t at = fb.put<uint32_t>(static_cast<uint32_t>(value.size()));
+        fb.data += value;
+        fb.data.push_back(0);
+        return at;
+    };
+}
+
+static string finishFlatBuffer(const FlatWriter &root) {
+    FlatBuffer fb;
+    fb.put<uint32_t>(0);
+    size_t table = root(fb);
+    fb.patch<uint32_t>(0, static_cast<uint32_t>(table));
+    return fb.data;
+}
+
+// values from the Arrow format's flatbuffer schemas
+static const int16_t METADATA_V5 = 4;
+static const uint8_t HEADER_SCHEMA = 1, HEADER_DICTIONARY_BATCH = 2, HEADER_RECORD_BATCH = 3;
+static const uint8_t TYPE_INT = 2, TYPE_FLOATING_POINT = 3, TYPE_UTF8 = 5;
+static const int16_t PRECISION_SINGLE = 1;
+
+static FlatWriter intType(int32_t bitWidth) {
+    return tableWriter({scalarField<int32_t>(0, bitWidth), scalarField<uint8_t>(1, 1)});
+}
+
+// a non-nullable field of the given type; with dictionaryId >= 0 the type is that of the dictionary's values, indexed
+// by int16
+static FlatWriter fieldWriter(const string &name, uint8_t typeType, FlatWriter type, int64_t dictionaryId = -1) {
+    vector<FlatField> fields = {offsetField(0, stringWriter(name)), scalarField<uint8_t>(1, 0),
+                                scalarField<uint8_t>(2, typeType), offsetField(3, move(type)),
+                                offsetField(5, tableVectorWriter({}))};
+    if (dictionaryId >= 0) {
+        fields.push_back(offsetField(4, tableWriter({scalarField<int64_t>(0, dictionaryId),
+                                                     offsetField(1, intType(16))})));
+    }
+    return tableWriter(fields);
+}
+
+static FlatWriter keyValueWriter(const string &key, const string &value) {
+    return tableWriter({offsetField(0, stringWriter(key)), offsetField(1, stringWriter(value))});
+}
+
+static FlatWriter schemaWriter(bool binPositions, int32_t resolution, const string &unit) {
+    return tableWriter({scalarField<int16_t>(0, 0), offsetField(1, tableVectorWriter({
+            fieldWriter("chr1", TYPE_UTF8, tableWriter({}), 0),
+            fieldWriter("chr2", TYPE_UTF8, tableWriter({}), 1),
+            fieldWriter(binPositions ? "bin1" : "x", TYPE_INT, intType(32)),
+            fieldWriter(binPositions ? "bin2" : "y", TYPE_INT, intType(32)),
+            fieldWriter("counts", TYPE_FLOATING_POINT, tableWriter({scalarField<int16_t>(0, PRECISION_SINGLE)}))})),
+            offsetField(2, tableVectorWriter({keyValueWriter("resolution", to_string(resolution)),
+                                              keyValueWriter("unit", unit)}))});
+}
+
+// the body of a record batch and the buffers (offset and length pairs) that make it up
+struct ArrowBody {
+    string data;
+    string buffers;
+
+    void addBuffer(const void *bytes, size_t size) {
+        int64_t offset = static_cast<int64_t>(data.size()), length = static_cast<int64_t>(size);
+        buffers.append((const char *) &offset, sizeof(int64_t));
+        buffers.append((const char *) &length, sizeof(int64_t));
+        data.append((const char *) bytes, size);
+        data.resize((data.size() + 7) / 8 * 8, 0);
+    }
+
+    size_t numBuffers() const { return buffers.size() / 16; }
+};
+
+// a RecordBatch table for length rows of numColumns columns without nulls, stored in body
+static FlatWriter recordBatchWriter(int64_t length, size_t numColumns, const ArrowBody &body) {
+    string nodes;
+    for (size_t i = 0; i < numColumns; i++) {
+        int64_t nullCount = 0;
+        nodes.append((const char *) &length, sizeof(int64_t));
+        nodes.append((const char *) &nullCount, sizeof(int64_t));
+    }
+    return tableWriter({scalarField<int64_t>(0, length), offsetField(1, structVectorWriter(nodes, numColumns)),
+                        offsetField(2, structVectorWriter(body.buffers, body.numBuffers()))});
+}
+
+static string messageMetadata(uint8_t headerType, FlatWriter header, int64_t bodyLength) {
+    return finishFlatBuffer(tableWriter({scalarField<int16_t>(0, METADATA_V5), scalarField<uint8_t>(1, headerType),
+                                         offsetField(2, move(header)), scalarField<int64_t>(3, bodyLength)}));
+}
+
+bool isArrowPath(const string &path, bool &streamFormat) {
+    auto endsWith = [&path](const string &suffix) {
+        return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    streamFormat = endsWith(".arrows");
+    return streamFormat || endsWith(".arrow") || endsWith(".feather");
+}
+
+ArrowContactWriter::ArrowContactWriter(const string &path, const vector<string> &chromosomeNames, bool binPositions,
+                                       int32_t resolution, const string &unit, bool streamFormat)
+        : streamFormat(streamFormat), binPositions(binPositions), resolution(resolution), unit(unit),
+          chromosomeNames(chromosomeNames) {
+    out = path == "-" ? stdout : fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+        return;
+    }
+    if (!streamFormat) {
+        writeBytes("ARROW1\0\0", 8);
+    }
+    writeMessage(messageMetadata(HEADER_SCHEMA, schemaWriter(binPositions, resolution, unit), 0), string());
+
+    // both chromosome columns index the chromosome names, each through a dictionary of its own
+    ArrowBody body;
+    vector<int32_t> offsets(1, 0);
+    string names;
+    for (const string &name : chromosomeNames) {
+        names += name;
+        offsets.push_back(static_cast<int32_t>(names.size()));
+    }
+    body.addBuffer(nullptr, 0);
+    body.addBuffer(offsets.data(), offsets.size() * sizeof(int32_t));
+    body.addBuffer(names.data(), names.size());
+    auto numNames = static_cast<int64_t>(chromosomeNames.size());
+    for (int64_t id = 0; id < 2; id++) {
+        FlatWriter batch = tableWriter({scalarField<int64_t>(0, id), offsetField(1, recordBatchWriter(numNames, 1, body))});
+        string metadata = messageMetadata(HEADER_DICTIONARY_BATCH, batch, static_cast<int64_t>(body.data.size()));
+        dictionaryBlocks.push_back(writeMessage(metadata, body.data));
+    }
+}
+
+ArrowContactWriter::~ArrowContactWriter() {
+    close();
+}
+
+void ArrowContactWriter::writeBytes(const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, out) != size) {
+        cerr << "Error writing Arrow output" << endl;
+    }
+    position += static_cast<int64_t>(size);
+}
+
+// an encapsulated message: continuation marker, metadata length, the metadata padded to 8 bytes, then the body
+ArrowContactWriter::MessageBlock ArrowContactWriter::writeMessage(const string &metadata, const string &body) {
+    MessageBlock block{position, 0, static_cast<int64_t>(body.size())};
+    string padded = metadata;
+    padded.resize((padded.size() + 7) / 8 * 8, 0);
+    uint32_t continuation = 0xFFFFFFFF;
+    auto length = static_cast<int32_t>(padded.size());
+    writeBytes(&continuation, sizeof(uint32_t));
+    writeBytes(&length, sizeof(int32_t));
+    writeBytes(padded.data(), padded.size());
+    writeBytes(body.data(), body.size());
+    block.metadataLength = 8 + length;
+    return block;
+}
+
+void ArrowContactWriter::writeBatch(int16_t chr1, int16_t chr2, const vector<int32_t> &binX,
+                                    const vector<int32_t> &binY, const vector<float> &counts) {
+    if (out == nullptr || counts.empty()) {
+        return;
+    }
+    size_t n = counts.size();
+    ArrowBody body;
+    vector<int16_t> keys(n, chr1);
+    body.addBuffer(nullptr, 0);
+    body.addBuffer(keys.data(), n * sizeof(int16_t));
+    keys.assign(n, chr2);
+    body.addBuffer(nullptr, 0);
+    body.addBuffer(keys.data(), n * sizeof(int16_t));
+    body.addBuffer(nullptr, 0);
+    body.addBuffer(binX.data(), n * sizeof(int32_t));
+    body.addBuffer(nullptr, 0);
+    body.addBuffer(binY.data(), n * sizeof(int32_t));
+    body.addBuffer(nullptr, 0);
+    body.addBuffer(counts.data(), n * sizeof(float));
+    string metadata = messageMetadata(HEADER_RECORD_BATCH, recordBatchWriter(static_cast<int64_t>(n), 5, body),
+                                      static_cast<int64_t>(body.data.size()));
+    recordBatchBlocks.push_back(writeMessage(metadata, body.data));
+}
+
+void ArrowContactWriter::close() {
+    if (out == nullptr) {
+        return;
+    }
+    uint32_t endOfStream[2] = {0xFFFFFFFF, 0};
+    writeBytes(endOfStream, sizeof(endOfStream));
+    if (!streamFormat) {
+        auto blocks = [](const vector<MessageBlock> &messages) {
+            string bytes;
+            for (const MessageBlock &block : messages) {
+                int32_t padding = 0;
+                bytes.append((const char *) &block.offset, sizeof(int64_t));
+                bytes.append((const char *) &block.metadataLength, sizeof(int32_t));
+                bytes.append((const char *) &padding, sizeof(int32_t));
+                bytes.append((const char *) &block.bodyLength, sizeof(int64_t));
+            }
+            return structVectorWriter(bytes, messages.size());
+        };
+        string footer = finishFlatBuffer(tableWriter({scalarField<int16_t>(0, METADATA_V5),
+                                                      offsetField(1, schemaWriter(binPositions, resolution, unit)),
+                                                      offsetField(2, blocks(dictionaryBlocks)),
+                                                      offsetField(3, blocks(recordBatchBlocks))}));
+        auto footerLength = static_cast<int32_t>(footer.size());
+        writeBytes(footer.data(), footer.size());
+        writeBytes(&footerLength, sizeof(int32_t));
+        writeBytes("ARROW1", 6);
+    }
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+    out = nullptr;
+}
@@ -0,0 +1,83 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#ifndef STRAW_ARROW_H
+#define STRAW_ARROW_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// writes contact records in the Arrow IPC format: an Arrow file (as Feather v2 is), which readers can memory-map,
+// or with streamFormat an Arrow stream, which can also go to standard output (path "-"). the columns are chr1 and
+// chr2 (strings, dictionary-encoded over the chromosome names), the two positions (int32) and counts (float32); every
+// writeBatch adds one record batch. with binPositions the positions are bin numbers, in columns bin1 and bin2 (as
+// slice files hold them), otherwise genomic positions, in columns x and y (as straw returns them). the schema's
+// metadata records the resolution and unit either way.
+class ArrowContactWriter {
+public:
+    ArrowContactWriter(const std::string& path, const std::vector<std::string>& chromosomeNames, bool binPositions,
+                       int32_t resolution, const std::string& unit, bool streamFormat = false);
+    ~ArrowContactWriter();
+
+    bool isOpen() const { return out != nullptr; }
+
+    // one record batch of contacts between the chromosomes at chr1 and chr2 in chromosomeNames
+    void writeBatch(int16_t chr1, int16_t chr2, const std::vector<int32_t>& binX, const std::vector<int32_t>& binY,
+                    const std::vector<float>& counts);
+    // ends the stream, and for files writes the footer
+    void close();
+
+private:
+    // where a message starts in the file and how long its metadata and body are, for the footer
+    struct MessageBlock {
+        int64_t offset;
+        int32_t metadataLength;
+        int64_t bodyLength;
+    };
+
+    FILE* out;
+    bool streamFormat;
+    bool binPositions;
+    int32_t resolution;
+    std::string unit;
+    int64_t position = 0;
+    std::vector<std::string> chromosomeNames;
+    std::vector<MessageBlock> dictionaryBlocks;
+    std::vector<MessageBlock> recordBatchBlocks;
+
+    void writeBytes(const void* data, size_t size);
+    MessageBlock writeMessage(const std::string& metadata, const std::string& body);
+};
+
+// true if the path names an Arrow file (.arrow, .feather) or, setting streamFormat, an Arrow stream (.arrows)
+bool isArrowPath(const std::string& path, bool& streamFormat);
+
+// writes the records straw(matrixType, norm, fileName, chr1loc, chr2loc, unit, binsize) returns to outputPath as Arrow, in
+// record batches of up to 65536 records. an Arrow stream for .arrows paths and "-" (standard output), otherwise a file.
+void strawToArrow(const std::string& matrixType, const std::string& norm, const std::string& fileName,
+                  const std::string& chr1loc, const std::string& chr2loc, const std::string& unit, int32_t binsize,
+                  const std::string& outputPath);
+
+#endif
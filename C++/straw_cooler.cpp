@@ -0,0 +1,301 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#include <cmath>
+#include <ctime>
+#include <iostream>
+#include "straw_cooler.h"
+
+using namespace std;
+
+#ifdef STRAW_USE_HDF5
+#include <hdf5.h>
+
+static_assert(sizeof(hid_t) == sizeof(int64_t), "HDF5 1.10 or later is needed");
+
+// elements per chunk of every dataset
+static const hsize_t COOLER_CHUNK_SIZE = 1 << 16;
+
+// a 1-D chunked, shuffled and compressed dataset holding size elements, or extendable when size is 0
+static hid_t createColumn(hid_t group, const string &name, hid_t type, hsize_t size) {
+    hsize_t dims[1] = {size}, maxDims[1] = {size > 0 ? size : H5S_UNLIMITED};
+    hsize_t chunk[1] = {size > 0 ? min(size, COOLER_CHUNK_SIZE) : COOLER_CHUNK_SIZE};
+    hid_t space = H5Screate_simple(1, dims, maxDims);
+    hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(properties, 1, chunk);
+    H5Pset_shuffle(properties);
+    H5Pset_deflate(properties, 6);
+    hid_t dataset = H5Dcreate2(group, name.c_str(), type, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+    H5Pclose(properties);
+    H5Sclose(space);
+    return dataset;
+}
+
+static void writeColumn(hid_t group, const string &name, hid_t fileType, hid_t memoryType, const void *data,
+                        size_t size) {
+    hid_t dataset = createColumn(group, name, fileType, size);
+    if (size > 0) {
+        H5Dwrite(dataset, memoryType, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+    }
+    H5Dclose(dataset);
+}
+
+// appends size elements to an extendable column holding oldSize
+static void appendColumn(hid_t dataset, hid_t memoryType, const void *data, hsize_t oldSize, hsize_t size) {
+    if (size == 0) return;
+    hsize_t newSize[1] = {oldSize + size}, start[1] = {oldSize}, count[1] = {size};
+    H5Dset_extent(dataset, newSize);
+    hid_t fileSpace = H5Dget_space(dataset);
+    H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, start, nullptr, count, nullptr);
+    hid_t memorySpace = H5Screate_simple(1, count, nullptr);
+    H5Dwrite(dataset, memoryType, memorySpace, fileSpace, H5P_DEFAULT, data);
+    H5Sclose(memorySpace);
+    H5Sclose(fileSpace);
+}
+
+static void writeAttribute(hid_t object, const string &name, const string &value) {
+    hid_t type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, H5T_VARIABLE);
+    H5Tset_cset(type, H5T_CSET_UTF8);
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attribute = H5Acreate2(object, name.c_str(), type, space, H5P_DEFAULT, H5P_DEFAULT);
+    const char *data = value.c_str();
+    H5Awrite(attribute, type, &data);
+    H5Aclose(attribute);
+    H5Sclose(space);
+    H5Tclose(type);
+}
+
+static void writeAttribute(hid_t object, const string &name, int64_t value) {
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attribute = H5Acreate2(object, name.c_str(), H5T_STD_I64LE, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attribute, H5T_NATIVE_INT64, &value);
+    H5Aclose(attribute);
+    H5Sclose(space);
+}
+
+static hid_t createGroup(hid_t parent, const string &name) {
+    return H5Gcreate2(parent, name.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+}
+
+CoolerWriter::CoolerWriter(const string &path, bool multiResolution) : multiResolution(multiResolution) {
+    file = H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file < 0) {
+        return;
+    }
+    if (multiResolution) {
+        writeAttribute(file, "format", "HDF5::MCOOL");
+        writeAttribute(file, "format-version", 2);
+        H5Gclose(createGroup(file, "resolutions"));
+    }
+}
+
+bool CoolerWriter::beginResolution(int32_t binSize, const vector<string> &chromNames,
+                                   const vector<int64_t> &chromLengths, const string &assembly,
+                                   const vector<string> &weightNames, const vector<vector<double>> &weights) {
+    if (file < 0) {
+        return false;
+    }
+    resolution = binSize;
+    group = multiResolution ? createGroup(file, "resolutions/" + to_string(binSize)) : H5Gopen2(file, "/", H5P_DEFAULT);
+    if (group < 0) {
+        cerr << "Resolution " << binSize << " is written twice" << endl;
+        return false;
+    }
+    writeAttribute(group, "assembly", assembly);
+
+    // chroms: names as fixed length strings, lengths as int32
+    size_t maxNameLength = 1;
+    for (const string &name : chromNames) {
+        maxNameLength = max(maxNameLength, name.size());
+    }
+    string names(maxNameLength * chromNames.size(), '\0');
+    vector<int32_t> lengths;
+    for (size_t i = 0; i < chromNames.size(); i++) {
+        names.replace(i * maxNameLength, chromNames[i].size(), chromNames[i]);
+        lengths.push_back(static_cast<int32_t>(chromLengths[i]));
+    }
+    hid_t nameType = H5Tcopy(H5T_C_S1);
+    H5Tset_size(nameType, maxNameLength);
+    H5Tset_strpad(nameType, H5T_STR_NULLPAD);
+    hid_t chroms = createGroup(group, "chroms");
+    writeColumn(chroms, "name", nameType, nameType, names.data(), chromNames.size());
+    writeColumn(chroms, "length", H5T_STD_I32LE, H5T_NATIVE_INT32, lengths.data(), lengths.size());
+    H5Gclose(chroms);
+    H5Tclose(nameType);
+
+    // bins: the chromosome (an enum over the names), start and end of every fixed size bin, then the weights
+    chromOffsets.assign(1, 0);
+    vector<int32_t> binChroms, starts, ends;
+    for (size_t i = 0; i < chromLengths.size(); i++) {
+        for (int64_t start = 0; start < chromLengths[i]; start += binSize) {
+            binChroms.push_back(static_cast<int32_t>(i));
+            starts.push_back(static_cast<int32_t>(start));
+            ends.push_back(static_cast<int32_t>(min(start + binSize, chromLengths[i])));
+        }
+        chromOffsets.push_back(static_cast<int64_t>(starts.size()));
+    }
+    hid_t chromType = H5Tenum_create(H5T_STD_I32LE);
+    for (int32_t i = 0; i < static_cast<int32_t>(chromNames.size()); i++) {
+        H5Tenum_insert(chromType, chromNames[i].c_str(), &i);
+    }
+    hid_t bins = createGroup(group, "bins");
+    writeColumn(bins, "chrom", chromType, chromType, binChroms.data(), binChroms.size());
+    writeColumn(bins, "start", H5T_STD_I32LE, H5T_NATIVE_INT32, starts.data(), starts.size());
+    writeColumn(bins, "end", H5T_STD_I32LE, H5T_NATIVE_INT32, ends.data(), ends.size());
+    for (size_t w = 0; w < weightNames.size(); w++) {
+        vector<double> column(weights[w]);
+        column.resize(starts.size(), NAN);
+        writeColumn(bins, weightNames[w], H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, column.data(), column.size());
+    }
+    H5Gclose(bins);
+    H5Tclose(chromType);
+
+    hid_t pixels = createGroup(group, "pixels");
+    bin1Dataset = createColumn(pixels, "bin1_id", H5T_STD_I64LE, 0);
+    bin2Dataset = createColumn(pixels, "bin2_id", H5T_STD_I64LE, 0);
+    countDataset = createColumn(pixels, "count", H5T_STD_I32LE, 0);
+    H5Gclose(pixels);
+    floatCounts = false;
+    nnz = 0;
+    bin1Counts.assign(starts.size(), 0);
+    return true;
+}
+
+void CoolerWriter::writePixels(const vector<int64_t> &bin1, const vector<int64_t> &bin2, const vector<double> &counts) {
+    if (group < 0 || counts.empty()) {
+        return;
+    }
+    if (!floatCounts) {
+        for (double count : counts) {
+            if (count != floor(count) || count > INT32_MAX) {
+                floatCounts = true;
+                break;
+            }
+        }
+        if (floatCounts) {
+            // the int32 counts so far are copied over to a float64 column that replaces them
+            hid_t pixels = H5Gopen2(group, "pixels", H5P_DEFAULT);
+            hid_t doubles = createColumn(pixels, "count_float64", H5T_IEEE_F64LE, 0);
+            vector<double> buffer;
+            for (hsize_t start = 0; start < static_cast<hsize_t>(nnz); start += COOLER_CHUNK_SIZE) {
+                hsize_t offset[1] = {start}, count[1] = {min(COOLER_CHUNK_SIZE, static_cast<hsize_t>(nnz) - start)};
+                buffer.resize(count[0]);
+                hid_t fileSpace = H5Dget_space(countDataset);
+                H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, offset, nullptr, count, nullptr);
+                hid_t memorySpace = H5Screate_simple(1, count, nullptr);
+                H5Dread(countDataset, H5T_NATIVE_DOUBLE, memorySpace, fileSpace, H5P_DEFAULT, buffer.data());
+                H5Sclose(memorySpace);
+                H5Sclose(fileSpace);
+                appendColumn(doubles, H5T_NATIVE_DOUBLE, buffer.data(), start, count[0]);
+            }
+            H5Dclose(countDataset);
+            H5Ldelete(pixels, "count", H5P_DEFAULT);
+            H5Lmove(pixels, "count_float64", pixels, "count", H5P_DEFAULT, H5P_DEFAULT);
+            countDataset = doubles;
+            H5Gclose(pixels);
+        }
+    }
+    auto oldSize = static_cast<hsize_t>(nnz);
+    appendColumn(bin1Dataset, H5T_NATIVE_INT64, bin1.data(), oldSize, bin1.size());
+    appendColumn(bin2Dataset, H5T_NATIVE_INT64, bin2.data(), oldSize, bin2.size());
+    if (floatCounts) {
+        appendColumn(countDataset, H5T_NATIVE_DOUBLE, counts.data(), oldSize, counts.size());
+    } else {
+        vector<int32_t> whole(counts.begin(), counts.end());
+        appendColumn(countDataset, H5T_NATIVE_INT32, whole.data(), oldSize, whole.size());
+    }
+    for (int64_t bin : bin1) {
+        bin1Counts[bin]++;
+    }
+    nnz += static_cast<int64_t>(counts.size());
+}
+
+void CoolerWriter::endResolution() {
+    if (group < 0) {
+        return;
+    }
+    H5Dclose(bin1Dataset);
+    H5Dclose(bin2Dataset);
+    H5Dclose(countDataset);
+
+    // indexes: the first bin of each chromosome and the first pixel of each bin1, each followed by the total
+    vector<int64_t> bin1Offsets(1, 0);
+    for (int64_t count : bin1Counts) {
+        bin1Offsets.push_back(bin1Offsets.back() + count);
+    }
+    hid_t indexes = createGroup(group, "indexes");
+    writeColumn(indexes, "chrom_offset", H5T_STD_I64LE, H5T_NATIVE_INT64, chromOffsets.data(), chromOffsets.size());
+    writeColumn(indexes, "bin1_offset", H5T_STD_I64LE, H5T_NATIVE_INT64, bin1Offsets.data(), bin1Offsets.size());
+    H5Gclose(indexes);
+
+    char date[32];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+    writeAttribute(group, "format", "HDF5::Cooler");
+    writeAttribute(group, "format-version", 3);
+    writeAttribute(group, "format-url", "https://github.com/open2c/cooler");
+    writeAttribute(group, "generated-by", "straw");
+    writeAttribute(group, "creation-date", date);
+    writeAttribute(group, "bin-type", "fixed");
+    writeAttribute(group, "bin-size", resolution);
+    writeAttribute(group, "storage-mode", "symmetric-upper");
+    writeAttribute(group, "nbins", static_cast<int64_t>(bin1Counts.size()));
+    writeAttribute(group, "nchroms", static_cast<int64_t>(chromOffsets.size() - 1));
+    writeAttribute(group, "nnz", nnz);
+    writeAttribute(group, "metadata", "{}");
+    H5Gclose(group);
+    group = -1;
+}
+
+void CoolerWriter::close() {
+    if (file < 0) {
+        return;
+    }
+    endResolution();
+    H5Fclose(file);
+    file = -1;
+}
+
+#else
+
+CoolerWriter::CoolerWriter(const string &path, bool multiResolution) : multiResolution(multiResolution) {
+    cerr << "Writing " << path << " needs straw built with HDF5" << endl;
+}
+
+bool CoolerWriter::beginResolution(int32_t, const vector<string> &, const vector<int64_t> &, const string &,
+                                   const vector<string> &, const vector<vector<double>> &) {
+    return false;
+}
+
+void CoolerWriter::writePixels(const vector<int64_t> &, const vector<int64_t> &, const vector<double> &) {}
+
+void CoolerWriter::endResolution() {}
+
+void CoolerWriter::close() {}
+
+#endif
+
+CoolerWriter::~CoolerWriter() {
+    close();
+}
@@ -0,0 +1,76 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#ifndef STRAW_COOLER_H
+#define STRAW_COOLER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// writes cooler files (https://github.com/open2c/cooler, format version 3): a single resolution .cool file, or with
+// multiResolution an .mcool file holding one cooler per resolution under /resolutions/<binsize>. tables are chunked,
+// shuffled and gzip-compressed HDF5 datasets. needs straw built with HDF5 (STRAW_USE_HDF5); otherwise isOpen() is
+// always false.
+class CoolerWriter {
+public:
+    CoolerWriter(const std::string& path, bool multiResolution);
+    ~CoolerWriter();
+
+    bool isOpen() const { return file >= 0; }
+
+    // starts the cooler of one resolution and writes its chroms and bins tables, the bins with a column of weights
+    // for each of weightNames (NaN for bins without one)
+    bool beginResolution(int32_t resolution, const std::vector<std::string>& chromNames,
+                         const std::vector<int64_t>& chromLengths, const std::string& assembly,
+                         const std::vector<std::string>& weightNames,
+                         const std::vector<std::vector<double>>& weights);
+    // appends pixels, which must continue the cooler's order: by bin1, then bin2, with bin1 <= bin2. counts are
+    // stored as int32 while they are all whole numbers, and as float64 from the first one that isn't
+    void writePixels(const std::vector<int64_t>& bin1, const std::vector<int64_t>& bin2,
+                     const std::vector<double>& counts);
+    // writes the indexes and attributes of the current cooler
+    void endResolution();
+    void close();
+
+private:
+    int64_t file = -1;
+    bool multiResolution;
+    int64_t group = -1;
+    int64_t bin1Dataset = -1, bin2Dataset = -1, countDataset = -1;
+    bool floatCounts = false;
+    int64_t nnz = 0;
+    int32_t resolution = 0;
+    std::vector<int64_t> chromOffsets;
+    std::vector<int64_t> bin1Counts;
+};
+
+// converts the observed counts of a .hic file at the given BP resolutions (all of them when empty) to a cooler, in an
+// .mcool file when there are several resolutions or outputPath ends in .mcool. the bins table holds the inverse of each
+// normalization in norms (those the file stores when empty) as a weight column of that name, and the first one again
+// as "weight". pixels are sorted within sortMemory bytes, spilling sorted runs to files next to outputPath beyond it.
+void convertToCooler(const std::string& fileName, const std::string& outputPath,
+                     const std::vector<int32_t>& resolutions, const std::vector<std::string>& norms,
+                     int64_t sortMemory = 1LL << 30);
+
+#endif
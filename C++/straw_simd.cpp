@@ -0,0 +1,435 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include "straw_simd.h"
+
+// the vector kernels are compiled per function with target attributes and chosen at runtime, so the rest of the
+// build needs no special flags. other compilers and architectures only get the scalar kernels.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define STRAW_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define STRAW_X86_DISPATCH 0
+#endif
+
+using namespace std;
+
+static_assert(sizeof(contactRecord) == 3 * sizeof(int32_t), "kernels read contactRecord as three 32-bit fields");
+
+static SimdLevel detectSimdLevel() {
+#if STRAW_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return SimdLevel::SSE4;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+static SimdLevel supportedSimdLevel() {
+    static const SimdLevel supported = detectSimdLevel();
+    return supported;
+}
+
+static atomic<int> selectedSimdLevel{-1};
+
+SimdLevel getSimdLevel() {
+    int level = selectedSimdLevel;
+    if (level < 0) {
+        return supportedSimdLevel();
+    }
+    return static_cast<SimdLevel>(level);
+}
+
+void setSimdLevel(SimdLevel level) {
+    if (static_cast<int>(level) > static_cast<int>(supportedSimdLevel())) {
+        level = supportedSimdLevel();
+    }
+    selectedSimdLevel = static_cast<int>(level);
+}
+
+static inline int32_t clampIndex(int32_t index, int32_t size) {
+    return index < 0 ? 0 : (index >= size ? size - 1 : index);
+}
+
+// the reference kernel; the vector kernels multiply in the same order so all levels give identical results
+static void scaleScalar(contactRecord *records, size_t begin, size_t n, const scaleTables &t) {
+    for (size_t i = begin; i < n; i++) {
+        int32_t x = records[i].binX;
+        int32_t y = records[i].binY;
+        double f = t.rowFactors[clampIndex(x - t.rowOffset, t.rowSize)] *
+                   t.colFactors[clampIndex(y - t.colOffset, t.colSize)];
+        f *= t.distanceFactors[clampIndex(abs(y - x) - t.distanceOffset, t.distanceSize)];
+        f *= t.constant;
+        double c = t.replaceCounts ? 1.0 : (double) records[i].counts;
+        records[i].counts = static_cast<float>(c * f);
+    }
+}
+
+#if STRAW_X86_DISPATCH
+
+// 4 records at a time; indices are clamped in SSE registers and the table lookups stay scalar
+__attribute__((target("sse4.1")))
+static size_t scaleSSE4(contactRecord *records, size_t n, const scaleTables &t) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rowOffset = _mm_set1_epi32(t.rowOffset), rowMax = _mm_set1_epi32(t.rowSize - 1);
+    const __m128i colOffset = _mm_set1_epi32(t.colOffset), colMax = _mm_set1_epi32(t.colSize - 1);
+    const __m128i distanceOffset = _mm_set1_epi32(t.distanceOffset), distanceMax = _mm_set1_epi32(t.distanceSize - 1);
+    const __m128d constant = _mm_set1_pd(t.constant);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        contactRecord *r = records + i;
+        __m128i x = _mm_setr_epi32(r[0].binX, r[1].binX, r[2].binX, r[3].binX);
+        __m128i y = _mm_setr_epi32(r[0].binY, r[1].binY, r[2].binY, r[3].binY);
+        __m128i ri = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(x, rowOffset), zero), rowMax);
+        __m128i ci = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(y, colOffset), zero), colMax);
+        __m128i di = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(_mm_abs_epi32(_mm_sub_epi32(y, x)), distanceOffset),
+                                                 zero), distanceMax);
+        alignas(16) int32_t rows[4], cols[4], distances[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(rows), ri);
+        _mm_store_si128(reinterpret_cast<__m128i *>(cols), ci);
+        _mm_store_si128(reinterpret_cast<__m128i *>(distances), di);
+        for (int32_t half = 0; half < 4; half += 2) {
+            __m128d f = _mm_mul_pd(_mm_setr_pd(t.rowFactors[rows[half]], t.rowFactors[rows[half + 1]]),
+                                   _mm_setr_pd(t.colFactors[cols[half]], t.colFactors[cols[half + 1]]));
+            f = _mm_mul_pd(f, _mm_setr_pd(t.distanceFactors[distances[half]],
+                                          t.distanceFactors[distances[half + 1]]));
+            f = _mm_mul_pd(f, constant);
+            __m128d c = t.replaceCounts ? _mm_set1_pd(1.0)
+                                        : _mm_setr_pd(r[half].counts, r[half + 1].counts);
+            alignas(16) double out[2];
+            _mm_store_pd(out, _mm_mul_pd(c, f));
+            r[half].counts = static_cast<float>(out[0]);
+            r[half + 1].counts = static_cast<float>(out[1]);
+        }
+    }
+    return i;
+}
+
+// 4 records at a time with the fields and table entries gathered
+__attribute__((target("avx2")))
+static size_t scaleAVX2(contactRecord *records, size_t n, const scaleTables &t) {
+    const __m128i xFields = _mm_setr_epi32(0, 3, 6, 9);
+    const __m128i yFields = _mm_setr_epi32(1, 4, 7, 10);
+    const __m128i countFields = _mm_setr_epi32(2, 5, 8, 11);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rowOffset = _mm_set1_epi32(t.rowOffset), rowMax = _mm_set1_epi32(t.rowSize - 1);
+    const __m128i colOffset = _mm_set1_epi32(t.colOffset), colMax = _mm_set1_epi32(t.colSize - 1);
+    const __m128i distanceOffset = _mm_set1_epi32(t.distanceOffset), distanceMax = _mm_set1_epi32(t.distanceSize - 1);
+    const __m256d constant = _mm256_set1_pd(t.constant);
+    const __m256d ones = _mm256_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto *fields = reinterpret_cast<int *>(records + i);
+        __m128i x = _mm_i32gather_epi32(fields, xFields, 4);
+        __m128i y = _mm_i32gather_epi32(fields, yFields, 4);
+        __m128i ri = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(x, rowOffset), zero), rowMax);
+        __m128i ci = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(y, colOffset), zero), colMax);
+        __m128i di = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(_mm_abs_epi32(_mm_sub_epi32(y, x)), distanceOffset),
+                                                 zero), distanceMax);
+        __m256d f = _mm256_mul_pd(_mm256_i32gather_pd(t.rowFactors, ri, 8),
+                                  _mm256_i32gather_pd(t.colFactors, ci, 8));
+        f = _mm256_mul_pd(f, _mm256_i32gather_pd(t.distanceFactors, di, 8));
+        f = _mm256_mul_pd(f, constant);
+        __m256d c = t.replaceCounts ? ones
+                                    : _mm256_cvtps_pd(_mm_i32gather_ps(reinterpret_cast<float *>(fields),
+                                                                       countFields, 4));
+        alignas(16) float out[4];
+        _mm_store_ps(out, _mm256_cvtpd_ps(_mm256_mul_pd(c, f)));
+        for (int32_t k = 0; k < 4; k++) {
+            records[i + k].counts = out[k];
+        }
+    }
+    return i;
+}
+
+// 8 records at a time; counts are scattered straight back into the records
+__attribute__((target("avx512f")))
+static size_t scaleAVX512(contactRecord *records, size_t n, const scaleTables &t) {
+    const __m256i xFields = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256i yFields = _mm256_setr_epi32(1, 4, 7, 10, 13, 16, 19, 22);
+    const __m512i countFields = _mm512_castsi256_si512(_mm256_setr_epi32(2, 5, 8, 11, 14, 17, 20, 23));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rowOffset = _mm256_set1_epi32(t.rowOffset), rowMax = _mm256_set1_epi32(t.rowSize - 1);
+    const __m256i colOffset = _mm256_set1_epi32(t.colOffset), colMax = _mm256_set1_epi32(t.colSize - 1);
+    const __m256i distanceOffset = _mm256_set1_epi32(t.distanceOffset);
+    const __m256i distanceMax = _mm256_set1_epi32(t.distanceSize - 1);
+    const __m512d constant = _mm512_set1_pd(t.constant);
+    const __m512d ones = _mm512_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto *fields = reinterpret_cast<int *>(records + i);
+        __m256i x = _mm256_i32gather_epi32(fields, xFields, 4);
+        __m256i y = _mm256_i32gather_epi32(fields, yFields, 4);
+        __m256i ri = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(x, rowOffset), zero), rowMax);
+        __m256i ci = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(y, colOffset), zero), colMax);
+        __m256i di = _mm256_min_epi32(_mm256_max_epi32(
+                _mm256_sub_epi32(_mm256_abs_epi32(_mm256_sub_epi32(y, x)), distanceOffset), zero), distanceMax);
+        __m512d f = _mm512_mul_pd(_mm512_i32gather_pd(ri, t.rowFactors, 8),
+                                  _mm512_i32gather_pd(ci, t.colFactors, 8));
+        f = _mm512_mul_pd(f, _mm512_i32gather_pd(di, t.distanceFactors, 8));
+        f = _mm512_mul_pd(f, constant);
+        __m512d c = ones;
+        if (!t.replaceCounts) {
+            c = _mm512_cvtps_pd(_mm512_castps512_ps256(
+                    _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0x00FF, countFields, fields, 4)));
+        }
+        __m256 out = _mm512_cvtpd_ps(_mm512_mul_pd(c, f));
+        _mm512_mask_i32scatter_ps(fields, 0x00FF, countFields, _mm512_castps256_ps512(out), 4);
+    }
+    return i;
+}
+
+#endif
+
+void scaleContactRecords(contactRecord *records, size_t n, const scaleTables &tables) {
+    size_t done = 0;
+#if STRAW_X86_DISPATCH
+    switch (getSimdLevel()) {
+        case SimdLevel::AVX512:
+            done = scaleAVX512(records, n, tables);
+            break;
+        case SimdLevel::AVX2:
+            done = scaleAVX2(records, n, tables);
+            break;
+        case SimdLevel::SSE4:
+            done = scaleSSE4(records, n, tables);
+            break;
+        default:
+            break;
+    }
+#endif
+    scaleScalar(records, done, n, tables);
+}
+
+// the cells [first, count) of one dense row; empty cells are skipped, without the per-cell division of the old loop
+static void decodeDenseCellsScalar(const char *cells, int32_t first, int32_t count, bool useShort,
+                                   int32_t binX, int32_t binY, contactRecord *records, size_t &written) {
+    for (int32_t c = first; c < count; c++) {
+        float value;
+        if (useShort) {
+            int16_t cell;
+            memcpy(&cell, cells + c * sizeof(int16_t), sizeof(int16_t));
+            if (cell == -32768) continue;
+            value = cell;
+        } else {
+            memcpy(&value, cells + c * sizeof(float), sizeof(float));
+            if (std::isnan(value)) continue;
+        }
+        contactRecord &record = records[written++];
+        record.binX = binX + c;
+        record.binY = binY;
+        record.counts = value;
+    }
+}
+
+#if STRAW_X86_DISPATCH
+
+// lane permutations that move the kept lanes of an 8-lane (AVX2) or 4-lane (SSE) mask to the front
+struct CompressTables {
+    alignas(32) int32_t lanes8[256][8];
+    alignas(16) int8_t bytes4[16][16];
+
+    CompressTables() {
+        for (int32_t mask = 0; mask < 256; mask++) {
+            int32_t k = 0;
+            for (int32_t lane = 0; lane < 8; lane++) {
+                if (mask & (1 << lane)) lanes8[mask][k++] = lane;
+            }
+            while (k < 8) lanes8[mask][k++] = 0;
+        }
+        for (int32_t mask = 0; mask < 16; mask++) {
+            int32_t k = 0;
+            for (int32_t lane = 0; lane < 4; lane++) {
+                if (mask & (1 << lane)) {
+                    for (int32_t b = 0; b < 4; b++) bytes4[mask][4 * k + b] = static_cast<int8_t>(4 * lane + b);
+                    k++;
+                }
+            }
+            for (int32_t b = 4 * k; b < 16; b++) bytes4[mask][b] = -128;
+        }
+    }
+};
+
+static const CompressTables &getCompressTables() {
+    static const CompressTables tables;
+    return tables;
+}
+
+// each of these decodes whole vectors of cells at the start of a row and returns how many cells it consumed
+
+__attribute__((target("sse4.1")))
+static int32_t decodeDenseRowSSE4(const char *cells, int32_t count, bool useShort, int32_t binX, int32_t binY,
+                                  contactRecord *records, size_t &written, const CompressTables &compress) {
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i sentinel = _mm_set1_epi32(-32768);
+    int32_t c = 0;
+    for (; c + 4 <= count; c += 4) {
+        __m128 values;
+        int32_t keep;
+        if (useShort) {
+            __m128i v = _mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(cells + c * 2)));
+            keep = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, sentinel))) & 0xF;
+            values = _mm_cvtepi32_ps(v);
+        } else {
+            values = _mm_loadu_ps(reinterpret_cast<const float *>(cells + c * 4));
+            keep = _mm_movemask_ps(_mm_cmpord_ps(values, values));
+        }
+        if (keep == 0) continue;
+        __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i *>(compress.bytes4[keep]));
+        alignas(16) int32_t xs[4];
+        alignas(16) float vs[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(xs),
+                        _mm_shuffle_epi8(_mm_add_epi32(lanes, _mm_set1_epi32(binX + c)), shuffle));
+        _mm_store_ps(vs, _mm_castsi128_ps(_mm_shuffle_epi8(_mm_castps_si128(values), shuffle)));
+        int32_t kept = __builtin_popcount(keep);
+        for (int32_t k = 0; k < kept; k++) {
+            contactRecord &record = records[written + k];
+            record.binX = xs[k];
+            record.binY = binY;
+            record.counts = vs[k];
+        }
+        written += kept;
+    }
+    return c;
+}
+
+__attribute__((target("avx2")))
+static int32_t decodeDenseRowAVX2(const char *cells, int32_t count, bool useShort, int32_t binX, int32_t binY,
+                                  contactRecord *records, size_t &written, const CompressTables &compress) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i sentinel = _mm256_set1_epi32(-32768);
+    int32_t c = 0;
+    for (; c + 8 <= count; c += 8) {
+        __m256 values;
+        int32_t keep;
+        if (useShort) {
+            __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(cells + c * 2)));
+            keep = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, sentinel))) & 0xFF;
+            values = _mm256_cvtepi32_ps(v);
+        } else {
+            values = _mm256_loadu_ps(reinterpret_cast<const float *>(cells + c * 4));
+            keep = _mm256_movemask_ps(_mm256_cmp_ps(values, values, _CMP_ORD_Q));
+        }
+        if (keep == 0) continue;
+        __m256i permutation = _mm256_load_si256(reinterpret_cast<const __m256i *>(compress.lanes8[keep]));
+        alignas(32) int32_t xs[8];
+        alignas(32) float vs[8];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(xs),
+                           _mm256_permutevar8x32_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(binX + c)),
+                                                       permutation));
+        _mm256_store_ps(vs, _mm256_permutevar8x32_ps(values, permutation));
+        int32_t kept = __builtin_popcount(keep);
+        for (int32_t k = 0; k < kept; k++) {
+            contactRecord &record = records[written + k];
+            record.binX = xs[k];
+            record.binY = binY;
+            record.counts = vs[k];
+        }
+        written += kept;
+    }
+    return c;
+}
+
+// compresses the kept lanes with the AVX-512 compress instructions and scatters them straight into the records
+__attribute__((target("avx512f")))
+static int32_t decodeDenseRowAVX512(const char *cells, int32_t count, bool useShort, int32_t binX, int32_t binY,
+                                    contactRecord *records, size_t &written) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i fields = _mm512_mullo_epi32(lanes, _mm512_set1_epi32(3));
+    const __m512i sentinel = _mm512_set1_epi32(-32768);
+    const __m512i ys = _mm512_set1_epi32(binY);
+    int32_t c = 0;
+    for (; c + 16 <= count; c += 16) {
+        __m512 values;
+        __mmask16 keep;
+        if (useShort) {
+            __m512i v = _mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(cells + c * 2)));
+            keep = _mm512_cmpneq_epi32_mask(v, sentinel);
+            values = _mm512_cvtepi32_ps(v);
+        } else {
+            values = _mm512_loadu_ps(cells + c * 4);
+            keep = _mm512_cmp_ps_mask(values, values, _CMP_ORD_Q);
+        }
+        if (keep == 0) continue;
+        __m512i xs = _mm512_maskz_compress_epi32(keep, _mm512_add_epi32(lanes, _mm512_set1_epi32(binX + c)));
+        __m512 vs = _mm512_maskz_compress_ps(keep, values);
+        int32_t kept = __builtin_popcount(keep);
+        auto front = static_cast<__mmask16>((1u << kept) - 1);
+        auto *out = reinterpret_cast<int *>(records + written);
+        _mm512_mask_i32scatter_epi32(out, front, fields, xs, 4);
+        _mm512_mask_i32scatter_epi32(out + 1, front, fields, ys, 4);
+        _mm512_mask_i32scatter_ps(out + 2, front, fields, vs, 4);
+        written += kept;
+    }
+    return c;
+}
+
+#endif
+
+size_t decodeDenseBlock(const char *cells, int32_t nPts, int32_t w, bool useShort,
+                        int32_t binXOffset, int32_t binYOffset, contactRecord *records) {
+    if (w <= 0) {
+        return 0;
+    }
+#if STRAW_X86_DISPATCH
+    SimdLevel level = getSimdLevel();
+    const CompressTables &compress = getCompressTables();
+#endif
+    const size_t cellSize = useShort ? sizeof(int16_t) : sizeof(float);
+    size_t written = 0;
+    int32_t binY = binYOffset;
+    for (int32_t rowStart = 0; rowStart < nPts; rowStart += w, binY++) {
+        const char *row = cells + static_cast<size_t>(rowStart) * cellSize;
+        int32_t count = std::min<int32_t>(w, nPts - rowStart);
+        int32_t done = 0;
+#if STRAW_X86_DISPATCH
+        switch (level) {
+            case SimdLevel::AVX512:
+                done = decodeDenseRowAVX512(row, count, useShort, binXOffset, binY, records, written);
+                break;
+            case SimdLevel::AVX2:
+                done = decodeDenseRowAVX2(row, count, useShort, binXOffset, binY, records, written, compress);
+                break;
+            case SimdLevel::SSE4:
+                done = decodeDenseRowSSE4(row, count, useShort, binXOffset, binY, records, written, compress);
+                break;
+            default:
+                break;
+        }
+#endif
+        decodeDenseCellsScalar(row, done, count, useShort, binXOffset, binY, records, written);
+    }
+    return written;
+}
@@ -0,0 +1,71 @@
+/*
+  The MIT License (MIT)
+
+  Copyright (c) 2011-2016 Broad Institute, Aiden Lab
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+#ifndef STRAW_SIMD_H
+#define STRAW_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include "straw.h"
+
+// instruction sets the kernels below can use; the best one the CPU supports is picked at runtime
+enum class SimdLevel {
+    Scalar,
+    SSE4,
+    AVX2,
+    AVX512
+};
+
+SimdLevel getSimdLevel();
+
+// overrides the detected level (clamped to what the CPU supports), e.g. to compare kernels
+void setSimdLevel(SimdLevel level);
+
+// per-query factor tables for the normalize stage. a record (binX, binY, counts) becomes
+//   counts * rowFactors[binX - rowOffset] * colFactors[binY - colOffset] * distanceFactors[|binY - binX| - distanceOffset] * constant
+// or, with replaceCounts, the same product without the counts (used for expected values). indices are clamped to the
+// tables, so a table with a single 1.0 entry means "no factor".
+struct scaleTables {
+    const double *rowFactors;
+    int32_t rowOffset;
+    int32_t rowSize;
+    const double *colFactors;
+    int32_t colOffset;
+    int32_t colSize;
+    const double *distanceFactors;
+    int32_t distanceOffset;
+    int32_t distanceSize;
+    double constant;
+    bool replaceCounts;
+};
+
+// applies the tables to the counts of n records in place
+void scaleContactRecords(contactRecord *records, size_t n, const scaleTables &tables);
+
+// decodes the nPts cells of a dense (type 2) block, stored row by row with w cells to a row as int16 (useShort) or
+// float values. empty cells (-32768 or NaN) are skipped and the rest become (binXOffset + column, binYOffset + row,
+// value) records. records needs room for nPts entries; returns the number written.
+size_t decodeDenseBlock(const char *cells, int32_t nPts, int32_t w, bool useShort,
+                        int32_t binXOffset, int32_t binYOffset, contactRecord *records);
+
+#endif
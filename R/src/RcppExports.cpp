@@ -27,6 +27,41 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// strawRegions
+Rcpp::List strawRegions(std::string norm, std::string fname, std::vector<std::string> chr1loc, std::vector<std::string> chr2loc, const std::string& unit, int32_t binsize, std::string matrix);
+RcppExport SEXP _strawr_strawRegions(SEXP normSEXP, SEXP fnameSEXP, SEXP chr1locSEXP, SEXP chr2locSEXP, SEXP unitSEXP, SEXP binsizeSEXP, SEXP matrixSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type norm(normSEXP);
+    Rcpp::traits::input_parameter< std::string >::type fname(fnameSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type chr1loc(chr1locSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type chr2loc(chr2locSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type unit(unitSEXP);
+    Rcpp::traits::input_parameter< int32_t >::type binsize(binsizeSEXP);
+    Rcpp::traits::input_parameter< std::string >::type matrix(matrixSEXP);
+    rcpp_result_gen = Rcpp::wrap(strawRegions(norm, fname, chr1loc, chr2loc, unit, binsize, matrix));
+    return rcpp_result_gen;
+END_RCPP
+}
+// strawPileup
+Rcpp::NumericMatrix strawPileup(std::string norm, std::string fname, Rcpp::DataFrame loops, int32_t window, const std::string& unit, int32_t binsize, std::string matrix, bool average);
+RcppExport SEXP _strawr_strawPileup(SEXP normSEXP, SEXP fnameSEXP, SEXP loopsSEXP, SEXP windowSEXP, SEXP unitSEXP, SEXP binsizeSEXP, SEXP matrixSEXP, SEXP averageSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type norm(normSEXP);
+    Rcpp::traits::input_parameter< std::string >::type fname(fnameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::DataFrame >::type loops(loopsSEXP);
+    Rcpp::traits::input_parameter< int32_t >::type window(windowSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type unit(unitSEXP);
+    Rcpp::traits::input_parameter< int32_t >::type binsize(binsizeSEXP);
+    Rcpp::traits::input_parameter< std::string >::type matrix(matrixSEXP);
+    Rcpp::traits::input_parameter< bool >::type average(averageSEXP);
+    rcpp_result_gen = Rcpp::wrap(strawPileup(norm, fname, loops, window, unit, binsize, matrix, average));
+    return rcpp_result_gen;
+END_RCPP
+}
 // readHicChroms
 Rcpp::DataFrame readHicChroms(std::string fname);
 RcppExport SEXP _strawr_readHicChroms(SEXP fnameSEXP) {
@@ -60,12 +95,28 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// readHicSlice
+Rcpp::DataFrame readHicSlice(std::string fname, std::string chr1, std::string chr2);
+RcppExport SEXP _strawr_readHicSlice(SEXP fnameSEXP, SEXP chr1SEXP, SEXP chr2SEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type fname(fnameSEXP);
+    Rcpp::traits::input_parameter< std::string >::type chr1(chr1SEXP);
+    Rcpp::traits::input_parameter< std::string >::type chr2(chr2SEXP);
+    rcpp_result_gen = Rcpp::wrap(readHicSlice(fname, chr1, chr2));
+    return rcpp_result_gen;
+END_RCPP
+}
 
 static const R_CallMethodDef CallEntries[] = {
     {"_strawr_straw", (DL_FUNC) &_strawr_straw, 7},
+    {"_strawr_strawRegions", (DL_FUNC) &_strawr_strawRegions, 7},
+    {"_strawr_strawPileup", (DL_FUNC) &_strawr_strawPileup, 8},
     {"_strawr_readHicChroms", (DL_FUNC) &_strawr_readHicChroms, 1},
     {"_strawr_readHicBpResolutions", (DL_FUNC) &_strawr_readHicBpResolutions, 1},
     {"_strawr_readHicNormTypes", (DL_FUNC) &_strawr_readHicNormTypes, 1},
+    {"_strawr_readHicSlice", (DL_FUNC) &_strawr_readHicSlice, 3},
     {NULL, NULL, 0}
 };
 
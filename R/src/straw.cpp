@@ -28,11 +28,15 @@
 #include <cmath>
 #include <set>
 #include <vector>
+#include <algorithm>
 #include <streambuf>
+#include <memory>
+#include <tuple>
 #include <curl/curl.h>
 #include <Rcpp.h>
 #include "zlib.h"
 #include "straw.h"
+#include "hic_slice.h"
 using namespace std;
 
 /*
@@ -824,6 +828,42 @@ public:
     }
 };
 
+// normalization vectors of one file keyed by (chromosome, norm, unit, resolution). a HiCFile and its MatrixZoomData
+// share one cache, as do HiCFiles open on the same file at once, so each vector is read once while they are in use and
+// then handed out without copying. the file is identified by its name and master index position, so a file rewritten
+// at the same path gets a new cache, and a cache is released with the last HiCFile holding it. R calls into the
+// package from a single thread, so the cache takes no locks.
+class NormVectorCache {
+public:
+    static shared_ptr<NormVectorCache> forFile(const string &fileName, int64_t master) {
+        static map<pair<string, int64_t>, weak_ptr<NormVectorCache>> registry;
+        for (auto it = registry.begin(); it != registry.end();) {
+            it = it->second.expired() ? registry.erase(it) : next(it);
+        }
+        weak_ptr<NormVectorCache> &slot = registry[make_pair(fileName, master)];
+        shared_ptr<NormVectorCache> cache = slot.lock();
+        if (!cache) {
+            cache = make_shared<NormVectorCache>();
+            slot = cache;
+        }
+        return cache;
+    }
+
+    // the vector for this key, made by read on the first request for it
+    template<typename Read>
+    shared_ptr<const vector<double>> get(int32_t chrIdx, const string &norm, const string &unit, int32_t resolution,
+                                         Read read) {
+        shared_ptr<const vector<double>> &values = entries[make_tuple(chrIdx, norm, unit, resolution)];
+        if (!values) {
+            values = make_shared<const vector<double>>(read());
+        }
+        return values;
+    }
+
+private:
+    map<tuple<int32_t, string, string, int32_t>, shared_ptr<const vector<double>>> entries;
+};
+
 class HiCFile {
 public:
     string prefix = "http"; // HTTP code
@@ -839,6 +879,8 @@ public:
     int64_t nviPosition = 0LL;
     int64_t nviLength = 0LL;
     static int64_t totalFileSize;
+    string fileName;
+    shared_ptr<NormVectorCache> normVectorCache;
 
     static size_t hdf(char *b, size_t size, size_t nitems, void *userdata) {
         size_t numbytes = size * nitems;
@@ -873,6 +915,7 @@ public:
     }
 
     explicit HiCFile(const string &fname) {
+        this->fileName = fname;
 
         // read header into buffer; 100K should be sufficient
         if (std::strncmp(fname.c_str(), prefix.c_str(), prefix.size()) == 0) {
@@ -897,6 +940,7 @@ public:
             chromosomeMap = readHeader(fin, master, genomeID, numChromosomes,
                                        version, nviPosition, nviLength, bpResolutions);
         }
+        normVectorCache = NormVectorCache::forFile(fname, master);
     }
 
     void close(){
@@ -932,8 +976,9 @@ public:
     int64_t myFilePos = 0LL;
     vector<double> expectedValues;
     bool foundFooter = false;
-    vector<double> c1Norm;
-    vector<double> c2Norm;
+    // empty for NONE; for intra matrices both point at the same vector
+    shared_ptr<const vector<double>> c1Norm = make_shared<const vector<double>>();
+    shared_ptr<const vector<double>> c2Norm = c1Norm;
     int32_t c1 = 0;
     int32_t c2 = 0;
     string matrixType;
@@ -989,11 +1034,15 @@ public:
         }
 
         if (norm != "NONE") {
-            c1Norm = hiCFile->readNormalizationVectorFromFooter(c1NormEntry);
+            c1Norm = hiCFile->normVectorCache->get(c1, norm, unit, resolution, [&]() {
+                return hiCFile->readNormalizationVectorFromFooter(c1NormEntry);
+            });
             if (c1 == c2) {
                 c2Norm = c1Norm;
             } else {
-                c2Norm = hiCFile->readNormalizationVectorFromFooter(c2NormEntry);
+                c2Norm = hiCFile->normVectorCache->get(c2, norm, unit, resolution, [&]() {
+                    return hiCFile->readNormalizationVectorFromFooter(c2NormEntry);
+                });
             }
         }
     }
@@ -1081,47 +1130,127 @@ public:
             //cout << blockMap[*it].size << " " <<  blockMap[*it].position << endl;
             vector<contactRecord> tmp_records = readBlock(fileReader->fin, fileReader->curl, fileReader->isHttp,
                                                           blockMap[blockNumber], footer.version);
-            for (contactRecord rec : tmp_records) {
-                int64_t x = rec.binX * footer.resolution;
-                int64_t y = rec.binY * footer.resolution;
-
-                if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
-                     y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
-                    // or check regions that overlap with lower left
-                    (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
-                     x <= origRegionIndices[3])) {
-
-                    float c = rec.counts;
-                    if (footer.norm != "NONE") {
-                        c = static_cast<float>(c / (footer.c1Norm[rec.binX] * footer.c2Norm[rec.binY]));
-                    }
-                    if (footer.matrixType == "oe") {
-                        if (isIntra) {
-                            c = static_cast<float>(c / footer.expectedValues[min(footer.expectedValues.size() - 1,
-                                                                                 (size_t) floor(abs(y - x) /
-                                                                                                footer.resolution))]);
-                        } else {
-                            c = static_cast<float>(c / avgCount);
-                        }
-                    } else if (footer.matrixType == "expected") {
-                        if (isIntra) {
-                            c = static_cast<float>(footer.expectedValues[min(footer.expectedValues.size() - 1,
-                                                                                 (size_t) floor(abs(y - x) /
-                                                                                                footer.resolution))]);
-                        } else {
-                            c = static_cast<float>(avgCount);
-                        }
+            appendRegionRecords(tmp_records, origRegionIndices, footer, records);
+        }
+        return records;
+    }
+
+    // records for several regions ({x0, x1, y0, y1} each, genomic), each as getRecords would return it. blocks are
+    // gathered over all regions first, so a block that several regions need is read and decoded once.
+    vector<vector<contactRecord>>
+    getRecordsForRegions(FileReader *fileReader, const vector<vector<int64_t>> &origRegions, const footerInfo &footer) {
+        vector<vector<contactRecord>> results(origRegions.size());
+        map<int32_t, vector<size_t>> regionsForBlock;
+        for (size_t r = 0; r < origRegions.size(); r++) {
+            int64_t regionIndices[4];
+            for (int32_t k = 0; k < 4; k++) {
+                regionIndices[k] = origRegions[r][k] / footer.resolution;
+            }
+            for (int32_t blockNumber : getBlockNumbers(footer.version, isIntra, regionIndices, blockBinCount,
+                                                       blockColumnCount)) {
+                regionsForBlock[blockNumber].push_back(r);
+            }
+        }
+        for (const auto &entry : regionsForBlock) {
+            auto idx = blockMap.find(entry.first);
+            if (idx == blockMap.end()) continue;
+            vector<contactRecord> blockRecords = readBlock(fileReader->fin, fileReader->curl, fileReader->isHttp,
+                                                           idx->second, footer.version);
+            for (size_t r : entry.second) {
+                appendRegionRecords(blockRecords, origRegions[r].data(), footer, results[r]);
+            }
+        }
+        return results;
+    }
+
+    // adds the (2 * window + 1) x (2 * window + 1) submatrix around each (row bin, column bin) center to sum (row-major,
+    // rows along the first chromosome) and returns how many centers were added; centers whose window runs off the
+    // chromosomes are skipped. each block is read once for all centers.
+    int64_t addPileup(FileReader *fileReader, const vector<pair<int64_t, int64_t>> &centers, int32_t window,
+                      const footerInfo &footer, vector<double> &sum) {
+        const int64_t width = 2 * (int64_t) window + 1;
+        const int32_t resolution = footer.resolution;
+        vector<vector<int64_t>> regions;
+        for (const auto &center : centers) {
+            if (center.first - window < 0 || center.second - window < 0 ||
+                center.first + window > footer.numBins1 || center.second + window > footer.numBins2) {
+                continue;
+            }
+            regions.push_back({(center.first - window) * resolution, (center.first + window) * resolution,
+                               (center.second - window) * resolution, (center.second + window) * resolution});
+        }
+        vector<vector<contactRecord>> records = getRecordsForRegions(fileReader, regions, footer);
+
+        sum.resize(static_cast<size_t>(width * width), 0);
+        for (size_t r = 0; r < regions.size(); r++) {
+            int64_t row0 = regions[r][0] / resolution;
+            int64_t col0 = regions[r][2] / resolution;
+            for (const contactRecord &cr : records[r]) {
+                if (isnan(cr.counts) || isinf(cr.counts)) continue;
+                int64_t x = cr.binX / resolution;
+                int64_t y = cr.binY / resolution;
+                int64_t row = x - row0;
+                int64_t col = y - col0;
+                bool placed = false;
+                if (0 <= row && row < width && 0 <= col && col < width) {
+                    sum[row * width + col] += cr.counts;
+                    placed = true;
+                }
+                // intra records count in both orientations, but only once on the diagonal
+                if (isIntra) {
+                    int64_t row2 = y - row0;
+                    int64_t col2 = x - col0;
+                    if (0 <= row2 && row2 < width && 0 <= col2 && col2 < width && !(placed && row2 == row && col2 == col)) {
+                        sum[row2 * width + col2] += cr.counts;
                     }
+                }
+            }
+        }
+        return static_cast<int64_t>(regions.size());
+    }
 
-                    contactRecord record = contactRecord();
-                    record.binX = static_cast<int32_t>(x);
-                    record.binY = static_cast<int32_t>(y);
-                    record.counts = c;
-                    records.push_back(record);
+    // appends the records of a block that fall in the region (genomic coordinates), normalized
+    void appendRegionRecords(const vector<contactRecord> &blockRecords, const int64_t origRegionIndices[4],
+                             const footerInfo &footer, vector<contactRecord> &records) {
+        for (contactRecord rec : blockRecords) {
+            int64_t x = rec.binX * footer.resolution;
+            int64_t y = rec.binY * footer.resolution;
+
+            if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
+                 y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
+                // or check regions that overlap with lower left
+                (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
+                 x <= origRegionIndices[3])) {
+
+                float c = rec.counts;
+                if (footer.norm != "NONE") {
+                    c = static_cast<float>(c / ((*footer.c1Norm)[rec.binX] * (*footer.c2Norm)[rec.binY]));
                 }
+                if (footer.matrixType == "oe") {
+                    if (isIntra) {
+                        c = static_cast<float>(c / footer.expectedValues[min(footer.expectedValues.size() - 1,
+                                                                             (size_t) floor(abs(y - x) /
+                                                                                            footer.resolution))]);
+                    } else {
+                        c = static_cast<float>(c / avgCount);
+                    }
+                } else if (footer.matrixType == "expected") {
+                    if (isIntra) {
+                        c = static_cast<float>(footer.expectedValues[min(footer.expectedValues.size() - 1,
+                                                                             (size_t) floor(abs(y - x) /
+                                                                                            footer.resolution))]);
+                    } else {
+                        c = static_cast<float>(avgCount);
+                    }
+                }
+
+                contactRecord record = contactRecord();
+                record.binX = static_cast<int32_t>(x);
+                record.binY = static_cast<int32_t>(y);
+                record.counts = c;
+                records.push_back(record);
             }
         }
-        return records;
     }
 };
 
@@ -1173,7 +1302,8 @@ getBlockRecordsWithNormalization(string fname,
                                  int32_t resolution, bool foundFooter, int32_t version, int32_t c1, int32_t c2,
                                  int32_t numBins1, int32_t numBins2, int64_t myFilePos, string unit, string norm,
                                  string matrixType,
-                                 vector<double> c1Norm, vector<double> c2Norm, vector<double> expectedValues) {
+                                 shared_ptr<const vector<double>> c1Norm, shared_ptr<const vector<double>> c2Norm,
+                                 vector<double> expectedValues) {
     int64_t origRegionIndices[4]; // as given by user
     origRegionIndices[0] = c1pos1;
     origRegionIndices[1] = c1pos2;
@@ -1276,6 +1406,187 @@ straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2
     return Rcpp::DataFrame::create(Rcpp::Named("x") = xActual_vec, Rcpp::Named("y") = yActual_vec, Rcpp::Named("counts") = counts_vec);
 }
 
+//' Straw for many regions
+//'
+//' Reads the records for many regions of a .hic file in one call. Returns the same as calling straw for each
+//' pair of chr1loc[i] and chr2loc[i], but the footer and normalization vectors are read once per chromosome pair
+//' and blocks shared between regions are read only once, which is much faster for many small regions.
+//'
+//' @param norm Normalization to apply. Must be one of NONE/VC/VC_SQRT/KR.
+//' @param fname path to .hic file
+//' @param chr1loc vector of first chromosome locations
+//' @param chr2loc vector of second chromosome locations, the same length as chr1loc
+//' @param unit BP (BasePair) or FRAG (FRAGment)
+//' @param binsize The bin size
+//' @param matrix Type of matrix to output. Must be one of observed/oe/expected.
+//' @return List with one data.frame of x,y,counts per region
+//' @examples
+//' strawRegions("NONE", system.file("extdata", "test.hic", package = "strawr"),
+//'              c("1:0:50000000", "1:50000000:100000000"), c("1:0:50000000", "1:50000000:100000000"), "BP", 2500000)
+//' @export
+// [[Rcpp::export]]
+Rcpp::List
+strawRegions(std::string norm, std::string fname, std::vector<std::string> chr1loc, std::vector<std::string> chr2loc,
+             const std::string &unit, int32_t binsize, std::string matrix = "observed") {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        Rcpp::stop("Norm specified incorrectly, must be one of <BP/FRAG>.");
+    }
+    if (chr1loc.size() != chr2loc.size()) {
+        Rcpp::stop("chr1loc and chr2loc must have the same length.");
+    }
+
+    HiCFile *hiCFile = new HiCFile(fname);
+
+    // group the regions by chromosome pair so that each matrix is set up once
+    map<pair<string, string>, pair<vector<vector<int64_t>>, vector<size_t>>> regionsForPair;
+    for (size_t i = 0; i < chr1loc.size(); i++) {
+        string chr1, chr2;
+        int64_t c1pos1 = -100LL, c1pos2 = -100LL, c2pos1 = -100LL, c2pos2 = -100LL;
+        parsePositions(chr1loc[i], chr1, c1pos1, c1pos2, hiCFile->chromosomeMap);
+        parsePositions(chr2loc[i], chr2, c2pos1, c2pos2, hiCFile->chromosomeMap);
+        vector<int64_t> region;
+        if (hiCFile->chromosomeMap[chr1].index > hiCFile->chromosomeMap[chr2].index) {
+            swap(chr1, chr2);
+            region = {c2pos1, c2pos2, c1pos1, c1pos2};
+        } else {
+            region = {c1pos1, c1pos2, c2pos1, c2pos2};
+        }
+        auto &entry = regionsForPair[make_pair(chr1, chr2)];
+        entry.first.push_back(region);
+        entry.second.push_back(i);
+    }
+    hiCFile->close();
+
+    vector<vector<contactRecord>> records(chr1loc.size());
+    for (const auto &pairRegions : regionsForPair) {
+        footerInfo footer = getNormalizationInfoForRegion(fname, pairRegions.first.first, pairRegions.first.second,
+                                                          matrix, norm, unit, binsize);
+        if (!footer.foundFooter) continue;
+        FileReader *fileReader = new FileReader(fname);
+        BlocksRecords *blocksRecords = new BlocksRecords(fileReader, footer);
+        vector<vector<contactRecord>> pairRecords = blocksRecords->getRecordsForRegions(fileReader,
+                                                                                         pairRegions.second.first,
+                                                                                         footer);
+        for (size_t k = 0; k < pairRecords.size(); k++) {
+            records[pairRegions.second.second[k]] = std::move(pairRecords[k]);
+        }
+        fileReader->close();
+        delete blocksRecords;
+        delete fileReader;
+    }
+
+    Rcpp::List frames(records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        vector<int32_t> xActual_vec, yActual_vec;
+        vector<float> counts_vec;
+        for (const contactRecord &record : records[i]) {
+            xActual_vec.push_back(record.binX);
+            yActual_vec.push_back(record.binY);
+            counts_vec.push_back(record.counts);
+        }
+        frames[i] = Rcpp::DataFrame::create(Rcpp::Named("x") = xActual_vec, Rcpp::Named("y") = yActual_vec,
+                                            Rcpp::Named("counts") = counts_vec);
+    }
+    return frames;
+}
+
+// the name the file uses for a chromosome, trying it with and without a "chr" prefix; empty if it isn't there
+string findChromosomeName(const map<string, chromosome> &chromosomeMap, const string &name) {
+    if (chromosomeMap.count(name)) {
+        return name;
+    }
+    string other = name.compare(0, 3, "chr") == 0 ? name.substr(3) : "chr" + name;
+    if (chromosomeMap.count(other)) {
+        return other;
+    }
+    return "";
+}
+
+//' Aggregate peak analysis
+//'
+//' Sums the (2 * window + 1) x (2 * window + 1) matrices centered on the anchor midpoints of each loop into
+//' one matrix (APA). Every block is read once however many loops it covers. Loops whose window runs off a
+//' chromosome, or whose chromosomes are not in the file, are skipped.
+//'
+//' @param norm Normalization to apply. Must be one of NONE/VC/VC_SQRT/KR.
+//' @param fname path to .hic file
+//' @param loops data.frame with the first six columns of a BEDPE file: chr1, x1, x2, chr2, y1, y2
+//' @param window number of bins on each side of the loop center
+//' @param unit BP (BasePair) or FRAG (FRAGment)
+//' @param binsize The bin size
+//' @param matrix Type of matrix to output. Must be one of observed/oe/expected.
+//' @param average If TRUE, the mean over the loops; otherwise the sum
+//' @return Numeric matrix with rows along the first anchor
+//' @examples
+//' loops <- data.frame(chr1 = "1", x1 = 50000000, x2 = 50010000, chr2 = "1", y1 = 60000000, y2 = 60010000)
+//' strawPileup("NONE", system.file("extdata", "test.hic", package = "strawr"), loops, 2, "BP", 2500000)
+//' @export
+// [[Rcpp::export]]
+Rcpp::NumericMatrix
+strawPileup(std::string norm, std::string fname, Rcpp::DataFrame loops, int32_t window, const std::string &unit,
+            int32_t binsize, std::string matrix = "observed", bool average = true) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        Rcpp::stop("Norm specified incorrectly, must be one of <BP/FRAG>.");
+    }
+    if (window < 0 || binsize <= 0) {
+        Rcpp::stop("window and binsize must be positive.");
+    }
+    if (loops.size() < 6) {
+        Rcpp::stop("loops must have the six BEDPE columns chr1, x1, x2, chr2, y1, y2.");
+    }
+    std::vector<std::string> chr1s = Rcpp::as<std::vector<std::string>>(loops[0]);
+    std::vector<double> x1 = Rcpp::as<std::vector<double>>(loops[1]);
+    std::vector<double> x2 = Rcpp::as<std::vector<double>>(loops[2]);
+    std::vector<std::string> chr2s = Rcpp::as<std::vector<std::string>>(loops[3]);
+    std::vector<double> y1 = Rcpp::as<std::vector<double>>(loops[4]);
+    std::vector<double> y2 = Rcpp::as<std::vector<double>>(loops[5]);
+
+    HiCFile *hiCFile = new HiCFile(fname);
+
+    // loop centers in bins, grouped by chromosome pair with the lower-index chromosome first; intra loops are put
+    // above the diagonal
+    map<pair<string, string>, vector<pair<int64_t, int64_t>>> centersForPair;
+    for (size_t i = 0; i < chr1s.size(); i++) {
+        string chr1 = findChromosomeName(hiCFile->chromosomeMap, chr1s[i]);
+        string chr2 = findChromosomeName(hiCFile->chromosomeMap, chr2s[i]);
+        if (chr1.empty() || chr2.empty()) continue;
+        int64_t center1 = ((int64_t) x1[i] + (int64_t) x2[i]) / 2 / binsize;
+        int64_t center2 = ((int64_t) y1[i] + (int64_t) y2[i]) / 2 / binsize;
+        int32_t index1 = hiCFile->chromosomeMap[chr1].index;
+        int32_t index2 = hiCFile->chromosomeMap[chr2].index;
+        if (index1 > index2 || (index1 == index2 && center1 > center2)) {
+            swap(chr1, chr2);
+            swap(center1, center2);
+        }
+        centersForPair[make_pair(chr1, chr2)].emplace_back(center1, center2);
+    }
+    hiCFile->close();
+
+    const int64_t width = 2 * (int64_t) window + 1;
+    vector<double> sum(static_cast<size_t>(width * width), 0);
+    int64_t numLoops = 0;
+    for (const auto &pairCenters : centersForPair) {
+        footerInfo footer = getNormalizationInfoForRegion(fname, pairCenters.first.first, pairCenters.first.second,
+                                                          matrix, norm, unit, binsize);
+        if (!footer.foundFooter) continue;
+        FileReader *fileReader = new FileReader(fname);
+        BlocksRecords *blocksRecords = new BlocksRecords(fileReader, footer);
+        numLoops += blocksRecords->addPileup(fileReader, pairCenters.second, window, footer, sum);
+        fileReader->close();
+        delete blocksRecords;
+        delete fileReader;
+    }
+
+    double scale = average && numLoops > 0 ? 1.0 / numLoops : 1.0;
+    Rcpp::NumericMatrix result(width, width);
+    for (int64_t i = 0; i < width; i++) {
+        for (int64_t j = 0; j < width; j++) {
+            result(i, j) = sum[i * width + j] * scale;
+        }
+    }
+    return result;
+}
+
 vector<chromosome> getChromosomes(string fname){
     HiCFile *hiCFile = new HiCFile(std::move(fname));
     vector<chromosome> chromosomes;
@@ -1448,3 +1759,45 @@ Rcpp::CharacterVector readHicNormTypes(std::string fname)
     hiCFile->close();
     return normTypes;
 }
+
+// chromosome keys as an R factor (keys start at 0, factor codes at 1)
+Rcpp::IntegerVector sliceKeysToFactor(const vector<int16_t> &keys, const Rcpp::CharacterVector &names) {
+    Rcpp::IntegerVector codes(keys.size());
+    transform(keys.begin(), keys.end(), codes.begin(), [](int16_t key) { return key + 1; });
+    codes.attr("levels") = names;
+    codes.attr("class") = "factor";
+    return codes;
+}
+
+//' Read a hic_slice file
+//'
+//' Reads the records of a slice file written by \code{straw dump}. Records are decompressed and parsed in large
+//' batches on a background thread straight into columns. Given a chromosome pair (in either order), only the
+//' records of that pair are returned, and for version 2 and 3 files only its chunks are read.
+//'
+//' @param fname path to .slc file
+//' @param chr1 first chromosome of the pair to read; empty for all pairs
+//' @param chr2 second chromosome of the pair to read; empty for all pairs
+//' @return Data frame of contact records with chromosome factors chr1 and chr2, binX, binY and counts
+//' @export
+// [[Rcpp::export]]
+Rcpp::DataFrame readHicSlice(std::string fname, std::string chr1 = "", std::string chr2 = "") {
+    HicSliceReader reader(fname, chr1, chr2);
+    if (!reader.isOpen()) {
+        Rcpp::stop("Could not read slice file: " + reader.getError());
+    }
+    HicSliceColumns columns = reader.readAll();
+    if (!reader.getError().empty()) {
+        Rcpp::stop("Could not read slice file: " + reader.getError());
+    }
+    Rcpp::CharacterVector names(reader.getHeader().numChromosomes);
+    for (int32_t i = 0; i < reader.getHeader().numChromosomes; i++) {
+        names[i] = reader.getChromosomeName(static_cast<int16_t>(i));
+    }
+    return Rcpp::DataFrame::create(Rcpp::Named("chr1") = sliceKeysToFactor(columns.chr1Key, names),
+                                   Rcpp::Named("binX") = Rcpp::IntegerVector(columns.binX.begin(), columns.binX.end()),
+                                   Rcpp::Named("chr2") = sliceKeysToFactor(columns.chr2Key, names),
+                                   Rcpp::Named("binY") = Rcpp::IntegerVector(columns.binY.begin(), columns.binY.end()),
+                                   Rcpp::Named("counts") = Rcpp::NumericVector(columns.counts.begin(),
+                                                                               columns.counts.end()));
+}
@@ -28,6 +28,7 @@
 #include <set>
 #include <vector>
 #include <map>
+#include <memory>
 
 // pointer structure for reading blocks or matrices, holds the size and position
 struct indexEntry {
@@ -54,8 +55,8 @@ struct footerInfo {
     std::string unit;
     std::string norm;
     std::string matrixType;
-    std::vector<double> c1Norm;
-    std::vector<double> c2Norm;
+    std::shared_ptr<const std::vector<double>> c1Norm;
+    std::shared_ptr<const std::vector<double>> c2Norm;
     std::vector<double> expectedValues;
 };
 
@@ -29,7 +29,9 @@ class GetPybindInclude(object):
 ext_modules = [
     Extension(
         'hicstraw',
-        ['src/straw.cpp'],
+        ['src/straw.cpp', 'src/hic_slice.cpp'],
+        # the package only reads slice files
+        define_macros=[('HIC_SLICE_NO_WRITER', None)],
         include_dirs=[
             # Path to pybind11 headers
             GetPybindInclude(),
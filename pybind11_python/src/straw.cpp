@@ -34,8 +34,14 @@
 #include <curl/curl.h>
 #include <iterator>
 #include <algorithm>
+#include <thread>
+#include <tuple>
+#include <memory>
+#include <stdexcept>
+#include <mutex>
 #include "zlib.h"
 #include "straw.h"
+#include "hic_slice.h"
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
@@ -1184,6 +1190,65 @@ vector<double> readNormalizationVector(istream &bufferin, int32_t version) {
     return values;
 }
 
+vector<double> readNormalizationVectorFromFooter(indexEntry cNormEntry, int32_t version, const string &fileName) {
+    char *buffer = readCompressedBytesFromFile(fileName, cNormEntry);
+    memstream bufferin(buffer, cNormEntry.size);
+    vector<double> cNorm = readNormalizationVector(bufferin, version);
+    delete buffer;
+    return cNorm;
+}
+
+// normalization vectors of one file keyed by (chromosome, norm, unit, resolution). every HiCFile and MatrixZoomData
+// open on the same file shares one cache, so each vector is read once while they are in use and then handed out
+// without copying. the file is identified by its name and master index position, so a file rewritten at the same path
+// gets a new cache, and a cache is released with the last object holding it.
+class NormVectorCache {
+public:
+    static shared_ptr<NormVectorCache> forFile(const string &fileName, int64_t master) {
+        static mutex registryMutex;
+        static map<pair<string, int64_t>, weak_ptr<NormVectorCache>> registry;
+        lock_guard<mutex> lock(registryMutex);
+        for (auto it = registry.begin(); it != registry.end();) {
+            it = it->second.expired() ? registry.erase(it) : next(it);
+        }
+        weak_ptr<NormVectorCache> &slot = registry[make_pair(fileName, master)];
+        shared_ptr<NormVectorCache> cache = slot.lock();
+        if (!cache) {
+            cache = make_shared<NormVectorCache>();
+            slot = cache;
+        }
+        return cache;
+    }
+
+    // the vector stored at cNormEntry, read on the first request for its key
+    shared_ptr<const vector<double>> get(int32_t chrIdx, const string &norm, const string &unit, int32_t resolution,
+                                         indexEntry cNormEntry, int32_t version, const string &fileName) {
+        shared_ptr<Entry> entry;
+        {
+            lock_guard<mutex> lock(entriesMutex);
+            shared_ptr<Entry> &slot = entries[make_tuple(chrIdx, norm, unit, resolution)];
+            if (!slot) {
+                slot = make_shared<Entry>();
+            }
+            entry = slot;
+        }
+        // read outside the lock so different vectors load concurrently
+        call_once(entry->loaded, [&]() {
+            entry->values = make_shared<const vector<double>>(
+                    readNormalizationVectorFromFooter(cNormEntry, version, fileName));
+        });
+        return entry->values;
+    }
+
+private:
+    struct Entry {
+        once_flag loaded;
+        shared_ptr<const vector<double>> values;
+    };
+    mutex entriesMutex;
+    map<tuple<int32_t, string, string, int32_t>, shared_ptr<Entry>> entries;
+};
+
 class MatrixZoomData {
 public:
     bool isIntra;
@@ -1191,8 +1256,9 @@ public:
     int64_t myFilePos = 0LL;
     vector<double> expectedValues;
     bool foundFooter = false;
-    vector<double> c1Norm;
-    vector<double> c2Norm;
+    // empty for NONE; for intra matrices both point at the same vector
+    shared_ptr<const vector<double>> c1Norm = make_shared<const vector<double>>();
+    shared_ptr<const vector<double>> c2Norm = c1Norm;
     int32_t c1 = 0;
     int32_t c2 = 0;
     string matrixType;
@@ -1209,7 +1275,10 @@ public:
     MatrixZoomData(const chromosome &chrom1, const chromosome &chrom2, const string &matrixType,
                    const string &norm, const string &unit, int32_t resolution,
                    int32_t &version, int64_t &master, int64_t &totalFileSize,
-                   const string &fileName) {
+                   const string &fileName, shared_ptr<NormVectorCache> normVectorCache = nullptr) {
+        if (!normVectorCache) {
+            normVectorCache = NormVectorCache::forFile(fileName, master);
+        }
         this->version = version;
         this->fileName = fileName;
         int32_t c01 = chrom1.index;
@@ -1253,11 +1322,11 @@ public:
         stream->close();
 
         if (norm != "NONE") {
-            c1Norm = readNormalizationVectorFromFooter(c1NormEntry, version, fileName);
+            c1Norm = normVectorCache->get(c1, norm, unit, resolution, c1NormEntry, version, fileName);
             if (isIntra) {
                 c2Norm = c1Norm;
             } else {
-                c2Norm = readNormalizationVectorFromFooter(c2NormEntry, version, fileName);
+                c2Norm = normVectorCache->get(c2, norm, unit, resolution, c2NormEntry, version, fileName);
             }
         }
 
@@ -1280,15 +1349,6 @@ public:
         }
     }
 
-    static vector<double> readNormalizationVectorFromFooter(indexEntry cNormEntry, int32_t &version,
-                                                            const string &fileName) {
-        char *buffer = readCompressedBytesFromFile(fileName, cNormEntry);
-        memstream bufferin(buffer, cNormEntry.size);
-        vector<double> cNorm = readNormalizationVector(bufferin, version);
-        delete buffer;
-        return cNorm;
-    }
-
     static bool isInRange(int32_t r, int32_t c, int32_t numRows, int32_t numCols) {
         return 0 <= r && r < numRows && 0 <= c && c < numCols;
     }
@@ -1303,9 +1363,9 @@ public:
 
     auto getNormVector(int32_t index) {
         if (index == c1) {
-            return py::array(py::cast(c1Norm));
+            return py::array(py::cast(*c1Norm));
         } else if (index == c2) {
-            return py::array(py::cast(c2Norm));
+            return py::array(py::cast(*c2Norm));
         }
         cerr << "Invalid index provided: " << index << endl;
         cerr << "Should be either " << c1 << " or " << c2 << endl;
@@ -1333,49 +1393,171 @@ public:
             //cout << *it << " -- " << blockMap.size() << endl;
             //cout << blockMap[*it].size << " " <<  blockMap[*it].position << endl;
             vector<contactRecord> tmp_records = readBlock(fileName, blockMap[blockNumber], version);
-            for (contactRecord rec : tmp_records) {
-                int64_t x = rec.binX * resolution;
-                int64_t y = rec.binY * resolution;
-
-                if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
-                     y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
-                    // or check regions that overlap with lower left
-                    (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
-                     x <= origRegionIndices[3])) {
-
-                    float c = rec.counts;
-                    if (norm != "NONE") {
-                        c = static_cast<float>(c / (c1Norm[rec.binX] * c2Norm[rec.binY]));
+            appendRegionRecords(tmp_records, origRegionIndices, records);
+        }
+        return records;
+    }
+
+    // records for several regions ([x0, x1, y0, y1] each, as for getRecords), each as getRecords would return it.
+    // blocks are gathered over all regions first, so a block that several regions need is read and decoded once.
+    vector<vector<contactRecord>> getRecordsForRegions(const vector<vector<int64_t>> &regions) {
+        vector<vector<contactRecord>> results(regions.size());
+        if (!foundFooter) {
+            return results;
+        }
+        map<int32_t, vector<size_t>> regionsForBlock;
+        for (size_t r = 0; r < regions.size(); r++) {
+            if (regions[r].size() != 4) {
+                cerr << "Region " << r << " should be [x0, x1, y0, y1]" << endl;
+                continue;
+            }
+            int64_t regionIndices[4];
+            convertGenomeToBinPos(regions[r].data(), regionIndices, resolution);
+            for (int32_t blockNumber : getBlockNumbers(regionIndices)) {
+                regionsForBlock[blockNumber].push_back(r);
+            }
+        }
+        for (const auto &entry : regionsForBlock) {
+            auto idx = blockMap.find(entry.first);
+            if (idx == blockMap.end()) continue;
+            vector<contactRecord> blockRecords = readBlock(fileName, idx->second, version);
+            for (size_t r : entry.second) {
+                appendRegionRecords(blockRecords, regions[r].data(), results[r]);
+            }
+        }
+        return results;
+    }
+
+    // adds the (2 * window + 1) x (2 * window + 1) submatrix around each (row bin, column bin) center to sum (row-major,
+    // rows along the first chromosome) and returns how many centers were added; centers whose window runs off the
+    // chromosomes are skipped. each block is read once for all centers, and each thread sums its share of the blocks
+    // into its own matrix before the partial sums are added together.
+    int64_t addPileup(const vector<pair<int64_t, int64_t>> &centers, int32_t window, vector<double> &sum) {
+        const int64_t width = 2 * (int64_t) window + 1;
+        if (!foundFooter || window < 0) {
+            return 0;
+        }
+        vector<vector<int64_t>> regions;
+        map<int32_t, vector<size_t>> regionsForBlock;
+        for (const auto &center : centers) {
+            if (center.first - window < 0 || center.second - window < 0 ||
+                center.first + window > numBins1 || center.second + window > numBins2) {
+                continue;
+            }
+            vector<int64_t> region = {(center.first - window) * resolution, (center.first + window) * resolution,
+                                      (center.second - window) * resolution, (center.second + window) * resolution};
+            int64_t regionIndices[4];
+            convertGenomeToBinPos(region.data(), regionIndices, resolution);
+            for (int32_t blockNumber : getBlockNumbers(regionIndices)) {
+                regionsForBlock[blockNumber].push_back(regions.size());
+            }
+            regions.push_back(region);
+        }
+        vector<pair<indexEntry, vector<size_t>>> blocks;
+        for (const auto &entry : regionsForBlock) {
+            auto idx = blockMap.find(entry.first);
+            if (idx != blockMap.end()) {
+                blocks.emplace_back(idx->second, entry.second);
+            }
+        }
+
+        unsigned int numThreads = max(1u, min(thread::hardware_concurrency(), static_cast<unsigned int>(blocks.size())));
+        vector<vector<double>> partials(numThreads, vector<double>(static_cast<size_t>(width * width), 0));
+        vector<thread> threads;
+        for (unsigned int t = 0; t < numThreads; t++) {
+            threads.emplace_back([this, t, numThreads, width, &blocks, &regions, &partials]() {
+                for (size_t b = t; b < blocks.size(); b += numThreads) {
+                    vector<contactRecord> blockRecords = readBlock(fileName, blocks[b].first, version);
+                    for (size_t r : blocks[b].second) {
+                        vector<contactRecord> records;
+                        appendRegionRecords(blockRecords, regions[r].data(), records);
+                        addToPileup(records, regions[r][0] / resolution, regions[r][2] / resolution, width,
+                                    partials[t]);
                     }
-                    if (matrixType == "oe") {
-                        if (isIntra) {
-                            c = static_cast<float>(c / expectedValues[min(expectedValues.size() - 1,
-                                                                          (size_t) floor(abs(y - x) /
-                                                                                         resolution))]);
-                        } else {
-                            c = static_cast<float>(c / avgCount);
-                        }
-                    } else if (matrixType == "expected") {
-                        if (isIntra) {
-                            c = static_cast<float>(expectedValues[min(expectedValues.size() - 1,
+                }
+            });
+        }
+        for (thread &t : threads) {
+            t.join();
+        }
+
+        sum.resize(static_cast<size_t>(width * width), 0);
+        for (const vector<double> &partial : partials) {
+            for (size_t i = 0; i < sum.size(); i++) {
+                sum[i] += partial[i];
+            }
+        }
+        return static_cast<int64_t>(regions.size());
+    }
+
+    // adds records (genomic) to a width x width matrix whose first cell is bin (row0, col0); intra records are added in
+    // both orientations, as getRecordsAsMatrix places them, but only once when both land on the same cell
+    void addToPileup(const vector<contactRecord> &records, int64_t row0, int64_t col0, int64_t width,
+                     vector<double> &matrix) const {
+        for (const contactRecord &cr : records) {
+            int64_t x = cr.binX / resolution;
+            int64_t y = cr.binY / resolution;
+            int64_t r = x - row0;
+            int64_t c = y - col0;
+            bool placed = false;
+            if (0 <= r && r < width && 0 <= c && c < width) {
+                matrix[r * width + c] += cr.counts;
+                placed = true;
+            }
+            if (isIntra) {
+                int64_t r2 = y - row0;
+                int64_t c2 = x - col0;
+                if (0 <= r2 && r2 < width && 0 <= c2 && c2 < width && !(placed && r2 == r && c2 == c)) {
+                    matrix[r2 * width + c2] += cr.counts;
+                }
+            }
+        }
+    }
+
+    // appends the records of a block that fall in the region (genomic coordinates), normalized
+    void appendRegionRecords(const vector<contactRecord> &blockRecords, const int64_t *origRegionIndices,
+                             vector<contactRecord> &records) const {
+        for (contactRecord rec : blockRecords) {
+            int64_t x = rec.binX * resolution;
+            int64_t y = rec.binY * resolution;
+
+            if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
+                 y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
+                // or check regions that overlap with lower left
+                (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
+                 x <= origRegionIndices[3])) {
+
+                float c = rec.counts;
+                if (norm != "NONE") {
+                    c = static_cast<float>(c / ((*c1Norm)[rec.binX] * (*c2Norm)[rec.binY]));
+                }
+                if (matrixType == "oe") {
+                    if (isIntra) {
+                        c = static_cast<float>(c / expectedValues[min(expectedValues.size() - 1,
                                                                       (size_t) floor(abs(y - x) /
                                                                                      resolution))]);
-                        } else {
-                            c = static_cast<float>(avgCount);
-                        }
+                    } else {
+                        c = static_cast<float>(c / avgCount);
                     }
-
-                    if (!isnan(c) && !isinf(c)){
-                        contactRecord record = contactRecord();
-                        record.binX = static_cast<int32_t>(x);
-                        record.binY = static_cast<int32_t>(y);
-                        record.counts = c;
-                        records.push_back(record);
+                } else if (matrixType == "expected") {
+                    if (isIntra) {
+                        c = static_cast<float>(expectedValues[min(expectedValues.size() - 1,
+                                                                  (size_t) floor(abs(y - x) /
+                                                                                 resolution))]);
+                    } else {
+                        c = static_cast<float>(avgCount);
                     }
                 }
+
+                if (!isnan(c) && !isinf(c)){
+                    contactRecord record = contactRecord();
+                    record.binX = static_cast<int32_t>(x);
+                    record.binY = static_cast<int32_t>(y);
+                    record.counts = c;
+                    records.push_back(record);
+                }
             }
         }
-        return records;
     }
 
     auto getRecordsAsMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) {
@@ -1445,6 +1627,7 @@ public:
     vector<int32_t> resolutions;
     static int64_t totalFileSize;
     string fileName;
+    shared_ptr<NormVectorCache> normVectorCache;
 
     static size_t hdf(char *b, size_t size, size_t nitems, void *userdata) {
         size_t numbytes = size * nitems;
@@ -1500,6 +1683,7 @@ public:
             resolutions = readResolutionsFromHeader(fin);
             fin.close();
         }
+        this->normVectorCache = NormVectorCache::forFile(fileName, master);
     }
 
     string getGenomeID() const {
@@ -1532,7 +1716,7 @@ public:
         chromosome chrom1 = chromosomeMap[chr1];
         chromosome chrom2 = chromosomeMap[chr2];
         return new MatrixZoomData(chrom1, chrom2, (matrixType), (norm), (unit),
-                                  resolution, version, master, totalFileSize, fileName);
+                                  resolution, version, master, totalFileSize, fileName, normVectorCache);
     }
 };
 
@@ -1606,6 +1790,89 @@ auto strawAsMatrix(const string &matrixType, const string &norm, const string &f
     }
 }
 
+// the name the file uses for a chromosome, trying it with and without a "chr" prefix; empty if it isn't there
+string findChromosomeName(const map<string, chromosome> &chromosomeMap, const string &name) {
+    if (chromosomeMap.count(name)) {
+        return name;
+    }
+    string other = name.compare(0, 3, "chr") == 0 ? name.substr(3) : "chr" + name;
+    if (chromosomeMap.count(other)) {
+        return other;
+    }
+    return "";
+}
+
+// aggregate peak analysis over loops given as (chr1, start1, end1, chr2, start2, end2): the sum, or with average the
+// mean, of the (2 * window + 1) x (2 * window + 1) submatrices centered on the anchor midpoints. loops whose window runs
+// off a chromosome, or whose chromosomes aren't in the file, are skipped.
+auto pileup(const string &matrixType, const string &norm, const string &fileName,
+            const vector<tuple<string, int64_t, int64_t, string, int64_t, int64_t>> &loops, int32_t window,
+            const string &unit, int32_t binsize, bool average) {
+    vector<vector<double>> matrix;
+    if (window < 0 || binsize <= 0) {
+        cerr << "Window and bin size must be positive" << endl;
+        return py::array(py::cast(matrix));
+    }
+    HiCFile *hiCFile = new HiCFile(fileName);
+
+    // loop centers in bins, grouped by chromosome pair with the lower-index chromosome first; intra loops are put
+    // above the diagonal
+    map<pair<string, string>, vector<pair<int64_t, int64_t>>> centersForPair;
+    for (const auto &loop : loops) {
+        string chr1 = findChromosomeName(hiCFile->chromosomeMap, get<0>(loop));
+        string chr2 = findChromosomeName(hiCFile->chromosomeMap, get<3>(loop));
+        if (chr1.empty() || chr2.empty()) continue;
+        int64_t center1 = (get<1>(loop) + get<2>(loop)) / 2 / binsize;
+        int64_t center2 = (get<4>(loop) + get<5>(loop)) / 2 / binsize;
+        int32_t index1 = hiCFile->chromosomeMap[chr1].index;
+        int32_t index2 = hiCFile->chromosomeMap[chr2].index;
+        if (index1 > index2 || (index1 == index2 && center1 > center2)) {
+            swap(chr1, chr2);
+            swap(center1, center2);
+        }
+        centersForPair[make_pair(chr1, chr2)].emplace_back(center1, center2);
+    }
+
+    const int64_t width = 2 * (int64_t) window + 1;
+    vector<double> sum(static_cast<size_t>(width * width), 0);
+    int64_t numLoops = 0;
+    for (const auto &pairCenters : centersForPair) {
+        MatrixZoomData *mzd = hiCFile->getMatrixZoomData(pairCenters.first.first, pairCenters.first.second,
+                                                         matrixType, norm, unit, binsize);
+        numLoops += mzd->addPileup(pairCenters.second, window, sum);
+        delete mzd;
+    }
+    delete hiCFile;
+
+    double scale = average && numLoops > 0 ? 1.0 / numLoops : 1.0;
+    for (int64_t i = 0; i < width; i++) {
+        matrix.emplace_back(sum.begin() + i * width, sum.begin() + (i + 1) * width);
+        for (double &value : matrix.back()) {
+            value *= scale;
+        }
+    }
+    return py::array(py::cast(matrix));
+}
+
+// a numpy array taking over the memory of the vector, so the columns are not copied
+template <typename T>
+py::array_t<T> moveToNumpy(vector<T> &values) {
+    auto *owner = new vector<T>(move(values));
+    py::capsule release(owner, [](void *p) { delete reinterpret_cast<vector<T> *>(p); });
+    return py::array_t<T>(owner->size(), owner->data(), release);
+}
+
+// a batch of slice records as a dict of numpy columns
+py::dict sliceColumnsToDict(HicSliceColumns &columns) {
+    py::dict result;
+    result["chr1Key"] = moveToNumpy(columns.chr1Key);
+    result["binX"] = moveToNumpy(columns.binX);
+    result["chr2Key"] = moveToNumpy(columns.chr2Key);
+    result["binY"] = moveToNumpy(columns.binY);
+    result["counts"] = moveToNumpy(columns.counts);
+    return result;
+}
+
 int64_t getNumRecordsForFile(const string &fileName, int32_t binsize, bool interOnly) {
     HiCFile *hiCFile = new HiCFile(fileName);
     int64_t totalNumRecords = 0;
@@ -1639,6 +1906,9 @@ m.doc() = "Fast tool for reading .hic files; see https://github.com/aidenlab/str
 m.def("strawC", &straw, "get contact records");
 m.def("straw", &straw, "get contact records");
 m.def("strawAsMatrix", &strawAsMatrix, "get contact records in numpy matrix");
+m.def("pileup", &pileup, "aggregate (APA) numpy matrix over a list of loops",
+      py::arg("matrixType"), py::arg("norm"), py::arg("fileName"), py::arg("loops"), py::arg("window"),
+      py::arg("unit"), py::arg("binsize"), py::arg("average") = true);
 
 py::class_<contactRecord>(m, "contactRecord")
 .def(py::init<>())
@@ -1660,11 +1930,50 @@ py::class_<MatrixZoomData>(m, "MatrixZoomData")
 .def(py::init<chromosome &, chromosome &, string &, string &, string &, int32_t, int32_t &, int64_t &, int64_t &, string &>())
 .def("getRecords", &MatrixZoomData::getRecords)
 .def("getRecordsAsMatrix", &MatrixZoomData::getRecordsAsMatrix)
+.def("getRecordsForRegions", &MatrixZoomData::getRecordsForRegions)
 .def("getNormVector", &MatrixZoomData::getNormVector)
 .def("getExpectedValues", &MatrixZoomData::getExpectedValues)
 ;
 
 
+py::class_<HicSliceReader>(m, "HicSliceReader")
+.def(py::init([](const string &fileName, const string &chr1, const string &chr2) {
+    unique_ptr<HicSliceReader> reader(new HicSliceReader(fileName, chr1, chr2));
+    if (!reader->isOpen()) {
+        throw std::runtime_error("Could not read slice file: " + reader->getError());
+    }
+    return reader;
+}), py::arg("fileName"), py::arg("chr1") = "", py::arg("chr2") = "")
+.def("getResolution", [](const HicSliceReader &reader) { return reader.getHeader().resolution; })
+.def("getChromosomeKeys", [](const HicSliceReader &reader) { return reader.getHeader().chromosomeKeys; })
+.def("getChromosomeName", &HicSliceReader::getChromosomeName)
+.def("readBatch", [](HicSliceReader &reader) -> py::object {
+    HicSliceColumns batch;
+    bool found;
+    {
+        py::gil_scoped_release release;
+        found = reader.readBatch(batch);
+    }
+    if (!found && !reader.getError().empty()) {
+        throw std::runtime_error("Could not read slice file: " + reader.getError());
+    }
+    if (!found) return py::none();
+    return sliceColumnsToDict(batch);
+})
+.def("readAll", [](HicSliceReader &reader) {
+    HicSliceColumns all;
+    {
+        py::gil_scoped_release release;
+        all = reader.readAll();
+    }
+    if (!reader.getError().empty()) {
+        throw std::runtime_error("Could not read slice file: " + reader.getError());
+    }
+    return sliceColumnsToDict(all);
+})
+;
+
+
 py::class_<HiCFile>(m, "HiCFile")
 .def(py::init<string>())
 .def("getChromosomes", &HiCFile::getChromosomes)